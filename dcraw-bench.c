@@ -0,0 +1,116 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * dcraw-bench.c - Measure the raw decoding throughput.
+ * Copyright 2026 by the UFRaw developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Usage: dcraw-bench [-r rounds] file...
+ *
+ * Every file is decoded once to warm up the caches and then 'rounds'
+ * times more. For each file the camera and the best time are reported,
+ * as MB/s of the file and as Mpix/s of the raw image, followed by the
+ * totals. Use one file per camera format of interest.
+ */
+
+#include "ufraw.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>    /* for getopt */
+#include <sys/stat.h>
+
+char *ufraw_binary;
+
+void ufraw_messenger(char *message, void *parentWindow)
+{
+    (void)parentWindow;
+    ufraw_batch_messenger(message);
+}
+
+/* Decode filename, filling in the camera and the raw size. Returns the
+ * time it took in seconds, or a negative value if it failed. */
+static double decode(char *filename, char *camera, int size, double *pixels)
+{
+    dcraw_data raw;
+    GTimer *timer = g_timer_new();
+    double seconds = -1;
+
+    int status = dcraw_open(&raw, filename);
+    if (status != DCRAW_SUCCESS && status != DCRAW_WARNING) {
+        ufraw_message(UFRAW_ERROR, "%s", raw.message);
+        g_timer_destroy(timer);
+        return -1;
+    }
+    status = dcraw_load_raw(&raw);
+    if (status == DCRAW_SUCCESS || status == DCRAW_WARNING) {
+        seconds = g_timer_elapsed(timer, NULL);
+        g_snprintf(camera, size, "%s %s", raw.make, raw.model);
+        *pixels = (double)raw.width * raw.height;
+    } else {
+        ufraw_message(UFRAW_ERROR, "%s", raw.message);
+    }
+    dcraw_close(&raw);
+    g_timer_destroy(timer);
+    return seconds;
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = 5;
+    int i, r, opt;
+    double totalBytes = 0, totalPixels = 0, totalSeconds = 0;
+
+#if !GLIB_CHECK_VERSION(2,31,0)
+    g_thread_init(NULL);
+#endif
+    ufraw_binary = g_path_get_basename(argv[0]);
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        if (opt == 'r')
+            rounds = MAX(atoi(optarg), 1);
+        else {
+            g_printerr("Usage: %s [-r rounds] file...\n", ufraw_binary);
+            return 1;
+        }
+    }
+    if (optind == argc) {
+        g_printerr("Usage: %s [-r rounds] file...\n", ufraw_binary);
+        return 1;
+    }
+    g_print("%-32s %-24s %8s %8s %8s\n", "File", "Camera", "ms", "MB/s",
+            "Mpix/s");
+    for (i = optind; i < argc; i++) {
+        char camera[max_name];
+        double pixels = 0, best = -1;
+        struct stat st;
+
+        if (g_stat(argv[i], &st) != 0) {
+            ufraw_message(UFRAW_ERROR, "%s: %s", argv[i], g_strerror(errno));
+            return 1;
+        }
+        for (r = 0; r <= rounds; r++) {
+            double seconds = decode(argv[i], camera, max_name, &pixels);
+            if (seconds < 0)
+                return 1;
+            /* The first round only warms up the caches */
+            if (r > 0 && (best < 0 || seconds < best))
+                best = seconds;
+        }
+        best = MAX(best, 1e-6);
+        g_print("%-32s %-24s %8.1f %8.1f %8.1f\n", argv[i], camera,
+                best * 1000, st.st_size / best / 1e6, pixels / best / 1e6);
+        totalBytes += st.st_size;
+        totalPixels += pixels;
+        totalSeconds += best;
+    }
+    g_print("%-32s %-24s %8.1f %8.1f %8.1f\n", "Total", "",
+            totalSeconds * 1000, totalBytes / totalSeconds / 1e6,
+            totalPixels / totalSeconds / 1e6);
+    return 0;
+}
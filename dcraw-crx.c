@@ -0,0 +1,986 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * dcraw-crx.c - Check the Canon CRX (CR3) decoder.
+ * Copyright 2026 by the UFRaw developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Usage: dcraw-crx [file...]
+ *
+ * Without files, a CR3 file is made up for each CRX coding mode: both
+ * header versions, no wavelet and one to three wavelet levels, several
+ * tiles, rounded lossless coding, QP tables and the three ways of storing
+ * the planes. Each one is decoded and must give back the image it was
+ * made from. The wavelet transform here is done over whole planes, so
+ * the tile borders of the decoder's transform are checked as well.
+ *
+ * A CR3 file on the command line is decoded and compared with file.pgm,
+ * its raw data as a 16 bit PGM written by another decoder.
+ */
+
+#include "ufraw.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+char *ufraw_binary;
+
+void ufraw_messenger(char *message, void *parentWindow)
+{
+    (void)parentWindow;
+    ufraw_batch_messenger(message);
+}
+
+typedef struct {
+    int version;	/* 0x100, or 0x200 for the extended headers */
+    int levels;		/* Wavelet levels, 0 for none */
+    int encoding;	/* 0 unsigned, 1 signed, 3 decorrelated planes */
+    int bits, medianBits, cfa;
+    int width, height, tileWidth, tileHeight;	/* In raw pixels */
+    int partial;	/* Code the lowest band with prediction */
+    int rounded;	/* Rounded lossless coding, mask 1 << (rounded-1) */
+    int qpTable;	/* Code a table of quantization steps per tile */
+    int qpartial;	/* Change the quantization step per line */
+    const char *name;
+} crx_case;
+
+static const crx_case Cases[] = {
+    { 0x100, 0, 0, 14, 14, 0, 232, 168,  232, 168, 1, 0, 0, 0, "plain" },
+    { 0x100, 0, 0, 12, 12, 1, 232, 168,   96,  64, 0, 0, 0, 0, "no prediction" },
+    { 0x100, 3, 0, 14, 14, 1, 234, 170,   96,  64, 1, 0, 0, 1, "wavelet" },
+    { 0x100, 1, 0, 10, 10, 2, 200, 100,  200, 100, 0, 0, 0, 0, "one level" },
+    { 0x200, 0, 0, 14, 14, 2, 234, 170,   96,  64, 1, 2, 0, 0, "rounded" },
+    { 0x200, 2, 1, 15, 15, 3, 234, 170,   96,  64, 1, 0, 1, 0, "QP table" },
+    { 0x200, 3, 1, 13, 13, 0, 250, 178,  128,  96, 1, 0, 1, 0, "QP table" },
+    { 0x200, 1, 3, 14, 12, 0, 234, 170,   96,  64, 0, 0, 0, 0, "decorrelated" },
+};
+
+static GRand *Rand;
+
+/* Bits are written from the most significant one, like crx_getbits() reads
+ * them. */
+typedef struct {
+    GByteArray *bytes;
+    unsigned acc;
+    int count;
+} bit_writer;
+
+static void put_bit(bit_writer *w, int bit)
+{
+    w->acc = w->acc << 1 | (bit & 1);
+    if (++w->count == 8) {
+        guint8 byte = w->acc;
+        g_byte_array_append(w->bytes, &byte, 1);
+        w->acc = w->count = 0;
+    }
+}
+
+static void put_bits(bit_writer *w, unsigned value, int n)
+{
+    while (n-- > 0)
+        put_bit(w, n < 32 ? value >> n & 1 : 0);
+}
+
+static void put_flush(bit_writer *w)
+{
+    while (w->count != 0)
+        put_bit(w, 0);
+}
+
+/* Golomb-Rice code: the quotient in unary, ended by a one, then k bits.
+ * Quotients of 'limit' and more escape to 'raw' bits of the code. */
+static void put_code(bit_writer *w, unsigned code, int k, int limit, int raw)
+{
+    if (code >> k >= (unsigned)limit) {
+        put_bits(w, 0, limit);
+        put_bit(w, 1);
+        put_bits(w, code, raw);
+    } else {
+        put_bits(w, 0, code >> k);
+        put_bit(w, 1);
+        put_bits(w, code, k);
+    }
+}
+
+static unsigned signed_code(int value)
+{
+    return value < 0 ? -2 * value - 1 : 2 * value;
+}
+
+static int next_k(int k, unsigned code, int max)
+{
+    int n = k - (code < (1U << k >> 1)) + ((code >> k) > 2) +
+            ((code >> k) > 5);
+    return max != 0 && n > max ? max : n;
+}
+
+static int median(int left, int above, int diag)
+{
+    int delta = above - diag;
+    int lo = MIN(left, above), hi = MAX(left, above);
+    /* The gradient prediction, limited to the range of its neighbours */
+    if (diag >= hi)
+        return lo;
+    if (diag <= lo)
+        return hi;
+    return left + delta;
+}
+
+typedef struct {
+    bit_writer w;
+    int width, k, s, mask, rbits;
+    int *prev, *cur, *kbuf;
+} band_coder;
+
+static const int RunBits[32] = {
+    0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+    4, 4, 5, 5, 6, 6, 7, 7, 8, 9, 10, 11, 12, 13, 14, 15
+};
+
+/* A run of n equal samples, out of at most 'left' */
+static void put_run(band_coder *b, int n, int left)
+{
+    int r = 1;
+
+    put_bit(&b->w, n > 0);
+    if (n == 0)
+        return;
+    while (n - r >= 1 << RunBits[b->s]) {
+        put_bit(&b->w, 1);
+        r += 1 << RunBits[b->s];
+        if (b->s < 31)
+            b->s++;
+        if (r == left)
+            return;
+    }
+    put_bit(&b->w, 0);
+    put_bits(&b->w, n - r, RunBits[b->s]);
+    if (b->s > 0)
+        b->s--;
+}
+
+static int run_length(const int *x, int value, int left)
+{
+    int n;
+    for (n = 0; n < left && x[n] == value; n++);
+    return n;
+}
+
+/* Code x as pred plus a residual, returning the code. In rounded mode
+ * the sample becomes what the decoder will make of it. */
+static unsigned put_residual(band_coder *b, int *c, int pred, int x)
+{
+    unsigned code;
+
+    if (b->mask != 0) {
+        int step = 2 * b->mask, d = x - pred;
+        int sym = d >= 0 ? (d + b->mask) / step : -((b->mask - d) / step);
+        code = signed_code(sym);
+        *c = pred + step * sym - (sym < 0);
+    } else {
+        code = signed_code(x - pred);
+        *c = x;
+    }
+    put_code(&b->w, code, b->k, 41, 21);
+    return code;
+}
+
+static void put_symbol(band_coder *b, const int *x, int i, int pred,
+                       int more)
+{
+    int *p = b->prev;
+    unsigned code = put_residual(b, b->cur + i, pred, x[i]);
+    if (more) {
+        int delta;
+        if (b->mask == 0)
+            delta = ABS(p[i + 1] - p[i]);
+        else if (p[i + 1] > p[i])
+            delta = (p[i + 1] - p[i] + b->mask - 1) >> b->rbits;
+        else
+            delta = (p[i] - p[i + 1] + b->mask) >> b->rbits;
+        code = (code + 2 * delta) >> 1;
+    }
+    b->k = next_k(b->k, code, 15);
+}
+
+/* The lowest band, predicted from the samples left, above and above left */
+static void put_top_line(band_coder *b, const int *x)
+{
+    int *c = b->cur, i = 0, left, n, pred;
+
+    c[-1] = 0;
+    for (left = b->width; left > 1; left--, i++) {
+        pred = c[i - 1];
+        if (ABS(c[i - 1]) <= b->mask) {
+            n = run_length(x + i, c[i - 1], left);
+            put_run(b, n, left);
+            for (left -= n; n > 0; n--, i++)
+                c[i] = c[i - 1];
+            if (left <= 0)
+                break;
+            pred = 0;
+        }
+        put_symbol(b, x, i, pred, 0);
+    }
+    if (left == 1)
+        put_symbol(b, x, i, c[i - 1], 0);
+    c[b->width] = c[b->width - 1] + 1;
+}
+
+static void put_line(band_coder *b, const int *x)
+{
+    int *p = b->prev, *c = b->cur, i = 0, left, n;
+
+    c[-1] = p[0];
+    for (left = b->width; left > 1; left--, i++) {
+        if (c[i - 1] != p[i] || c[i - 1] != p[i + 1]) {
+            put_symbol(b, x, i, median(c[i - 1], p[i], p[i - 1]), 1);
+            continue;
+        }
+        n = run_length(x + i, c[i - 1], left);
+        put_run(b, n, left);
+        for (left -= n; n > 0; n--, i++)
+            c[i] = c[i - 1];
+        if (left <= 0)
+            break;
+        put_symbol(b, x, i, p[i], left > 1);
+    }
+    if (left == 1)
+        put_symbol(b, x, i, median(c[i - 1], p[i], p[i - 1]), 0);
+    c[b->width] = c[b->width - 1] + 1;
+}
+
+static void put_line_rounded(band_coder *b, const int *x)
+{
+    int *p = b->prev, *c = b->cur, i = 0, left, n, reached = 0;
+
+    p[-1] = c[-1] = p[0];
+    for (left = b->width; left > 1; left--) {
+        if (ABS(p[i + 1] - p[i]) > b->mask) {
+            put_symbol(b, x, i, median(c[i - 1], p[i], p[i - 1]), 1);
+            i++;
+            reached = 1;
+        } else if (reached || ABS(p[i - 1] - c[i - 1]) > b->mask) {
+            put_symbol(b, x, i, median(c[i - 1], p[i], p[i - 1]), 1);
+            i++;
+            reached = 0;
+        } else {
+            n = run_length(x + i, c[i - 1], left);
+            put_run(b, n, left);
+            for (left -= n; n > 0; n--, i++)
+                c[i] = c[i - 1];
+            if (left > 1) {
+                put_symbol(b, x, i, p[i], 1);
+                i++;
+                reached = ABS(p[i] - p[i - 1]) > b->mask;
+            } else if (left == 1) {
+                put_symbol(b, x, i, p[i], 0);
+                i++;
+            }
+        }
+    }
+    if (left == 1)
+        put_symbol(b, x, i, median(c[i - 1], p[i], p[i - 1]), 0);
+    c[b->width] = c[b->width - 1] + 1;
+}
+
+/* The wavelet detail bands, coded without prediction */
+static void put_top_line_noref(band_coder *b, const int *x)
+{
+    int *c = b->cur, *kb = b->kbuf, i = 0, left, n;
+    unsigned code;
+
+    b->prev[-1] = c[-1] = 0;
+    for (left = b->width; left > 1; left--, i++) {
+        if (c[i - 1] != 0) {
+            code = signed_code(x[i]);
+        } else {
+            n = run_length(x + i, 0, left);
+            put_run(b, n, left);
+            for (left -= n; n > 0; n--, i++)
+                kb[i] = c[i] = 0;
+            if (left <= 0)
+                break;
+            code = signed_code(x[i]) - 1;
+        }
+        put_code(&b->w, code, b->k, 41, 21);
+        c[i] = x[i];
+        kb[i] = b->k = next_k(b->k, code, 15);
+    }
+    if (left == 1) {
+        code = signed_code(x[i]);
+        put_code(&b->w, code, b->k, 41, 21);
+        c[i] = x[i];
+        kb[i] = b->k = next_k(b->k, code, 15);
+    }
+    c[b->width] = 0;
+}
+
+static void put_line_noref(band_coder *b, const int *x)
+{
+    int *p = b->prev, *c = b->cur, *kb = b->kbuf, w = b->width, i, n;
+    unsigned code;
+
+    for (i = 0; i < w - 1; i++) {
+        if ((p[i + 1] | p[i] | c[i - 1]) != 0) {
+            code = signed_code(x[i]);
+        } else {
+            n = run_length(x + i, 0, w - i);
+            put_run(b, n, w - i);
+            for (; n > 0; n--, i++)
+                kb[i] = c[i] = 0;
+            if (i >= w - 1) {
+                if (i == w - 1) {
+                    code = signed_code(x[i]) - 1;
+                    put_code(&b->w, code, b->k, 41, 21);
+                    c[i] = x[i];
+                    kb[i] = b->k = next_k(b->k, code, 15);
+                }
+                continue;
+            }
+            code = signed_code(x[i]) - 1;
+        }
+        put_code(&b->w, code, b->k, 41, 21);
+        c[i] = x[i];
+        b->k = next_k(b->k, code, 0);
+        if (kb[i + 1] - b->k > 1)
+            b->k++;
+        else if (b->k > 15)
+            b->k = 15;
+        kb[i] = b->k;
+    }
+    if (i == w - 1) {
+        code = signed_code(x[i]);
+        put_code(&b->w, code, b->k, 41, 21);
+        c[i] = x[i];
+        kb[i] = b->k = next_k(b->k, code, 15);
+    }
+}
+
+/* Code a band of width x height samples into bytes. The samples of a
+ * rounded band are replaced by what the decoder makes of them. With
+ * 'qpartial' every line starts with a change of the quantization step,
+ * which keeps it at unity here. */
+static void put_band(GByteArray *bytes, int *x, int width, int height,
+                     int partial, int mask, int qpartial)
+{
+    band_coder b;
+    int *buf = g_new0(int, 3 * width + 5);
+    int row, qparam = 4, qk = 0, *t;
+
+    memset(&b, 0, sizeof b);
+    b.w.bytes = bytes;
+    b.width = width;
+    b.mask = mask;
+    for (b.rbits = 1; mask >> b.rbits != 0; b.rbits++);
+    b.prev = buf + 1;
+    b.cur = buf + width + 3;
+    b.kbuf = buf + 2 * width + 4;
+    for (row = 0; row < height; row++) {
+        int *line = x + (gsize)row * width;
+        t = b.prev;
+        b.prev = b.cur;
+        b.cur = t;
+        if (qpartial) {
+            int q = 4 + g_rand_int_range(Rand, 0, 2);
+            unsigned code = signed_code(q - qparam);
+            put_code(&b.w, code, qk, 23, 8);
+            qk = next_k(qk, code, 0);
+            qparam = q;
+        }
+        if (!partial && row == 0)
+            put_top_line_noref(&b, line);
+        else if (!partial)
+            put_line_noref(&b, line);
+        else if (row == 0)
+            put_top_line(&b, line);
+        else if (mask != 0)
+            put_line_rounded(&b, line);
+        else
+            put_line(&b, line);
+        memcpy(line, b.cur, width * sizeof * line);
+    }
+    put_flush(&b.w);
+    g_free(buf);
+}
+
+/* A table of quantization steps for blocks of 8x2 samples of a tile, with
+ * entries that all make a unity step. */
+static void put_qp_table(GByteArray *bytes, int width, int height)
+{
+    bit_writer w = { bytes, 0, 0 };
+    int qw = (width + 7) >> 3, qh = (height + 1) >> 1;
+    int *buf = g_new0(int, 2 * (qw + 2)), *line[2];
+    int row, col, k = 0, v, pred, *l0, *l1;
+    unsigned code;
+
+    line[0] = buf + 1;
+    line[1] = buf + qw + 3;
+    for (row = 0; row < qh; row++) {
+        l0 = line[row & 1];
+        l1 = line[~row & 1];
+        l1[-1] = row == 0 ? 0 : l0[0];
+        for (col = 0; col < qw; col++) {
+            v = g_rand_int_range(Rand, 0, 2);
+            pred = row == 0 ? l1[col - 1] :
+                   median(l1[col - 1], l0[col], l0[col - 1]);
+            code = signed_code(v - pred);
+            put_code(&w, code, k, 23, 8);
+            l1[col] = v;
+            if (row > 0 && col + 1 < qw)
+                code = (code + 2 * ABS(l0[col + 1] - l0[col])) >> 1;
+            k = next_k(k, code, 7);
+        }
+        l1[qw] = l1[qw - 1] + 1;
+    }
+    put_flush(&w);
+    g_free(buf);
+}
+
+/* One step of the 5/3 wavelet of the n samples x[0], x[stride], ...,
+ * leaving the low half first, then the high half. */
+static void forward_53(int *x, int n, int stride)
+{
+    int nl = (n + 1) / 2, nh = n / 2, i;
+    int *lo = g_new(int, nl), *hi = g_new(int, MAX(nh, 1));
+
+    if (n > 1) {
+        /* Mirrored at both ends */
+        for (i = 0; i < nh; i++)
+            hi[i] = x[(2 * i + 1) * stride] -
+                    ((x[2 * i * stride] +
+                      x[(2 * i + 2 < n ? 2 * i + 2 : 2 * i) * stride]) >> 1);
+        for (i = 0; i < nl; i++)
+            lo[i] = x[2 * i * stride] +
+                    ((hi[MAX(i - 1, 0)] + hi[MIN(i, nh - 1)] + 2) >> 2);
+        for (i = 0; i < nl; i++)
+            x[i * stride] = lo[i];
+        for (i = 0; i < nh; i++)
+            x[(nl + i) * stride] = hi[i];
+    }
+    g_free(lo);
+    g_free(hi);
+}
+
+typedef struct {
+    int width, height;
+    int *data;		/* Low rows above high rows, low columns first */
+} wavelet_level;
+
+/* Coefficient (row, col) of band hx, hy of a level, high if set */
+static int coefficient(const wavelet_level *l, int hx, int hy, int row,
+                       int col)
+{
+    int lw = (l->width + 1) / 2, lh = (l->height + 1) / 2;
+    int w = hx ? l->width - lw : lw, h = hy ? l->height - lh : lh;
+
+    if (row < 0 || row >= h || col < 0 || col >= w)
+        g_error("coefficient %d,%d outside of its band", row, col);
+    return l->data[(row + hy * lh) * l->width + col + hx * lw];
+}
+
+/* The coefficients a tile needs along one axis: at each level those of
+ * its samples and of the samples after it that the inverse reaches. */
+typedef struct {
+    int loStart[3], loCount[3], hiStart[3], hiCount[3];
+} tile_axis;
+
+static void get_axis(tile_axis *a, int start, int size, int levels,
+                     int before, int after)
+{
+    int j, n = size, m = size;
+
+    for (j = 0; j < levels; j++) {
+        if (after) {
+            a->loCount[j] = a->hiCount[j] = m % 2 ? (m + 1) / 2 : m / 2 + 1;
+        } else {
+            a->loCount[j] = (n + 1) / 2;
+            a->hiCount[j] = n / 2;
+        }
+        a->loStart[j] = start / 2;
+        a->hiStart[j] = start / 2 - before;
+        a->hiCount[j] += before;
+        n = (n + 1) / 2;
+        m = a->loCount[j];
+        start /= 2;
+    }
+}
+
+static void put_be(GByteArray *a, unsigned value, int bytes)
+{
+    while (bytes-- > 0) {
+        guint8 b = value >> (8 * bytes);
+        g_byte_array_append(a, &b, 1);
+    }
+}
+
+static void put_zeros(GByteArray *a, int bytes)
+{
+    while (bytes-- > 0)
+        put_be(a, 0, 1);
+}
+
+static guint box_start(GByteArray *a, const char *type)
+{
+    guint start = a->len;
+    put_be(a, 0, 4);
+    g_byte_array_append(a, (const guint8 *)type, 4);
+    return start;
+}
+
+/* Fill in a size that was written as 0 */
+static void set_size(GByteArray *a, guint at, guint size)
+{
+    a->data[at] = size >> 24;
+    a->data[at + 1] = size >> 16;
+    a->data[at + 2] = size >> 8;
+    a->data[at + 3] = size;
+}
+
+static void box_end(GByteArray *a, guint start)
+{
+    set_size(a, start, a->len - start);
+}
+
+/* The boxes dcraw reads from a CR3 file: the camera in CMT1, the raw
+ * track with its CMP1 header, and where its data is. */
+static GByteArray *make_moov(const crx_case *t, unsigned mdatHeader,
+                             unsigned size, unsigned offset)
+{
+    static const guint8 uuid[16] = { 0x85, 0xc0, 0xb6, 0x87, 0x82, 0x0f,
+                                     0x11, 0xe0, 0x81, 0x11, 0xf4, 0xce,
+                                     0x46, 0x2b, 0x6a, 0x48
+                                   };
+    GByteArray *a = g_byte_array_new();
+    guint moov, box, cmp1, trak, mdia, minf, stbl, stsd, craw;
+
+    moov = box_start(a, "moov");
+    box = box_start(a, "uuid");
+    g_byte_array_append(a, uuid, 16);
+    cmp1 = box_start(a, "CMT1");
+    g_byte_array_append(a, (const guint8 *)"MM\0*\0\0\0\010", 8);
+    put_be(a, 2, 2);
+    put_be(a, 271, 2), put_be(a, 2, 2), put_be(a, 6, 4), put_be(a, 38, 4);
+    put_be(a, 272, 2), put_be(a, 2, 2), put_be(a, 9, 4), put_be(a, 44, 4);
+    put_be(a, 0, 4);
+    g_byte_array_append(a, (const guint8 *)"Canon\0Test CRX", 15);
+    put_zeros(a, 1);
+    box_end(a, cmp1);
+    box_end(a, box);
+
+    trak = box_start(a, "trak");
+    box = box_start(a, "tkhd");
+    put_zeros(a, 12);
+    put_be(a, 3, 4);			/* The raw image track */
+    put_zeros(a, 58);
+    put_be(a, t->width, 4);
+    put_be(a, t->height, 4);
+    put_zeros(a, 2);
+    box_end(a, box);
+    mdia = box_start(a, "mdia");
+    minf = box_start(a, "minf");
+    stbl = box_start(a, "stbl");
+    stsd = box_start(a, "stsd");
+    put_be(a, 0, 4);
+    put_be(a, 1, 4);
+    craw = box_start(a, "CRAW");
+    put_zeros(a, 82);
+    cmp1 = box_start(a, "CMP1");
+    put_be(a, t->version, 2);
+    put_zeros(a, 6);
+    put_be(a, t->width, 4);
+    put_be(a, t->height, 4);
+    put_be(a, t->tileWidth, 4);
+    put_be(a, t->tileHeight, 4);
+    put_be(a, t->bits, 1);
+    put_be(a, 4 << 4 | t->cfa, 1);
+    put_be(a, t->encoding << 4 | t->levels, 1);
+    put_be(a, (t->tileWidth < t->width) << 7 |
+           (t->tileHeight < t->height) << 6, 1);
+    put_be(a, mdatHeader, 4);
+    put_be(a, (t->version == 0x200) << 7, 1);
+    put_zeros(a, 23);
+    put_be(a, (t->medianBits != t->bits) << 6, 1);
+    put_zeros(a, 27);
+    put_be(a, t->medianBits, 1);
+    put_zeros(a, 3);
+    box_end(a, cmp1);
+    box_end(a, craw);
+    box_end(a, stsd);
+    box = box_start(a, "stsz");
+    put_be(a, 0, 4);
+    put_be(a, size, 4);
+    put_be(a, 1, 4);
+    box_end(a, box);
+    box = box_start(a, "co64");
+    put_be(a, 0, 4);
+    put_be(a, 1, 4);
+    put_be(a, 0, 4);
+    put_be(a, offset, 4);
+    box_end(a, box);
+    box_end(a, stbl);
+    box_end(a, minf);
+    box_end(a, mdia);
+    box_end(a, trak);
+    box_end(a, moov);
+    return a;
+}
+
+/* The planes of one colour each: pixels, or luma and colour differences
+ * for the decorrelated encoding. Flat areas make runs. */
+static int *make_planes(const crx_case *t)
+{
+    int w = t->width / 2, h = t->height / 2, p, row, col;
+    int *planes = g_new(int, 4 * w * h);
+    int max = (1 << (t->encoding == 3 ? t->medianBits : t->bits)) - 1;
+
+    for (p = 0; p < 4; p++)
+        for (row = 0; row < h; row++)
+            for (col = 0; col < w; col++) {
+                int v, flat = (row / 12 + col / 20) % 3 == 0;
+                if (t->encoding == 3)
+                    v = p == 0 ? (col * 7 + row * 3) % 400 - 200 :
+                        flat ? 0 : g_rand_int_range(Rand, -60, 60);
+                else if (flat)
+                    v = max / 3;
+                else
+                    v = CLAMP((col * 29 + row * 13 + p * 101) % (max + 1) +
+                              g_rand_int_range(Rand, -40, 40), 0, max);
+                if (t->encoding == 0)
+                    v -= 1 << (t->bits - 1);
+                else if (t->encoding == 1)
+                    v = v * 2 - max;
+                planes[(p * h + row) * w + col] = v;
+            }
+    return planes;
+}
+
+/* The raw image the decoder should give for the coded planes */
+static guint16 *make_raw(const crx_case *t, const int *planes)
+{
+    int w = t->width / 2, h = t->height / 2, p, row, col;
+    guint16 *raw = g_new(guint16, t->width * t->height);
+    int max = (1 << t->bits) - 1, half = 1 << (t->bits - 1);
+
+    for (row = 0; row < h; row++)
+        for (col = 0; col < w; col++) {
+            int v[4], y, g;
+            for (p = 0; p < 4; p++)
+                v[p] = planes[(p * h + row) * w + col];
+            if (t->encoding == 3) {
+                /* Luma, two colour differences and the green difference */
+                y = (1 << (t->medianBits - 1) << 10) + v[0] * 1024;
+                g = y - 168 * v[1] - 585 * v[3];
+                g = g < 0 ? -((-g + 512) >> 9 & ~1) : (g + 512) >> 9 & ~1;
+                g = CLAMP(g, -0x10000, 0x10000);
+                v[0] = (y + 1510 * v[3] + 512) >> 10;
+                v[3] = (y + 1927 * v[1] + 512) >> 10;
+                v[1] = (v[2] + g + 1) >> 1;
+                v[2] = (g - v[2] + 1) >> 1;
+                for (p = 0; p < 4; p++)
+                    v[p] = CLAMP(v[p], 0, (1 << t->medianBits) - 1);
+            } else {
+                for (p = 0; p < 4; p++)
+                    v[p] = t->encoding == 1 ?
+                           (guint16)CLAMP(v[p], -half, half - 1) :
+                           CLAMP(v[p] + half, 0, max);
+            }
+            for (p = 0; p < 4; p++) {
+                int pos = p ^ t->cfa;
+                raw[(row * 2 + (pos >> 1)) * t->width + col * 2 + (pos & 1)] =
+                    v[p];
+            }
+        }
+    return raw;
+}
+
+/* Write the CR3 file of a case, returning the raw image it holds */
+static guint16 *write_cr3(const crx_case *t, const char *filename)
+{
+    int w = t->width / 2, h = t->height / 2, tw = t->tileWidth / 2;
+    int th = t->tileHeight / 2, cols = (w + tw - 1) / tw;
+    int rows = (h + th - 1) / th, bands = 3 * t->levels + 1;
+    int *planes = make_planes(t), n, p, j, b, i;
+    int ext = t->version == 0x200;
+    wavelet_level level[4][3];
+    GByteArray *header = g_byte_array_new(), *data = g_byte_array_new();
+    GByteArray *file = g_byte_array_new(), *moov;
+    guint tileSizeAt, compSizeAt, offset;
+    guint16 *raw;
+    FILE *out;
+
+    /* Transform the whole planes once */
+    for (p = 0; p < 4; p++) {
+        int lw = w, lh = h, *src = planes + p * w * h;
+        for (j = 0; j < t->levels; j++) {
+            wavelet_level *l = &level[p][j];
+            l->width = lw;
+            l->height = lh;
+            l->data = g_memdup(src, lw * lh * sizeof(int));
+            for (i = 0; i < lw; i++)
+                forward_53(l->data + i, lh, lw);
+            for (i = 0; i < lh; i++)
+                forward_53(l->data + i * lw, lw, 1);
+            /* The next level transforms the low band of this one */
+            if (j > 0)
+                g_free(src);
+            src = g_new(int, (lw + 1) / 2 * ((lh + 1) / 2));
+            for (i = 0; i < (lw + 1) / 2 * ((lh + 1) / 2); i++)
+                src[i] = l->data[i / ((lw + 1) / 2) * lw +
+                                 i % ((lw + 1) / 2)];
+            lw = (lw + 1) / 2;
+            lh = (lh + 1) / 2;
+        }
+        if (t->levels > 0)
+            g_free(src);
+    }
+    for (n = 0; n < cols * rows; n++) {
+        int col = n % cols * tw, row = n / cols * th;
+        int width = MIN(tw, w - col), height = MIN(th, h - row);
+        int left = col > 0, right = col + width < w;
+        int top = row > 0, bottom = row + height < h;
+        guint tileStart = data->len, qpSize = 0, extra = ext ? 2 : 0;
+        tile_axis ax, ay;
+
+        get_axis(&ax, col, width, t->levels, left, right);
+        get_axis(&ay, row, height, t->levels, top, bottom);
+        if (t->qpTable) {
+            put_qp_table(data, width, height);
+            qpSize = data->len - tileStart;
+        }
+        put_zeros(data, extra);
+        put_be(header, ext ? 0xff11 : 0xff01, 2);
+        put_be(header, ext ? 16 : 8, 2);
+        tileSizeAt = header->len;
+        put_be(header, 0, 4);
+        put_be(header, n, 2);
+        put_zeros(header, 2);
+        if (ext) {
+            put_be(header, qpSize, 4);
+            put_be(header, extra, 2);
+            put_zeros(header, 2);
+        }
+        for (p = 0; p < 4; p++) {
+            guint compStart = data->len;
+            put_be(header, ext ? 0xff12 : 0xff02, 2);
+            put_be(header, 8, 2);
+            compSizeAt = header->len;
+            put_be(header, 0, 4);
+            put_be(header, p << 4 | t->partial << 3 | t->rounded << 1, 1);
+            put_zeros(header, 3);
+            for (b = 0; b < bands; b++) {
+                int hx = 0, hy = 0, bw, bh, r, c, x0, y0, k;
+                int qpartial = t->qpartial && t->levels > 0 && b % 2;
+                guint bandStart = data->len, size, pad;
+                int *x;
+                const wavelet_level *l;
+
+                if (t->levels == 0) {
+                    bw = width;
+                    bh = height;
+                    x0 = col;
+                    y0 = row;
+                    l = NULL;
+                } else if (b == 0) {
+                    j = t->levels - 1;
+                    bw = ax.loCount[j];
+                    bh = ay.loCount[j];
+                    x0 = ax.loStart[j];
+                    y0 = ay.loStart[j];
+                    l = &level[p][j];
+                } else {
+                    j = t->levels - 1 - (b - 1) / 3;
+                    k = (b - 1) % 3;
+                    hx = k != 1;
+                    hy = k != 0;
+                    bw = hx ? ax.hiCount[j] : ax.loCount[j];
+                    bh = hy ? ay.hiCount[j] : ay.loCount[j];
+                    x0 = hx ? ax.hiStart[j] : ax.loStart[j];
+                    y0 = hy ? ay.hiStart[j] : ay.loStart[j];
+                    l = &level[p][j];
+                }
+                x = g_new(int, bw * bh);
+                for (r = 0; r < bh; r++)
+                    for (c = 0; c < bw; c++)
+                        x[r * bw + c] = l == NULL ?
+                                        planes[(p * h + y0 + r) * w + x0 + c] :
+                                        coefficient(l, hx, hy, y0 + r, x0 + c);
+                put_band(data, x, bw, bh, t->partial && b == 0,
+                         t->rounded && b == 0 ? 1 << (t->rounded - 1) : 0,
+                         qpartial);
+                /* Rounded coding changes the samples themselves */
+                if (t->rounded)
+                    for (r = 0; r < bh; r++)
+                        for (c = 0; c < bw; c++)
+                            planes[(p * h + y0 + r) * w + x0 + c] =
+                                x[r * bw + c];
+                g_free(x);
+                size = data->len - bandStart;
+                pad = -size & 7;
+                put_zeros(data, pad);
+                put_be(header, ext ? 0xff13 : 0xff03, 2);
+                put_be(header, ext ? 16 : 8, 2);
+                put_be(header, size + pad, 4);
+                if (ext) {
+                    put_be(header, b << 12, 2);
+                    put_be(header, t->qpTable ? 8 : 0, 2);
+                    put_be(header, 0, 4);
+                    put_be(header, pad, 2);
+                    put_be(header, 0, 2);
+                } else {
+                    put_be(header, (unsigned)b << 28 | qpartial << 27 |
+                           4 << 19 | pad, 4);
+                }
+            }
+            set_size(header, compSizeAt, data->len - compStart);
+        }
+        set_size(header, tileSizeAt, data->len - tileStart);
+    }
+    for (p = 0; p < 4; p++)
+        for (j = 0; j < t->levels; j++)
+            g_free(level[p][j].data);
+
+    g_byte_array_append(file, (const guint8 *)
+                        "\0\0\0\030ftypcrx \0\0\0\001crx isom", 24);
+    moov = make_moov(t, header->len, header->len + data->len, 0);
+    offset = file->len + moov->len + 8;
+    g_byte_array_free(moov, TRUE);
+    moov = make_moov(t, header->len, header->len + data->len, offset);
+    g_byte_array_append(file, moov->data, moov->len);
+    g_byte_array_free(moov, TRUE);
+    put_be(file, 8 + header->len + data->len, 4);
+    g_byte_array_append(file, (const guint8 *)"mdat", 4);
+    g_byte_array_append(file, header->data, header->len);
+    g_byte_array_append(file, data->data, data->len);
+
+    raw = make_raw(t, planes);
+    out = g_fopen(filename, "wb");
+    if (out == NULL || fwrite(file->data, 1, file->len, out) != file->len)
+        g_error("%s: cannot write %s", ufraw_binary, filename);
+    fclose(out);
+    g_byte_array_free(header, TRUE);
+    g_byte_array_free(data, TRUE);
+    g_byte_array_free(file, TRUE);
+    g_free(planes);
+    return raw;
+}
+
+/* Compare the decoded raw data of filename with the expected width x height
+ * image. Returns the number of differing pixels, or -1 if it fails. */
+static int compare(char *filename, const guint16 *expected, int width,
+                   int height)
+{
+    dcraw_data raw;
+    int row, col, diff = 0;
+
+    int status = dcraw_open(&raw, filename);
+    if (status != DCRAW_SUCCESS && status != DCRAW_WARNING) {
+        ufraw_message(UFRAW_ERROR, "%s", raw.message);
+        return -1;
+    }
+    status = dcraw_load_raw(&raw);
+    if (status != DCRAW_SUCCESS && status != DCRAW_WARNING) {
+        ufraw_message(UFRAW_ERROR, "%s", raw.message);
+        dcraw_close(&raw);
+        return -1;
+    }
+    if (raw.width != width || raw.height != height) {
+        ufraw_message(UFRAW_ERROR, "%s: %dx%d instead of %dx%d", filename,
+                      raw.width, raw.height, width, height);
+        dcraw_close(&raw);
+        return -1;
+    }
+    for (row = 0; row < height; row++)
+        for (col = 0; col < width; col++) {
+            int c = raw.fourColorFilters >>
+                    ((((row << 1) & 14) | (col & 1)) << 1) & 3;
+            diff += raw.raw.image[(row >> 1) * raw.raw.width + (col >> 1)][c]
+                    != expected[row * width + col];
+        }
+    dcraw_close(&raw);
+    return diff;
+}
+
+/* Read a 16 bit PGM, as written by dcraw -D -4 */
+static guint16 *read_pgm(const char *filename, int *width, int *height)
+{
+    gchar *contents, *p;
+    gsize length;
+    int max, n, i;
+    guint16 *image;
+
+    if (!g_file_get_contents(filename, &contents, &length, NULL))
+        return NULL;
+    if (sscanf(contents, "P5 %d %d %d%n", width, height, &max, &n) != 3 ||
+            max < 256 || length < n + 1 + 2 * (gsize)*width * *height) {
+        g_free(contents);
+        return NULL;
+    }
+    image = g_new(guint16, *width * *height);
+    for (p = contents + n + 1, i = 0; i < *width * *height; i++, p += 2)
+        image[i] = (guint8)p[0] << 8 | (guint8)p[1];
+    g_free(contents);
+    return image;
+}
+
+int main(int argc, char **argv)
+{
+    int i, diff, failures = 0;
+
+#if !GLIB_CHECK_VERSION(2,31,0)
+    g_thread_init(NULL);
+#endif
+    ufraw_binary = g_path_get_basename(argv[0]);
+    if (argc > 1) {
+        for (i = 1; i < argc; i++) {
+            int width, height;
+            char *pgm = g_strconcat(argv[i], ".pgm", NULL);
+            guint16 *expected = read_pgm(pgm, &width, &height);
+            if (expected == NULL) {
+                g_printerr("%s: cannot read %s\n", ufraw_binary, pgm);
+                return 1;
+            }
+            diff = compare(argv[i], expected, width, height);
+            g_print("%s: %s: %d pixels differ\n", ufraw_binary, argv[i],
+                    diff);
+            failures += diff != 0;
+            g_free(expected);
+            g_free(pgm);
+        }
+        return failures == 0 ? 0 : 1;
+    }
+    Rand = g_rand_new_with_seed(0x43525831);
+    for (i = 0; i < (int)G_N_ELEMENTS(Cases); i++) {
+        const crx_case *t = &Cases[i];
+        char *filename;
+        int fd = g_file_open_tmp("dcraw-crx-XXXXXX.cr3", &filename, NULL);
+        guint16 *expected;
+
+        if (fd < 0) {
+            g_printerr("%s: cannot make a temporary file\n", ufraw_binary);
+            return 1;
+        }
+        close(fd);
+        expected = write_cr3(t, filename);
+        diff = compare(filename, expected, t->width, t->height);
+        g_print("%s: version %x, %d levels, encoding %d, %s: ",
+                ufraw_binary, t->version, t->levels, t->encoding, t->name);
+        if (diff == 0)
+            g_print("ok\n");
+        else
+            g_print("%d pixels differ\n", diff);
+        failures += diff != 0;
+        g_unlink(filename);
+        g_free(filename);
+        g_free(expected);
+    }
+    g_rand_free(Rand);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,191 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * dcraw-stress.c - Check that raw files decode concurrently as they do
+ * one at a time.
+ * Copyright 2026 by the UFRaw developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Usage: dcraw-stress [-t threads] [-r rounds] file...
+ *
+ * Every file is first decoded serially. Then 'threads' threads decode all
+ * the files 'rounds' times each, starting at different files so that
+ * different and equal files are decoded at the same time. Every decoded
+ * raw image, and for CFA sensors its AHD (or for X-Trans, Markesteijn)
+ * interpolation, must match its serial decode bit for bit.
+ *
+ * Without files on the command line the files are taken from the
+ * UFRAW_TEST_FILES environment variable. Without any files the test is
+ * skipped, which 'make check' reports as such.
+ */
+
+#include "ufraw.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>    /* for getopt */
+
+#define SKIP_EXIT_CODE 77
+
+char *ufraw_binary;
+
+void ufraw_messenger(char *message, void *parentWindow)
+{
+    (void)parentWindow;
+    ufraw_batch_messenger(message);
+}
+
+typedef struct {
+    char *filename;
+    int width, height, colors;
+    dcraw_image_type *image;
+    dcraw_image_data final;	/* Interpolated image, if it has a CFA */
+} decoded_file;
+
+static decoded_file *Files;
+static int FileCount, Rounds = 4;
+static volatile gint Mismatches = 0;
+
+/* Decode filename into out. Returns FALSE with a message if it fails. */
+static gboolean decode(char *filename, decoded_file *out)
+{
+    dcraw_data raw;
+    int status = dcraw_open(&raw, filename);
+    if (status != DCRAW_SUCCESS && status != DCRAW_WARNING) {
+        ufraw_message(UFRAW_ERROR, "%s", raw.message);
+        return FALSE;
+    }
+    status = dcraw_load_raw(&raw);
+    if (status != DCRAW_SUCCESS && status != DCRAW_WARNING) {
+        ufraw_message(UFRAW_ERROR, "%s", raw.message);
+        dcraw_close(&raw);
+        return FALSE;
+    }
+    out->filename = filename;
+    out->width = raw.raw.width;
+    out->height = raw.raw.height;
+    out->colors = raw.raw.colors;
+    out->image = g_memdup(raw.raw.image, (gsize)out->width * out->height *
+                          sizeof(dcraw_image_type));
+    out->final.image = NULL;
+    out->final.width = out->final.height = 0;
+    if (raw.filters != 0) {
+        int rgbWB[4] = { 0x10000, 0x10000, 0x10000, 0x10000 };
+        dcraw_finalize_raw(&raw, NULL, rgbWB);
+        status = dcraw_finalize_interpolate(&out->final, &raw,
+                                            dcraw_ahd_interpolation, 0,
+                                            dcraw_demosaic_export);
+        if (status != DCRAW_SUCCESS && status != DCRAW_WARNING) {
+            ufraw_message(UFRAW_ERROR, "%s", raw.message);
+            g_free(out->image);
+            g_free(out->final.image);
+            dcraw_close(&raw);
+            return FALSE;
+        }
+    }
+    dcraw_close(&raw);
+    return TRUE;
+}
+
+static gboolean decode_matches(decoded_file *serial)
+{
+    decoded_file d;
+    gboolean match;
+
+    if (!decode(serial->filename, &d))
+        return FALSE;
+    match = d.width == serial->width && d.height == serial->height &&
+            d.colors == serial->colors &&
+            memcmp(d.image, serial->image, (gsize)d.width * d.height *
+                   sizeof(dcraw_image_type)) == 0 &&
+            d.final.width == serial->final.width &&
+            d.final.height == serial->final.height &&
+            (d.final.image == NULL ||
+             memcmp(d.final.image, serial->final.image,
+                    (gsize)d.final.width * d.final.height *
+                    sizeof(dcraw_image_type)) == 0);
+    g_free(d.image);
+    g_free(d.final.image);
+    return match;
+}
+
+static gpointer decode_thread(gpointer first)
+{
+    int round, i;
+
+    for (round = 0; round < Rounds; round++)
+        for (i = 0; i < FileCount; i++) {
+            decoded_file *f = &Files[(GPOINTER_TO_INT(first) + round + i) %
+                                     FileCount];
+            if (!decode_matches(f)) {
+                g_printerr("%s: %s differs from its serial decode\n",
+                           ufraw_binary, f->filename);
+                g_atomic_int_inc(&Mismatches);
+            }
+        }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    GThread **threads;
+    char **filenames;
+    int threadCount = 4;
+    int i, opt;
+
+#if !GLIB_CHECK_VERSION(2,31,0)
+    g_thread_init(NULL);
+#endif
+    ufraw_binary = g_path_get_basename(argv[0]);
+    while ((opt = getopt(argc, argv, "t:r:")) != -1) {
+        if (opt == 't')
+            threadCount = atoi(optarg);
+        else if (opt == 'r')
+            Rounds = atoi(optarg);
+        else {
+            g_printerr("Usage: %s [-t threads] [-r rounds] file...\n",
+                       ufraw_binary);
+            return 1;
+        }
+    }
+    filenames = argv + optind;
+    FileCount = argc - optind;
+    if (FileCount == 0 && g_getenv("UFRAW_TEST_FILES") != NULL) {
+        filenames = g_strsplit_set(g_getenv("UFRAW_TEST_FILES"), " \t\n", 0);
+        for (i = 0; filenames[i] != NULL; i++)
+            if (filenames[i][0] != '\0')
+                filenames[FileCount++] = filenames[i];
+    }
+    if (FileCount == 0) {
+        g_print("%s: no raw files given, skipped\n", ufraw_binary);
+        return SKIP_EXIT_CODE;
+    }
+    threadCount = MAX(threadCount, 2);
+
+    Files = g_new0(decoded_file, FileCount);
+    for (i = 0; i < FileCount; i++)
+        if (!decode(filenames[i], &Files[i]))
+            return 1;
+
+    threads = g_new(GThread *, threadCount);
+    for (i = 0; i < threadCount; i++)
+        threads[i] = g_thread_create(decode_thread, GINT_TO_POINTER(i),
+                                     TRUE, NULL);
+    for (i = 0; i < threadCount; i++)
+        g_thread_join(threads[i]);
+    g_free(threads);
+
+    g_print("%s: %d files, %d threads, %d rounds: %d mismatches\n",
+            ufraw_binary, FileCount, threadCount, Rounds, Mismatches);
+    for (i = 0; i < FileCount; i++) {
+        g_free(Files[i].image);
+        g_free(Files[i].final.image);
+    }
+    g_free(Files);
+    return Mismatches == 0 ? 0 : 1;
+}
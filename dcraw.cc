@@ -136,8 +136,16 @@ tone_curve_size = 0, tone_curve_offset = 0; /* Nikon Tone Curves UF*/
 tone_mode_offset = 0, tone_mode_size = 0; /* Nikon ToneComp UF*/
 messageBuffer = NULL;
 lastStatus = DCRAW_SUCCESS;
+getbithuff_bitbuf = 0, getbithuff_vbits = 0, getbithuff_reset = 0;
+ph1_bitbuf = 0, ph1_vbits = 0, pana_vbits = 0, sony_p = 0;
+memset (ljpeg_cs, 0, sizeof ljpeg_cs);
+crx_index = 0, crx_wide = crx_high = crx_off = crx_len = crx_cmp1 = 0;
 ifname = NULL;
 ifname_display = NULL;
+ifp = NULL;
+ifpMapping = NULL;
+ifpBuffer = NULL;
+ifpBufferSize = 0;
 ifpReadCount = 0;
 ifpSize = 0;
 ifpStepProgress = 0;
@@ -153,7 +161,7 @@ free(ifname_display);
 void CLASS ifpProgress(unsigned readCount) {
     ifpReadCount += readCount;
     if (ifpSize==0) return;
-    unsigned newStepProgress = STEPS * ifpReadCount / ifpSize;
+    unsigned newStepProgress = (UINT64)STEPS * ifpReadCount / ifpSize;
     if (newStepProgress > ifpStepProgress) {
 #ifdef DCRAW_NOMAIN
 	if (ifpStepProgress)
@@ -206,8 +214,15 @@ char *CLASS fgets(char *s, int size, FILE *stream) {
 }
 
 int CLASS fgetc(FILE *stream) {
+#ifdef HAVE_GETC_UNLOCKED
+    /* Each DCRaw instance is used by one thread at a time */
+    int chr = getc_unlocked(stream);
+#else
     int chr = ::fgetc(stream);
-    if (stream==ifp) ifpProgress(1);
+#endif
+    /* This is called for every byte by the bit readers,
+     * so report the progress only every 64KB. */
+    if (stream==ifp && !(++ifpReadCount & 0xffff)) ifpProgress(0);
     return chr;
 }
 
@@ -360,6 +375,10 @@ void CLASS merror (void *ptr, const char *where)
 
 void CLASS derror()
 {
+#ifdef _OPENMP
+  #pragma omp critical(dcraw_derror)
+#endif
+  {
   if (!data_error) {
     dcraw_message (DCRAW_WARNING, "%s: ", ifname_display);
     if (feof(ifp))
@@ -373,6 +392,7 @@ void CLASS derror()
 #endif
   }
   data_error++;
+  }
 }
 
 ushort CLASS sget2 (uchar *s)
@@ -679,9 +699,8 @@ int CLASS canon_s2is()
 
 unsigned CLASS getbithuff (int nbits, ushort *huff)
 {
-  // TODO: The following static variables are not thread-safe
-  static unsigned bitbuf=0;
-  static int vbits=0, reset=0;
+  unsigned &bitbuf=getbithuff_bitbuf;
+  int &vbits=getbithuff_vbits, &reset=getbithuff_reset;
   unsigned c;
 
   if (nbits > 25) return 0;
@@ -897,8 +916,15 @@ void CLASS canon_load_raw()
 struct jhead {
   int algo, bits, high, wide, clrs, sraw, psv, restart, vpred[6];
   ushort quant[64], idct[64], *huff[20], *free[20], *row;
+  /* Buffered bit reader and lookup tables used by ljpeg_row() */
+  uchar *buf, *bp, *bend;
+  UINT64 bitbuf;
+  int vbits, pad, marker, dry, mem, *lut[6];
 };
 
+#define LJPEG_BUF_SIZE 0x10000
+#define LJPEG_LUT_BITS 12
+
 int CLASS ljpeg_start (struct jhead *jh, int info_only)
 {
   ushort c, tag, len;
@@ -962,6 +988,137 @@ void CLASS ljpeg_end (struct jhead *jh)
   int c;
   FORC4 if (jh->free[c]) free (jh->free[c]);
   free (jh->row);
+  free (jh->buf);
+}
+
+/*
+   ljpeg_row() reads the entropy coded data through its own buffer,
+   instead of one fgetc() per byte, and decodes the Huffman code and the
+   difference bits that follow it with a single table lookup.  The result
+   is identical to ljpeg_diff(), including the handling of markers, of the
+   end of file and of corrupt data.
+
+   A table entry holds diff << 8 | bits, where bits is the total length
+   of the code and the difference.  Zero means the pair is longer than
+   LJPEG_LUT_BITS, or needs special handling, and is decoded the slow way.
+
+   If jh->mem is set, jh->bp and jh->bend point to the data in memory
+   and no read buffer is needed.  ljpeg_make_lut() does not longjmp(),
+   so that it can be called from a parallel region.
+ */
+int CLASS ljpeg_make_lut (struct jhead *jh)
+{
+  int c, i, p, max, code, len, bits, diff, size;
+  ushort *huff;
+
+  size = jh->mem ? 0 : LJPEG_BUF_SIZE;
+  jh->buf = (uchar *) malloc (size +
+		jh->clrs * (sizeof (int) << LJPEG_LUT_BITS));
+  if (!jh->buf) return 0;
+  if (!jh->mem) jh->bp = jh->bend = jh->buf;
+  FORC(jh->clrs) {
+    for (i=0; i < c && jh->huff[i] != jh->huff[c]; i++);
+    if (i < c) {
+      jh->lut[c] = jh->lut[i];
+      continue;
+    }
+    jh->lut[c] = (int *) (jh->buf + size) + (c << LJPEG_LUT_BITS);
+    huff = jh->huff[c];
+    max = huff[0];
+    for (p=0; p < 1 << LJPEG_LUT_BITS; p++) {
+      jh->lut[c][p] = 0;
+      code = max > LJPEG_LUT_BITS ? p << (max - LJPEG_LUT_BITS)
+				  : p >> (LJPEG_LUT_BITS - max);
+      bits = huff[1+code] >> 8;
+      len = (uchar) huff[1+code];
+      if (!bits || len >= 16 || bits + len > LJPEG_LUT_BITS) continue;
+      diff = len ? p >> (LJPEG_LUT_BITS - bits - len) & ((1 << len) - 1) : 0;
+      if (len && (diff & (1 << (len-1))) == 0)
+	diff -= (1 << len) - 1;
+      jh->lut[c][p] = diff * 256 + bits + len;
+    }
+  }
+  return 1;
+}
+
+int CLASS ljpeg_getc (struct jhead *jh)
+{
+  size_t num;
+
+  if (jh->bp == jh->bend) {
+    if (jh->mem) return EOF;
+    num = ::fread (jh->buf, 1, LJPEG_BUF_SIZE, ifp);
+    ifpProgress (num);
+    jh->bp = jh->buf;
+    jh->bend = jh->buf + num;
+    if (!num) return EOF;
+  }
+  return *jh->bp++;
+}
+
+/* Keep at least 57 bits in bitbuf, appending zeros after a marker
+   or at the end of file as getbithuff() does. */
+void CLASS ljpeg_fill (struct jhead *jh)
+{
+  int c, m;
+
+  while (jh->vbits <= 56) {
+    c = 0;
+    if (!jh->marker) {
+      if ((c = ljpeg_getc(jh)) == EOF) {
+	jh->marker = 1;
+	c = 0;
+      } else if (c == 0xff) {
+	if ((m = ljpeg_getc(jh)) != 0) {
+	  /* Stop at the marker, leave its code to the restart scan */
+	  if (m != EOF) jh->bp--;
+	  jh->marker = 2;
+	  c = 0;
+	}
+      }
+    }
+    if (jh->marker) jh->pad += 8;
+    jh->bitbuf = jh->bitbuf << 8 | c;
+    jh->vbits += 8;
+  }
+}
+
+int CLASS ljpeg_fast_diff (struct jhead *jh, int c)
+{
+  ushort *huff = jh->huff[c];
+  int e, len, diff, bits;
+
+  if (jh->dry) return 0;
+  if (jh->vbits <= 56) ljpeg_fill (jh);
+  e = jh->lut[c][jh->bitbuf >> (jh->vbits - LJPEG_LUT_BITS)
+		  & ((1 << LJPEG_LUT_BITS) - 1)];
+  if (e && (e & 255) <= jh->vbits - jh->pad) {
+    jh->vbits -= e & 255;
+    return e >> 8;
+  }
+  /* Same steps as gethuff() and getbits() in ljpeg_diff() */
+  bits = jh->bitbuf >> (jh->vbits - huff[0]) & ((1 << huff[0]) - 1);
+  jh->vbits -= huff[1+bits] >> 8;
+  len = (uchar) huff[1+bits];
+  if (jh->vbits < jh->pad) {
+    jh->dry = 1;
+    derror();
+  }
+  if (len == 16 && (!dng_version || dng_version >= 0x1010000))
+    return -32768;
+  diff = 0;
+  if (!jh->dry && len && len <= 25) {
+    if (jh->vbits < len) ljpeg_fill (jh);
+    diff = jh->bitbuf >> (jh->vbits - len) & ((1ULL << len) - 1);
+    jh->vbits -= len;
+    if (jh->vbits < jh->pad) {
+      jh->dry = 1;
+      derror();
+    }
+  }
+  if ((diff & (1 << (len-1))) == 0)
+    diff -= (1 << len) - 1;
+  return diff;
 }
 
 int CLASS ljpeg_diff (ushort *huff)
@@ -985,19 +1142,21 @@ ushort * CLASS ljpeg_row (int jrow, struct jhead *jh)
   int col, c, diff, pred, spred=0;
   ushort mark=0, *row[3];
 
+  if (!jh->buf && !ljpeg_make_lut (jh))
+    merror (NULL, "ljpeg_row()");
   if (jrow * jh->wide % jh->restart == 0) {
     FORC(6) jh->vpred[c] = 1 << (jh->bits-1);
     if (jrow) {
-      fseek (ifp, -2, SEEK_CUR);
-      do mark = (mark << 8) + (c = fgetc(ifp));
+      if (jh->marker == 2) mark = 0xff;
+      do mark = (mark << 8) + (c = ljpeg_getc(jh));
       while (c != EOF && mark >> 4 != 0xffd);
     }
-    getbits(-1);
+    jh->bitbuf = jh->vbits = jh->pad = jh->marker = jh->dry = 0;
   }
   FORC3 row[c] = jh->row + jh->wide*jh->clrs*((jrow+c) & 1);
   for (col=0; col < jh->wide; col++)
     FORC(jh->clrs) {
-      diff = ljpeg_diff (jh->huff[c]);
+      diff = ljpeg_fast_diff (jh, c);
       if (jh->sraw && c <= jh->sraw && (col | c))
 		    pred = spred;
       else if (col) pred = row[0][-jh->clrs];
@@ -1151,7 +1310,7 @@ void CLASS ljpeg_idct (struct jhead *jh)
 {
   int c, i, j, len, skip, coef;
   float work[3][8][8];
-  static float cs[106] = { 0 };
+  float *cs = ljpeg_cs;
   static const uchar zigzag[80] =
   {  0, 1, 8,16, 9, 2, 3,10,17,24,32,25,18,11, 4, 5,12,19,26,33,
     40,48,41,34,27,20,13, 6, 7,14,21,28,35,42,49,56,57,50,43,36,
@@ -1183,46 +1342,120 @@ void CLASS ljpeg_idct (struct jhead *jh)
   FORC(64) jh->idct[c] = CLIP(((float *)work[2])[c]+0.5);
 }
 
+void CLASS lossless_dng_tile (struct jhead *jh, unsigned trow, unsigned tcol)
+{
+  unsigned jwide, jrow, jcol, row, col, i, j;
+  ushort *rp;
+
+  jwide = jh->wide;
+  if (filters) jwide *= jh->clrs;
+  jwide /= MIN (is_raw, tiff_samples);
+  switch (jh->algo) {
+    case 0xc1:
+      jh->vpred[0] = 16384;
+      getbits(-1);
+      for (jrow=0; jrow+7 < (unsigned) jh->high; jrow += 8) {
+	for (jcol=0; jcol+7 < (unsigned) jh->wide; jcol += 8) {
+	  ljpeg_idct (jh);
+	  rp = jh->idct;
+	  row = trow + jcol/tile_width + jrow*2;
+	  col = tcol + jcol%tile_width;
+	  for (i=0; i < 16; i+=2)
+	    for (j=0; j < 8; j++)
+	      adobe_copy_pixel (row+i, col+j, &rp);
+	}
+      }
+      break;
+    case 0xc3:
+      for (row=col=jrow=0; jrow < (unsigned) jh->high; jrow++) {
+	rp = ljpeg_row (jrow, jh);
+	for (jcol=0; jcol < jwide; jcol++) {
+	  adobe_copy_pixel (trow+row, tcol+col, &rp);
+	  if (++col >= tile_width || col >= raw_width)
+	    row += 1 + (col = 0);
+	}
+      }
+  }
+}
+
+/*
+   DNG tiles are compressed independently.  When the file is in memory,
+   the tile headers are read through ifp and up to LJPEG_TILES lossless
+   tiles at a time are then decoded in parallel straight from memory.
+ */
+#define LJPEG_TILES 128
+
+void CLASS lossless_dng_load_tiles()
+{
+  unsigned save, trow=0, tcol=0, (*pos)[3];
+  struct jhead *tiles;
+  int n, t, done=0;
+
+  tiles = (struct jhead *) calloc (LJPEG_TILES, sizeof *tiles);
+  merror (tiles, "lossless_dng_load_tiles()");
+  pos = (unsigned (*)[3]) calloc (LJPEG_TILES, sizeof *pos);
+  merror (pos, "lossless_dng_load_tiles()");
+  while (!done && trow < raw_height) {
+    for (n=0; n < LJPEG_TILES && trow < raw_height; ) {
+      save = ftell(ifp);
+      fseek (ifp, get4(), SEEK_SET);
+      if (!ljpeg_start (&tiles[n], 0)) {
+	done = 1;
+	break;
+      }
+      if (tiles[n].algo == 0xc3) {
+	pos[n][0] = trow;
+	pos[n][1] = tcol;
+	pos[n][2] = ftell(ifp);
+	if (pos[n][2] > ifpBufferSize) {
+	  ljpeg_end (&tiles[n]);
+	  derror();
+	  done = 1;
+	  break;
+	}
+	tiles[n].mem = 1;
+	tiles[n].bp = (uchar *) ifpBuffer + pos[n][2];
+	tiles[n].bend = (uchar *) ifpBuffer + ifpBufferSize;
+	if (!ljpeg_make_lut (&tiles[n]))
+	  merror (NULL, "lossless_dng_load_tiles()");
+	n++;
+      } else {
+	lossless_dng_tile (&tiles[n], trow, tcol);
+	ljpeg_end (&tiles[n]);
+      }
+      fseek (ifp, save+4, SEEK_SET);
+      if ((tcol += tile_width) >= raw_width)
+	trow += tile_length + (tcol = 0);
+    }
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+#endif
+    for (t=0; t < n; t++)
+      lossless_dng_tile (&tiles[t], pos[t][0], pos[t][1]);
+    for (t=0; t < n; t++) {
+      ifpProgress (tiles[t].bp - ((uchar *) ifpBuffer + pos[t][2]));
+      ljpeg_end (&tiles[t]);
+    }
+  }
+  free (pos);
+  free (tiles);
+}
+
 void CLASS lossless_dng_load_raw()
 {
-  unsigned save, trow=0, tcol=0, jwide, jrow, jcol, row, col, i, j;
+  unsigned save, trow=0, tcol=0;
   struct jhead jh;
-  ushort *rp;
 
+  if (ifpBuffer && tile_length < INT_MAX && tile_width) {
+    lossless_dng_load_tiles();
+    return;
+  }
   while (trow < raw_height) {
     save = ftell(ifp);
     if (tile_length < INT_MAX)
       fseek (ifp, get4(), SEEK_SET);
     if (!ljpeg_start (&jh, 0)) break;
-    jwide = jh.wide;
-    if (filters) jwide *= jh.clrs;
-    jwide /= MIN (is_raw, tiff_samples);
-    switch (jh.algo) {
-      case 0xc1:
-	jh.vpred[0] = 16384;
-	getbits(-1);
-	for (jrow=0; jrow+7 < (unsigned) jh.high; jrow += 8) {
-	  for (jcol=0; jcol+7 < (unsigned) jh.wide; jcol += 8) {
-	    ljpeg_idct (&jh);
-	    rp = jh.idct;
-	    row = trow + jcol/tile_width + jrow*2;
-	    col = tcol + jcol%tile_width;
-	    for (i=0; i < 16; i+=2)
-	      for (j=0; j < 8; j++)
-		adobe_copy_pixel (row+i, col+j, &rp);
-	  }
-	}
-	break;
-      case 0xc3:
-	for (row=col=jrow=0; jrow < (unsigned) jh.high; jrow++) {
-	  rp = ljpeg_row (jrow, &jh);
-	  for (jcol=0; jcol < jwide; jcol++) {
-	    adobe_copy_pixel (trow+row, tcol+col, &rp);
-	    if (++col >= tile_width || col >= raw_width)
-	      row += 1 + (col = 0);
-	  }
-	}
-    }
+    lossless_dng_tile (&jh, trow, tcol);
     fseek (ifp, save+4, SEEK_SET);
     if ((tcol += tile_width) >= raw_width)
       trow += tile_length + (tcol = 0);
@@ -1230,11 +1463,69 @@ void CLASS lossless_dng_load_raw()
   }
 }
 
+/*
+   Rows of packed DNG data start on byte boundaries, so when the file
+   is in memory each row can be unpacked independently.
+ */
+void CLASS packed_dng_load_rows()
+{
+  const uchar *data = ifpBuffer + ftell(ifp), *bp;
+  size_t bytes = ((size_t) raw_width * tiff_samples * tiff_bps + 7) >> 3;
+  int row, fail=0;
+
+#ifdef _OPENMP
+  #pragma omp parallel private(bp)
+#endif
+  {
+    ushort *pixel, *rp;
+    unsigned col, bitbuf;
+    int vbits;
+
+    pixel = (ushort *) calloc (raw_width, tiff_samples*sizeof *pixel);
+    if (!pixel) fail = 1;
+#ifdef _OPENMP
+    #pragma omp for schedule(static)
+#endif
+    for (row=0; row < raw_height; row++) {
+      if (!pixel) continue;
+      bp = data + row * bytes;
+      if (tiff_bps == 16) {
+	if (order == 0x4949)
+	  for (col=0; col < raw_width * tiff_samples; col++, bp+=2)
+	    pixel[col] = bp[0] | bp[1] << 8;
+	else
+	  for (col=0; col < raw_width * tiff_samples; col++, bp+=2)
+	    pixel[col] = bp[0] << 8 | bp[1];
+      } else {
+	bitbuf = vbits = 0;
+	for (col=0; col < raw_width * tiff_samples; col++) {
+	  while (vbits < (int) tiff_bps) {
+	    bitbuf = bitbuf << 8 | *bp++;
+	    vbits += 8;
+	  }
+	  pixel[col] = bitbuf >> (vbits -= tiff_bps) & ((1 << tiff_bps) - 1);
+	}
+      }
+      for (rp=pixel, col=0; col < raw_width; col++)
+	adobe_copy_pixel (row, col, &rp);
+    }
+    free (pixel);
+  }
+  if (fail) merror (NULL, "packed_dng_load_rows()");
+  ifpProgress (bytes * raw_height);
+}
+
 void CLASS packed_dng_load_raw()
 {
   ushort *pixel, *rp;
   unsigned row, col;
 
+  if (ifpBuffer && !zero_after_ff && tiff_bps && tiff_bps <= 16 &&
+      ftell(ifp) + (((size_t) raw_width * tiff_samples * tiff_bps + 7) >> 3)
+		* raw_height <= ifpBufferSize) {
+    packed_dng_load_rows();
+    return;
+  }
   pixel = (ushort *) calloc (raw_width, tiff_samples*sizeof *pixel);
   merror (pixel, "packed_dng_load_raw()");
   for (row=0; row < raw_height; row++) {
@@ -1582,7 +1873,7 @@ void CLASS phase_one_correct()
 {
   unsigned entries, tag, data, save, col, row, type;
   int len, i, j, k, cip, val[4], dev[4], sum, max;
-  int head[9], diff, mindiff=INT_MAX, off_412=0;
+  int head[9], diff, mindiff=INT_MAX, off_412=0, r;
   static const signed char dir[12][2] =
     { {-1,-1}, {-1,1}, {1,-1}, {1,1}, {-2,0}, {0,-2}, {0,2}, {2,0},
       {-2,-2}, {-2,2}, {2,-2}, {2,2} };
@@ -1619,9 +1910,12 @@ void CLASS phase_one_correct()
 	  num = num * i + poly[j];
 	curve[i] = LIM(num+i,0,65535);
       } apply:					/* apply to whole image */
-      for (row=0; row < raw_height; row++)
+#ifdef _OPENMP
+      #pragma omp parallel for private(col)
+#endif
+      for (r=0; r < raw_height; r++)
 	for (col = (tag & 1)*ph1.split_col; col < raw_width; col++)
-	  RAW(row,col) = curve[RAW(row,col)];
+	  RAW(r,col) = curve[RAW(r,col)];
     } else if (tag == 0x400) {			/* Sensor defects */
       while ((len -= 8) >= 0) {
 	col  = get2();
@@ -1690,11 +1984,14 @@ void CLASS phase_one_correct()
 	  cx[17] = cf[17] = ((unsigned) ref[15] * 65535) / lc[qr][qc][15];
 	  cx[18] = cf[18] = 65535;
 	  cubic_spline(cx, cf, 19);
-	  for (row = (qr ? ph1.split_row : 0);
-	       (int) row < (qr ? raw_height : ph1.split_row); row++)
+#ifdef _OPENMP
+	  #pragma omp parallel for private(col)
+#endif
+	  for (r = (qr ? ph1.split_row : 0);
+	       r < (qr ? raw_height : ph1.split_row); r++)
 	    for (col = (qc ? ph1.split_col : 0);
 		 (int) col < (qc ? raw_width : ph1.split_col); col++)
-	      RAW(row,col) = curve[RAW(row,col)];
+	      RAW(r,col) = curve[RAW(r,col)];
 	}
       }
       qlin_applied = 1;
@@ -1708,10 +2005,13 @@ void CLASS phase_one_correct()
       qmult[1][0] = 1.0 + getreal(11);
       get4(); get4(); get4();
       qmult[1][1] = 1.0 + getreal(11);
-      for (row=0; row < raw_height; row++)
+#ifdef _OPENMP
+      #pragma omp parallel for private(col,i)
+#endif
+      for (r=0; r < raw_height; r++)
 	for (col=0; col < raw_width; col++) {
-	  i = qmult[(int) row >= ph1.split_row][(int) col >= ph1.split_col] * RAW(row,col);
-	  RAW(row,col) = LIM(i,0,65535);
+	  i = qmult[r >= ph1.split_row][(int) col >= ph1.split_col] * RAW(r,col);
+	  RAW(r,col) = LIM(i,0,65535);
 	}
       qmult_applied = 1;
     } else if (tag == 0x431 && !qmult_applied) { /* Quadrant combined */
@@ -1733,11 +2033,14 @@ void CLASS phase_one_correct()
 	  cx[0] = cf[0] = 0;
 	  cx[8] = cf[8] = 65535;
 	  cubic_spline(cx, cf, 9);
-	  for (row = (qr ? ph1.split_row : 0);
-	       (int) row < (qr ? raw_height : ph1.split_row); row++)
+#ifdef _OPENMP
+	  #pragma omp parallel for private(col)
+#endif
+	  for (r = (qr ? ph1.split_row : 0);
+	       r < (qr ? raw_height : ph1.split_row); r++)
 	    for (col = (qc ? ph1.split_col : 0);
 		 (int) col < (qc ? raw_width : ph1.split_col); col++)
-	      RAW(row,col) = curve[RAW(row,col)];
+	      RAW(r,col) = curve[RAW(r,col)];
 	}
       }
       qmult_applied = 1;
@@ -1760,11 +2063,14 @@ void CLASS phase_one_correct()
     for (i=0; i < 2; i++)
       for (j=0; j < head[i+1]*head[i+3]; j++)
 	xval[i][j] = get2();
-    for (row=0; row < raw_height; row++)
+#ifdef _OPENMP
+    #pragma omp parallel for private(col,cfrac,cip,num,i,j,k,frac,mult)
+#endif
+    for (r=0; r < raw_height; r++)
       for (col=0; col < raw_width; col++) {
 	cfrac = (float) col * head[3] / raw_width;
 	cfrac -= cip = cfrac;
-	num = RAW(row,col) * 0.5;
+	num = RAW(r,col) * 0.5;
 	for (i=cip; i < cip+2; i++) {
 	  for (k=j=0; j < head[1]; j++)
 	    if (num < xval[0][k = head[1]*i+j]) break;
@@ -1772,8 +2078,8 @@ void CLASS phase_one_correct()
 		(xval[0][k] - num) / (xval[0][k] - xval[0][k-1]);
 	  mult[i-cip] = yval[0][k-1] * frac + yval[0][k] * (1-frac);
 	}
-	i = ((mult[0] * (1-cfrac) + mult[1] * cfrac) * row + num) * 2;
-	RAW(row,col) = LIM(i,0,65535);
+	i = ((mult[0] * (1-cfrac) + mult[1] * cfrac) * r + num) * 2;
+	RAW(r,col) = LIM(i,0,65535);
       }
     free (yval[0]);
   }
@@ -1801,9 +2107,8 @@ void CLASS phase_one_load_raw()
 
 unsigned CLASS ph1_bithuff (int nbits, ushort *huff)
 {
-  // TODO: The following static variables are not thread-safe
-  static UINT64 bitbuf=0;
-  static int vbits=0;
+  UINT64 &bitbuf=ph1_bitbuf;
+  int &vbits=ph1_vbits;
   unsigned c;
 
   if (nbits == -1)
@@ -1824,6 +2129,156 @@ unsigned CLASS ph1_bithuff (int nbits, ushort *huff)
 #define ph1_bits(n) ph1_bithuff(n,0)
 #define ph1_huff(h) ph1_bithuff(*h,h+1)
 
+/*
+   Every row of a compressed IIQ file starts at an offset from a table
+   and resets the bit reader and predictors, so when the file is in
+   memory the rows are decoded in parallel, each with its own reader.
+ */
+struct ph1_stream {
+  const uchar *bp, *bend;
+  UINT64 bitbuf;
+  int vbits, order, errors;
+};
+
+static unsigned ph1_stream_bits (struct ph1_stream *s, int nbits)
+{
+  unsigned c;
+
+  if (nbits == 0) return 0;
+  if (s->vbits < nbits) {
+    if (s->bp + 4 <= s->bend) {
+      c = s->order == 0x4949 ?
+	s->bp[0] | s->bp[1] << 8 | s->bp[2] << 16 | (unsigned) s->bp[3] << 24 :
+	(unsigned) s->bp[0] << 24 | s->bp[1] << 16 | s->bp[2] << 8 | s->bp[3];
+      s->bp += 4;
+    } else {
+      c = 0;
+      s->errors++;
+    }
+    s->bitbuf = s->bitbuf << 32 | c;
+    s->vbits += 32;
+  }
+  c = s->bitbuf << (64-s->vbits) >> (64-nbits);
+  s->vbits -= nbits;
+  return c;
+}
+
+/*
+   A block that starts with a 1 bit keeps the length of the block before
+   it, even across rows.  Rows are decoded from len[] as carried in and
+   leave it as carried out; 4 in the result means that the carried in
+   length was used, so the row must be decoded again once the row above
+   is known.
+ */
+int CLASS phase_one_decode_row (struct ph1_stream *s, ushort *pixel, int len[2])
+{
+  static const int length[] = { 8,7,6,9,11,10,5,12,14,13 };
+  int pred[2], set[2], col, i, j, status=0;
+
+  pred[0] = pred[1] = set[0] = set[1] = 0;
+  for (col=0; col < raw_width; col++) {
+    if (col >= (raw_width & -8))
+      len[0] = len[1] = set[0] = set[1] = 14;
+    else if ((col & 7) == 0)
+      for (i=0; i < 2; i++) {
+	for (j=0; j < 5 && !ph1_stream_bits(s, 1); j++);
+	if (j--) set[i] = len[i] = length[j*2 + ph1_stream_bits(s, 1)];
+      }
+    if (!set[col & 1]) status |= 4;
+    if ((i = len[col & 1]) == 14)
+      pixel[col] = pred[col & 1] = ph1_stream_bits(s, 16);
+    else
+      pixel[col] = pred[col & 1] += ph1_stream_bits(s, i) + 1 - (1 << (i - 1));
+    if (pred[col & 1] >> 16) status |= 1;
+    if (ph1.format == 5 && pixel[col] < 256)
+      pixel[col] = curve[pixel[col]];
+  }
+  return status | (s->errors > 0);
+}
+
+int CLASS phase_one_load_row (int row, int *offset, short (*cblack)[2],
+	short (*rblack)[2], ushort *pixel, int len[2], unsigned *bytes)
+{
+  struct ph1_stream s;
+  off_t pos;
+  int col, i, status;
+
+  pos = data_offset + offset[row];
+  if (pos < 0 || (size_t) pos > ifpBufferSize) return 1;
+  s.bp = ifpBuffer + pos;
+  s.bend = ifpBuffer + ifpBufferSize;
+  s.bitbuf = s.vbits = s.errors = 0;
+  s.order = order;
+  status = phase_one_decode_row (&s, pixel, len);
+  *bytes += s.bp - (ifpBuffer + pos);
+  for (col=0; col < raw_width; col++) {
+    i = (pixel[col] << 2*(ph1.format != 8)) - ph1.black
+      + cblack[row][col >= ph1.split_col]
+      + rblack[col][row >= ph1.split_row];
+    if (i > 0) RAW(row,col) = i;
+  }
+  return status;
+}
+
+void CLASS phase_one_load_rows (int *offset, short (*cblack)[2],
+	short (*rblack)[2])
+{
+  int row, status=0, carry[2];
+  unsigned bytes=0, redo=0;
+  int (*lens)[3];
+  ushort *pixel;
+
+  lens = (int (*)[3]) calloc (raw_height, sizeof *lens);
+  merror (lens, "phase_one_load_rows()");
+#ifdef _OPENMP
+  #pragma omp parallel private(pixel) reduction(|:status) reduction(+:bytes)
+#endif
+  {
+    /* Every thread must reach the loop, even without a buffer */
+    pixel = (ushort *) calloc (raw_width, sizeof *pixel);
+    if (!pixel) status = 2;
+#ifdef _OPENMP
+    #pragma omp for schedule(dynamic,16)
+#endif
+    for (row=0; row < raw_height; row++) {
+      if (!pixel) continue;
+      lens[row][0] = lens[row][1] = 14;
+      lens[row][2] = phase_one_load_row (row, offset, cblack, rblack,
+		pixel, lens[row], &bytes);
+      status |= lens[row][2];
+    }
+    free (pixel);
+  }
+  if (status & 2) {
+    free (lens);
+    merror (NULL, "phase_one_load_rows()");
+  }
+  /* Decode again, in order, the rows that started with the lengths
+     carried in from the row above */
+  if (status & 4) {
+    pixel = (ushort *) calloc (raw_width, sizeof *pixel);
+    if (!pixel) free (lens);
+    merror (pixel, "phase_one_load_rows()");
+    for (row=1; row < raw_height; row++) {
+      if (!(lens[row][2] & 4) ||
+	  (lens[row-1][0] == 14 && lens[row-1][1] == 14)) continue;
+      carry[0] = lens[row-1][0];
+      carry[1] = lens[row-1][1];
+      memset (&RAW(row,0), 0, raw_width * sizeof *raw_image);
+      lens[row][2] = phase_one_load_row (row, offset, cblack, rblack,
+		pixel, carry, &redo);
+      lens[row][0] = carry[0];
+      lens[row][1] = carry[1];
+    }
+    free (pixel);
+  }
+  for (status=row=0; row < raw_height; row++)
+    status |= lens[row][2] & 1;
+  free (lens);
+  if (status) derror();
+  ifpProgress (bytes);
+}
+
 void CLASS phase_one_load_raw_c()
 {
   static const int length[] = { 8,7,6,9,11,10,5,12,14,13 };
@@ -1847,6 +2302,13 @@ void CLASS phase_one_load_raw_c()
     read_shorts ((ushort *) rblack[0], raw_width*2);
   for (i=0; i < 256; i++)
     curve[i] = i*i / 3.969 + 0.5;
+  len[0] = len[1] = 14;
+  if (ifpBuffer && (size_t) data_offset <= ifpBufferSize) {
+    phase_one_load_rows (offset, cblack, rblack);
+    free (pixel);
+    maximum = 0xfffc - ph1.black;
+    return;
+  }
   for (row=0; row < raw_height; row++) {
     fseek (ifp, data_offset + offset[row], SEEK_SET);
     ph1_bits(-1);
@@ -1963,12 +2425,49 @@ void CLASS leaf_hdr_load_raw()
   }
 }
 
+/*
+   Uncompressed 16-bit data, such as that of uncompressed Sony ARW files,
+   is converted straight from memory a row per thread.
+ */
+void CLASS unpacked_load_rows (unsigned count, int bits)
+{
+  const uchar *data = ifpBuffer + ftell(ifp);
+  int row, errors=0;
+
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static) reduction(+:errors)
+#endif
+  for (row=0; row < raw_height; row++) {
+    const uchar *bp = data + (size_t) row * raw_width * 2;
+    ushort *rp = raw_image + (size_t) row * raw_width;
+    unsigned col, n = (unsigned) row * raw_width >= count ? 0 :
+	MIN ((unsigned) raw_width, count - (unsigned) row * raw_width);
+    if (order == 0x4949)
+      for (col=0; col < n; col++)
+	rp[col] = (bp[col*2] | bp[col*2+1] << 8) >> load_flags;
+    else
+      for (col=0; col < n; col++)
+	rp[col] = (bp[col*2] << 8 | bp[col*2+1]) >> load_flags;
+    if ((unsigned) (row-top_margin) < height)
+      for (col=left_margin; col < (unsigned) left_margin + width; col++)
+	errors += rp[col] >> bits != 0;
+  }
+  fseek (ifp, (size_t) count * 2, SEEK_CUR);
+  ifpProgress ((size_t) count * 2);
+  if (errors) derror();
+}
+
 void CLASS unpacked_load_raw()
 {
   int row, col, bits=0;
+  unsigned count = raw_width*raw_height - (fuji_layout && shot_select ? raw_width >> 1 : 0);
 
   while ((unsigned) 1 << ++bits < maximum);
-  read_shorts (raw_image, raw_width*raw_height - (fuji_layout && shot_select ? raw_width >> 1 : 0));
+  if (ifpBuffer && ftell(ifp) + (size_t) count * 2 <= ifpBufferSize) {
+    unpacked_load_rows (count, bits);
+    return;
+  }
+  read_shorts (raw_image, count);
   for (row=0; row < raw_height; row++)
     for (col=0; col < raw_width; col++)
       if ((RAW(row,col) >>= load_flags) >> bits
@@ -2002,193 +2501,1582 @@ void CLASS sinar_4shot_load_raw()
       }
     }
   }
-  free (pixel);
-  mix_green = 1;
+  free (pixel);
+  mix_green = 1;
+}
+
+void CLASS imacon_full_load_raw()
+{
+  int row, col;
+
+  if (!image) return;
+  for (row=0; row < height; row++)
+    for (col=0; col < width; col++)
+      read_shorts (image[row*width+col], 3);
+}
+
+/*
+   Rows that are neither interlaced nor padded with filler bytes are
+   unpacked straight from memory, a row per thread.  The words of bite
+   bits are stored little-endian and read from the top bit down, so they
+   are addressed as a big-endian byte stream.  Byte-packed 12 and 14-bit
+   data and 12-bit data in 32-bit words get loops of their own.
+ */
+int CLASS packed_load_rows (int bwide, int bite)
+{
+  const uchar *data = ifpBuffer + ftell(ifp);
+  int bytes = bite >> 3, flip = load_flags >> 6 & 3, mask = (1 << tiff_bps) - 1;
+  size_t size = (size_t) raw_height * bwide;
+  int row;
+
+  size += (bytes - size % bytes) % bytes;
+  if (bite > 32 || load_flags & 3 || ftell(ifp) + size > ifpBufferSize)
+    return 0;
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
+  for (row=0; row < raw_height; row++) {
+    const uchar *bp = data + (size_t) row * bwide;
+    ushort *rp = raw_image + (size_t) row * raw_width;
+    int col=0, vbits=0;
+    unsigned w0, w1, w2;
+    UINT64 bitbuf=0;
+    size_t j;
+
+    if (bytes == 1 && tiff_bps == 12)
+      for (; col+1 < raw_width; col+=2, bp+=3) {
+	rp[ col    ^ flip] = bp[0] << 4 | bp[1] >> 4;
+	rp[(col+1) ^ flip] = (bp[1] & 15) << 8 | bp[2];
+      }
+    else if (bytes == 1 && tiff_bps == 14)
+      for (; col+3 < raw_width; col+=4, bp+=7) {
+	rp[ col    ^ flip] = bp[0] << 6 | bp[1] >> 2;
+	rp[(col+1) ^ flip] = (bp[1] & 3) << 12 | bp[2] << 4 | bp[3] >> 4;
+	rp[(col+2) ^ flip] = (bp[3] & 15) << 10 | bp[4] << 2 | bp[5] >> 6;
+	rp[(col+3) ^ flip] = (bp[5] & 63) << 8 | bp[6];
+      }
+    else if (bytes == 4 && tiff_bps == 12 && (bp - data) % 4 == 0)
+      for (; col+7 < raw_width; col+=8, bp+=12) {
+	w0 = bp[0] | bp[1] << 8 | bp[2] << 16 | (unsigned) bp[3] << 24;
+	w1 = bp[4] | bp[5] << 8 | bp[6] << 16 | (unsigned) bp[7] << 24;
+	w2 = bp[8] | bp[9] << 8 | bp[10] << 16 | (unsigned) bp[11] << 24;
+	rp[ col    ^ flip] = w0 >> 20;
+	rp[(col+1) ^ flip] = w0 >> 8 & 0xfff;
+	rp[(col+2) ^ flip] = (w0 & 0xff) << 4 | w1 >> 28;
+	rp[(col+3) ^ flip] = w1 >> 16 & 0xfff;
+	rp[(col+4) ^ flip] = w1 >> 4 & 0xfff;
+	rp[(col+5) ^ flip] = (w1 & 15) << 8 | w2 >> 24;
+	rp[(col+6) ^ flip] = w2 >> 12 & 0xfff;
+	rp[(col+7) ^ flip] = w2 & 0xfff;
+      }
+    for (j = bp - data; col < raw_width; col++) {
+      for (; vbits < (int) tiff_bps; vbits += 8, j++)
+	bitbuf = bitbuf << 8 | data[bytes == 3 ? j / 3 * 3 + 2 - j % 3 : j ^ (bytes-1)];
+      rp[col ^ flip] = bitbuf >> (vbits -= tiff_bps) & mask;
+    }
+  }
+  fseek (ifp, size, SEEK_CUR);
+  ifpProgress (size);
+  return 1;
+}
+
+void CLASS packed_load_raw()
+{
+  int vbits=0, bwide, rbits, bite, half, irow, row, col, val, i;
+  UINT64 bitbuf=0;
+
+  bwide = raw_width * tiff_bps / 8;
+  bwide += bwide & load_flags >> 9;
+  rbits = bwide * 8 - raw_width * tiff_bps;
+  if (load_flags & 1) bwide = bwide * 16 / 15;
+  bite = 8 + (load_flags & 56);
+  if (ifpBuffer && packed_load_rows (bwide, bite)) return;
+  half = (raw_height+1) >> 1;
+  for (irow=0; irow < raw_height; irow++) {
+    row = irow;
+    if (load_flags & 2 &&
+	(row = irow % half * 2 + irow / half) == 1 &&
+	load_flags & 4) {
+      if (vbits=0, tiff_compress)
+	fseek (ifp, data_offset - (-half*bwide & -2048), SEEK_SET);
+      else {
+	fseek (ifp, 0, SEEK_END);
+	fseek (ifp, ftell(ifp) >> 3 << 2, SEEK_SET);
+      }
+    }
+    for (col=0; col < raw_width; col++) {
+      for (vbits -= tiff_bps; vbits < 0; vbits += bite) {
+	bitbuf <<= bite;
+	for (i=0; i < bite; i+=8)
+	  bitbuf |= ((UINT64) fgetc(ifp) << i);
+      }
+      val = bitbuf << (64-tiff_bps-vbits) >> (64-tiff_bps);
+      RAW(row,col ^ (load_flags >> 6 & 3)) = val;
+      if (load_flags & 1 && (col % 10) == 9 && fgetc(ifp) &&
+	row < height+top_margin && col < width+left_margin) derror();
+    }
+    vbits -= rbits;
+  }
+}
+
+void CLASS nokia_load_raw()
+{
+  uchar  *data,  *dp;
+  int rev, dwide, row, col, c;
+  double sum[]={0,0};
+
+  rev = 3 * (order == 0x4949);
+  dwide = (raw_width * 5 + 1) / 4;
+  data = (uchar *) malloc (dwide*2);
+  merror (data, "nokia_load_raw()");
+  for (row=0; row < raw_height; row++) {
+    if ((int) fread (data+dwide, 1, dwide, ifp) < dwide) derror();
+    FORC(dwide) data[c] = data[dwide+(c ^ rev)];
+    for (dp=data, col=0; col < raw_width; dp+=5, col+=4)
+      FORC4 RAW(row,col+c) = (dp[c] << 2) | (dp[4] >> (c << 1) & 3);
+  }
+  free (data);
+  maximum = 0x3ff;
+  if (strcmp(make,"OmniVision")) return;
+  row = raw_height/2;
+  FORC(width-1) {
+    sum[ c & 1] += SQR(RAW(row,c)-RAW(row+1,c+1));
+    sum[~c & 1] += SQR(RAW(row+1,c)-RAW(row,c+1));
+  }
+  if (sum[1] > sum[0]) filters = 0x4b4b4b4b;
+}
+
+void CLASS canon_rmf_load_raw()
+{
+  int row, col, bits, orow, ocol, c;
+
+  for (row=0; row < raw_height; row++)
+    for (col=0; col < raw_width-2; col+=3) {
+      bits = get4();
+      FORC3 {
+	orow = row;
+	if ((ocol = col+c-4) < 0) {
+	  ocol += raw_width;
+	  if ((orow -= 2) < 0)
+	    orow += raw_height;
+	}
+	RAW(orow,ocol) = curve[bits >> (10*c+2) & 0x3ff];
+      }
+    }
+  maximum = curve[0x3ff];
+}
+
+unsigned CLASS pana_bits (int nbits)
+{
+  uchar *buf=pana_buf;
+  int &vbits=pana_vbits;
+  int byte;
+
+  if (!nbits) return vbits=0;
+  if (!vbits) {
+    fread (buf+load_flags, 1, 0x4000-load_flags, ifp);
+    fread (buf, 1, load_flags, ifp);
+  }
+  vbits = (vbits - nbits) & 0x1ffff;
+  byte = vbits >> 3 ^ 0x3ff0;
+  return (buf[byte] | buf[byte+1] << 8) >> (vbits & 7) & ~(-1 << nbits);
+}
+
+/*
+   Each 0x4000-byte block, rotated by load_flags bytes, holds 1024 groups
+   of 14 pixels in 128 bits, read from the top bit down.  A group resets
+   its predictors, so it decodes on its own as long as it takes exactly
+   128 bits, which is checked by returning the bits left over.
+ */
+static inline unsigned pana_group_bits (const UINT64 word[2], int &pos, int nbits)
+{
+  UINT64 val;
+
+  if (pos < nbits) return pos = -256, 0;
+  pos -= nbits;
+  if (pos >= 64) val = word[1] >> (pos - 64);
+  else if (pos + nbits > 64) val = word[0] >> pos | word[1] << (64 - pos);
+  else val = word[0] >> pos;
+  return val & ((1 << nbits) - 1);
+}
+
+int CLASS panasonic_decode_group (const uchar *gp, ushort *pix)
+{
+  UINT64 word[2] = { 0, 0 };
+  int pos=128, i, j, c, sh=0, pred[2]={0,0}, nonz[2]={0,0};
+
+  for (i=8; i--; ) {
+    word[0] = word[0] << 8 | gp[i];
+    word[1] = word[1] << 8 | gp[i+8];
+  }
+  for (i=0; i < 14; i++) {
+    c = i & 1;
+    if (i % 3 == 2) sh = 4 >> (3 - pana_group_bits (word, pos, 2));
+    if (nonz[c]) {
+      if ((j = pana_group_bits (word, pos, 8))) {
+	if ((pred[c] -= 0x80 << sh) < 0 || sh == 4)
+	     pred[c] &= ~(-1 << sh);
+	pred[c] += j << sh;
+      }
+    } else if ((nonz[c] = pana_group_bits (word, pos, 8)) || i > 11)
+      pred[c] = nonz[c] << 4 | pana_group_bits (word, pos, 4);
+    pix[i] = pred[c];
+  }
+  return pos;
+}
+
+int CLASS panasonic_load_rows()
+{
+  size_t base = ftell(ifp), groups = (size_t) height * (raw_width / 14);
+  int row, bad=0, errors=0;
+
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static) reduction(+:bad,errors)
+#endif
+  for (row=0; row < height; row++) {
+    uchar grp[16];
+    ushort *rp = raw_image + (size_t) row * raw_width;
+    int col, k;
+    size_t g, blk;
+    for (col=0; col < raw_width && !bad; col += 14) {
+      g = ((size_t) row * raw_width + col) / 14;
+      blk = base + (g >> 10) * 0x4000;
+      if (blk + 0x4000 > ifpBufferSize) { bad++; break; }
+      for (k=0; k < 16; k++)
+	grp[k] = ifpBuffer[blk + ((((g & 1023) << 4 | k) - load_flags) & 0x3fff)];
+      if (panasonic_decode_group (grp, rp + col)) bad++;
+    }
+    for (col=0; col < width; col++)
+      errors += rp[col] > 4098;
+  }
+  if (bad) return 0;
+  fseek (ifp, base + ((groups + 1023) >> 10) * 0x4000, SEEK_SET);
+  ifpProgress (((groups + 1023) >> 10) * 0x4000);
+  if (errors) derror();
+  return 1;
+}
+
+void CLASS panasonic_load_raw()
+{
+  int row, col, i, j, sh=0, pred[2], nonz[2];
+
+  if (ifpBuffer && raw_width % 14 == 0 && panasonic_load_rows()) return;
+  pana_bits(0);
+  for (row=0; row < height; row++)
+    for (col=0; col < raw_width; col++) {
+      if ((i = col % 14) == 0)
+	pred[0] = pred[1] = nonz[0] = nonz[1] = 0;
+      if (i % 3 == 2) sh = 4 >> (3 - pana_bits(2));
+      if (nonz[i & 1]) {
+	if ((j = pana_bits(8))) {
+	  if ((pred[i & 1] -= 0x80 << sh) < 0 || sh == 4)
+	       pred[i & 1] &= ~(-1 << sh);
+	  pred[i & 1] += j << sh;
+	}
+      } else if ((nonz[i & 1] = pana_bits(8)) || i > 11)
+	pred[i & 1] = nonz[i & 1] << 4 | pana_bits(4);
+      if ((RAW(row,col) = pred[col & 1]) > 4098 && col < width) derror();
+    }
+}
+
+void CLASS olympus_load_raw()
+{
+  ushort huff[4096];
+  int row, col, nbits, sign, low, high, i, c, w, n, nw;
+  int acarry[2][3], *carry, pred, diff;
+
+  huff[n=0] = 0xc0c;
+  for (i=12; i--; )
+    FORC(2048 >> i) huff[++n] = (i+1) << 8 | i;
+  fseek (ifp, 7, SEEK_CUR);
+  getbits(-1);
+  for (row=0; row < height; row++) {
+    memset (acarry, 0, sizeof acarry);
+    for (col=0; col < raw_width; col++) {
+      carry = acarry[col & 1];
+      i = 2 * (carry[2] < 3);
+      for (nbits=2+i; (ushort) carry[0] >> (nbits+i); nbits++);
+      low = (sign = getbits(3)) & 3;
+      sign = sign << 29 >> 31;
+      if ((high = getbithuff(12,huff)) == 12)
+	high = getbits(16-nbits) >> 1;
+      carry[0] = (high << nbits) | getbits(nbits);
+      diff = (carry[0] ^ sign) + carry[1];
+      carry[1] = (diff*3 + carry[1]) >> 5;
+      carry[2] = carry[0] > 16 ? 0 : carry[2]+1;
+      if (col >= width) continue;
+      if (row < 2 && col < 2) pred = 0;
+      else if (row < 2) pred = RAW(row,col-2);
+      else if (col < 2) pred = RAW(row-2,col);
+      else {
+	w  = RAW(row,col-2);
+	n  = RAW(row-2,col);
+	nw = RAW(row-2,col-2);
+	if ((w < nw && nw < n) || (n < nw && nw < w)) {
+	  if (ABS(w-nw) > 32 || ABS(n-nw) > 32)
+	    pred = w + n - nw;
+	  else pred = (w + n) >> 1;
+	} else pred = ABS(w-nw) > ABS(n-nw) ? w : n;
+      }
+      if ((RAW(row,col) = pred + ((diff << 2) | low)) >> 12) derror();
+    }
+  }
+}
+
+/*
+   Canon CRX (CR3).  The raw image is split into four planes, one per
+   CFA colour, and every plane into the same grid of tiles.  Each tile
+   of each plane holds up to three levels of the 5/3 integer wavelet,
+   every subband coded on its own with adaptive Golomb-Rice codes and
+   run lengths, so all tiles of all planes are decoded in parallel.
+ */
+enum { CRX_RIGHT=1, CRX_LEFT=2, CRX_BOTTOM=4, CRX_TOP=8 };
+
+struct crx_bits {
+  const uchar *bp, *bend;
+  UINT64 buf;
+  int left, errors;
+};
+
+struct crx_qstep {
+  unsigned *table;
+  int width, height;
+};
+
+struct crx_band {
+  struct crx_bits bits;
+  unsigned offset, size;
+  int width, height, line, partial, mask, rbits, k, s;
+  int *prev, *cur, *kbuf;
+  int qparam, qk, qpartial, col0, col1, row0, shift;
+  unsigned qbase, qmult;
+  const struct crx_qstep *qstep;
+};
+
+struct crx_comp {
+  unsigned offset, size;
+  int partial, mask;
+  struct crx_band band[10];
+};
+
+struct crx_tile {
+  int row, col, width, height, flags;
+  unsigned offset, size, qp_size, extra;
+  unsigned *qtable;
+  struct crx_qstep qstep[3];
+  struct crx_comp comp[4];
+};
+
+struct crx_image {
+  int version, nbits, cfa, enc, levels, bands, median_bits;
+  int width, height, tile_width, tile_height, cols, rows;
+  const uchar *data;
+  struct crx_tile *tile;
+  short *plane;
+};
+
+/* One level of the inverse wavelet, made a row at a time */
+struct crx_level {
+  int width, height, flags;
+  struct crx_level *src;
+  struct crx_band *ll, *hl, *lh, *hh;
+  int *hrow[4], *erow[2], *lrow, *orow;
+  int hlines, elines, next;
+};
+
+static const int crx_jbits[32] = { 0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,
+	4,4,5,5,6,6,7,7,8,9,10,11,12,13,14,15 };
+
+static void crx_fill (struct crx_bits *s)
+{
+  while (s->left <= 56) {
+    if (s->bp < s->bend)
+      s->buf |= (UINT64) *s->bp++ << (56 - s->left);
+    s->left += 8;
+  }
+}
+
+static unsigned crx_getbits (struct crx_bits *s, int n)
+{
+  unsigned v;
+
+  if (!n) return 0;
+  if (s->left < n) crx_fill (s);
+  v = s->buf >> (64 - n);
+  s->buf <<= n;
+  s->left -= n;
+  return v;
+}
+
+/* Counts the zero bits before the next one bit, which is skipped too */
+static unsigned crx_zeros (struct crx_bits *s)
+{
+  unsigned n=0;
+
+  for (;;) {
+    if (s->left < 32) crx_fill (s);
+    if (s->buf) break;
+    if (s->bp >= s->bend) {
+      s->errors++;
+      return n;
+    }
+    n += s->left;
+    s->left = 0;
+  }
+  for (; !(s->buf >> 56); s->left -= 8, n += 8) s->buf <<= 8;
+  for (; !(s->buf >> 63); s->left--, n++) s->buf <<= 1;
+  s->buf <<= 1;
+  s->left--;
+  return n;
+}
+
+static unsigned crx_code (struct crx_bits *s, int k)
+{
+  unsigned code = crx_zeros (s);
+
+  if (code >= 41) return crx_getbits (s, 21);
+  return k ? crx_getbits (s, k) | code << k : code;
+}
+
+static unsigned crx_qp_code (struct crx_bits *s, int k)
+{
+  unsigned code = crx_zeros (s);
+
+  if (code >= 23) return crx_getbits (s, 8);
+  return k ? crx_getbits (s, k) | code << k : code;
+}
+
+static int crx_signed (unsigned code)
+{
+  return -(int) (code & 1) ^ (int) (code >> 1);
+}
+
+static int crx_next_k (int k, unsigned code, int max)
+{
+  k += ((code >> k) > 2) + ((code >> k) > 5) - (code < (1U << k >> 1));
+  return max && k > max ? max : k;
+}
+
+/* Length of a run of repeated samples, at most 'left', 0 if none */
+static int crx_run (struct crx_bits *s, int *sp, int left)
+{
+  int n=1;
+
+  if (!crx_getbits (s, 1)) return 0;
+  while (crx_getbits (s, 1)) {
+    if ((n += 1 << crx_jbits[*sp]) > left) return left;
+    if (*sp < 31) ++*sp;
+    if (n == left) return n;
+  }
+  n += crx_getbits (s, crx_jbits[*sp]);
+  if (*sp > 0) --*sp;
+  if (n > left) {
+    s->errors++;
+    n = left;
+  }
+  return n;
+}
+
+/* Median of left, above and left + above - above left */
+static int crx_median (int left, int above, int diag)
+{
+  int delta = above - diag;
+
+  switch (((diag < left) ^ (delta < 0)) << 1 | ((left < above) ^ (delta < 0))) {
+    case 2:  return left;
+    case 3:  return above;
+  }
+  return left + delta;
+}
+
+/* Lines are indexed from -1 to width, the ends only give context */
+static void crx_symbol (struct crx_band *b, int i, int median, int more)
+{
+  int *p = b->prev, *c = b->cur;
+  unsigned code;
+
+  code = crx_code (&b->bits, b->k);
+  c[i] = (median ? crx_median (c[i-1], p[i], p[i-1]) : p[i])
+	+ crx_signed (code);
+  if (more) code = (code + 2 * ABS(p[i+1] - p[i])) >> 1;
+  b->k = crx_next_k (b->k, code, 15);
+}
+
+static void crx_top_line (struct crx_band *b)
+{
+  int *c = b->cur, i=0, left, n;
+  unsigned code;
+
+  c[-1] = 0;
+  for (left = b->width; left > 1; left--, i++) {
+    if (c[i-1]) c[i] = c[i-1];
+    else {
+      left -= n = crx_run (&b->bits, &b->s, left);
+      for (; n; n--, i++) c[i] = c[i-1];
+      if (left <= 0) break;
+      c[i] = 0;
+    }
+    code = crx_code (&b->bits, b->k);
+    c[i] += crx_signed (code);
+    b->k = crx_next_k (b->k, code, 15);
+  }
+  if (left == 1) {
+    code = crx_code (&b->bits, b->k);
+    c[i] = c[i-1] + crx_signed (code);
+    b->k = crx_next_k (b->k, code, 15);
+  }
+  c[b->width] = c[b->width-1] + 1;
+}
+
+static void crx_line (struct crx_band *b)
+{
+  int *p = b->prev, *c = b->cur, i=0, left, n;
+
+  c[-1] = p[0];
+  for (left = b->width; left > 1; left--, i++)
+    if (c[i-1] != p[i] || c[i-1] != p[i+1])
+      crx_symbol (b, i, 1, 1);
+    else {
+      left -= n = crx_run (&b->bits, &b->s, left);
+      for (; n; n--, i++) c[i] = c[i-1];
+      if (left <= 0) break;
+      crx_symbol (b, i, 0, left > 1);
+    }
+  if (left == 1) crx_symbol (b, i, 1, 0);
+  c[b->width] = c[b->width-1] + 1;
+}
+
+/* Lossless coding with the low bits rounded off */
+static void crx_symbol_rounded (struct crx_band *b, int i, int median, int more)
+{
+  int *p = b->prev, *c = b->cur, sym, delta;
+  unsigned code;
+
+  code = crx_code (&b->bits, b->k);
+  sym = crx_signed (code);
+  c[i] = (median ? crx_median (c[i-1], p[i], p[i-1]) : p[i])
+	+ b->mask * 2 * sym - (sym < 0);
+  if (more) {
+    if (p[i+1] > p[i])
+      delta = (p[i+1] - p[i] + b->mask - 1) >> b->rbits;
+    else delta = (p[i] - p[i+1] + b->mask) >> b->rbits;
+    code = (code + 2 * delta) >> 1;
+  }
+  b->k = crx_next_k (b->k, code, 15);
+}
+
+static void crx_top_line_rounded (struct crx_band *b)
+{
+  int *c = b->cur, i=0, left, n, sym;
+  unsigned code;
+
+  c[-1] = 0;
+  for (left = b->width; left > 1; left--, i++) {
+    if (ABS(c[i-1]) > b->mask) c[i] = c[i-1];
+    else {
+      left -= n = crx_run (&b->bits, &b->s, left);
+      for (; n; n--, i++) c[i] = c[i-1];
+      if (left <= 0) break;
+      c[i] = 0;
+    }
+    code = crx_code (&b->bits, b->k);
+    sym = crx_signed (code);
+    c[i] += b->mask * 2 * sym - (sym < 0);
+    b->k = crx_next_k (b->k, code, 15);
+  }
+  if (left == 1) {
+    code = crx_code (&b->bits, b->k);
+    sym = crx_signed (code);
+    c[i] = c[i-1] + b->mask * 2 * sym - (sym < 0);
+    b->k = crx_next_k (b->k, code, 15);
+  }
+  c[b->width] = c[b->width-1] + 1;
+}
+
+static void crx_line_rounded (struct crx_band *b)
+{
+  int *p = b->prev, *c = b->cur, i=0, left, n, reached=0;
+
+  p[-1] = c[-1] = p[0];
+  for (left = b->width; left > 1; left--)
+    if (ABS(p[i+1] - p[i]) > b->mask) {
+      crx_symbol_rounded (b, i++, 1, 1);
+      reached = 1;
+    } else if (reached || ABS(p[i-1] - c[i-1]) > b->mask) {
+      crx_symbol_rounded (b, i++, 1, 1);
+      reached = 0;
+    } else {
+      left -= n = crx_run (&b->bits, &b->s, left);
+      for (; n; n--, i++) c[i] = c[i-1];
+      if (left > 1) {
+	crx_symbol_rounded (b, i++, 0, 1);
+	reached = ABS(p[i] - p[i-1]) > b->mask;
+      } else if (left == 1)
+	crx_symbol_rounded (b, i++, 0, 0);
+    }
+  if (left == 1) crx_symbol_rounded (b, i, 1, 0);
+  c[b->width] = c[b->width-1] + 1;
+}
+
+/*
+   Wavelet detail bands are coded without prediction.  A zero context
+   starts a run of zeros, and the sample ending a run cannot be zero.
+   kbuf[] keeps the coding parameter of every column of the line above.
+ */
+static void crx_top_line_noref (struct crx_band *b)
+{
+  int *c = b->cur, *kb = b->kbuf, i=0, left, n;
+  unsigned code;
+
+  b->prev[-1] = c[-1] = 0;
+  for (left = b->width; left > 1; left--, i++) {
+    if (c[i-1]) {
+      code = crx_code (&b->bits, b->k);
+      c[i] = crx_signed (code);
+    } else {
+      left -= n = crx_run (&b->bits, &b->s, left);
+      for (; n; n--, i++) kb[i] = c[i] = 0;
+      if (left <= 0) break;
+      code = crx_code (&b->bits, b->k);
+      c[i] = crx_signed (code + 1);
+    }
+    kb[i] = b->k = crx_next_k (b->k, code, 15);
+  }
+  if (left == 1) {
+    code = crx_code (&b->bits, b->k);
+    c[i] = crx_signed (code);
+    kb[i] = b->k = crx_next_k (b->k, code, 15);
+  }
+  c[b->width] = 0;
+}
+
+static void crx_line_noref (struct crx_band *b)
+{
+  int *p = b->prev, *c = b->cur, *kb = b->kbuf, w = b->width, i, n;
+  unsigned code;
+
+  for (i=0; i < w-1; i++) {
+    if (p[i+1] | p[i] | c[i-1]) {
+      code = crx_code (&b->bits, b->k);
+      c[i] = crx_signed (code);
+    } else {
+      n = crx_run (&b->bits, &b->s, w-i);
+      for (; n; n--, i++) kb[i] = c[i] = 0;
+      if (i >= w-1) {
+	if (i == w-1) {
+	  code = crx_code (&b->bits, b->k);
+	  c[i] = crx_signed (code + 1);
+	  kb[i] = b->k = crx_next_k (b->k, code, 15);
+	}
+	continue;
+      }
+      code = crx_code (&b->bits, b->k);
+      c[i] = crx_signed (code + 1);
+    }
+    b->k = crx_next_k (b->k, code, 0);
+    if (kb[i+1] - b->k > 1) b->k++;
+    else if (b->k > 15) b->k = 15;
+    kb[i] = b->k;
+  }
+  if (i == w-1) {
+    code = crx_code (&b->bits, b->k);
+    c[i] = crx_signed (code);
+    kb[i] = b->k = crx_next_k (b->k, code, 15);
+  }
+}
+
+static unsigned crx_qscale (int q)
+{
+  static const unsigned step[6] = { 0x28, 0x2d, 0x33, 0x39, 0x40, 0x48 };
+
+  q = LIM(q, 0, 179);
+  return q / 6 >= 6 ? step[q % 6] << (q / 6 - 6) : step[q % 6] >> (6 - q / 6);
+}
+
+/* Decodes the next line of a subband into b->cur */
+static int *crx_band_next (struct crx_band *b, int quantized)
+{
+  const struct crx_qstep *q = b->qstep;
+  const unsigned *qrow;
+  unsigned code, scale;
+  int *t, i, col, last;
+
+  t = b->prev;
+  b->prev = b->cur;
+  b->cur = t;
+  if (!b->size) {
+    memset (b->cur, 0, b->width * sizeof *b->cur);
+    b->line++;
+    return b->cur;
+  }
+  if (quantized && b->qpartial && !q) {
+    code = crx_qp_code (&b->bits, b->qk);
+    b->qparam += crx_signed (code);
+    if ((b->qk = crx_next_k (b->qk, code, 0)) > 7) {
+      b->bits.errors++;
+      b->qk = 7;
+    }
+  }
+  if (!b->partial)
+    b->line ? crx_line_noref (b) : crx_top_line_noref (b);
+  else if (b->mask)
+    b->line ? crx_line_rounded (b) : crx_top_line_rounded (b);
+  else
+    b->line ? crx_line (b) : crx_top_line (b);
+  if (quantized && q) {
+    qrow = q->table + q->width * LIM(b->line - b->row0, 0, q->height-1);
+    last = (b->width - b->col1 - b->col0 - 1) >> b->shift;
+    for (i=0; i < b->width; i++) {
+      col = i < b->col0 ? 0 : i >= b->width - b->col1 ? last :
+		(i - b->col0) >> b->shift;
+      scale = b->qbase + ((qrow[LIM(col, 0, q->width-1)] * b->qmult) >> 3);
+      b->cur[i] *= LIM(scale, 1, 0x168000);
+    }
+  } else if (quantized && (scale = crx_qscale (b->qparam)) != 1)
+    for (i=0; i < b->width; i++)
+      b->cur[i] *= scale;
+  b->line++;
+  return b->cur;
+}
+
+/*
+   One line of the inverse 5/3 lifting:
+	x[2n]   = lo[n] - (hi[n-1] + hi[n] + 2) / 4
+	x[2n+1] = hi[n] + (x[2n] + x[2n+2]) / 2
+   mirrored at the tile edges that have no neighbour.  A neighbour on
+   the left adds hi[-1] in front, one on the right the coefficients
+   needed past the end.
+ */
+static void crx_idwt_line (int *out, int width, const int *lo,
+	const int *hi, int nhi, int before, int after)
+{
+  int n, e;
+
+  if (width == 1) {
+    out[0] = lo[0];
+    return;
+  }
+  if (before) hi++, nhi--;
+  out[0] = lo[0] - ((hi[-!!before] + hi[0] + 2) >> 2);
+  for (n=1; 2*n < width; n++) {
+    out[2*n] = lo[n] - ((hi[n-1] + hi[MIN(n, nhi-1)] + 2) >> 2);
+    out[2*n-1] = hi[n-1] + ((out[2*n-2] + out[2*n]) >> 1);
+  }
+  if (!(width & 1)) {
+    n = width >> 1;
+    e = after ? lo[n] - ((hi[n-1] + hi[n] + 2) >> 2) : out[width-2];
+    out[width-1] = hi[n-1] + ((out[width-2] + e) >> 1);
+  }
+}
+
+static int *crx_level_row (struct crx_level *l);
+
+static void crx_low_row (struct crx_level *l)
+{
+  int *lo = l->src ? crx_level_row (l->src) : crx_band_next (l->ll, 1);
+
+  crx_idwt_line (l->lrow, l->width, lo, crx_band_next (l->hl, 1),
+	l->hl->width, l->flags & CRX_LEFT, l->flags & CRX_RIGHT);
+}
+
+/* Horizontally inverted high row k, k = -1 being the one above the tile */
+static int *crx_high_row (struct crx_level *l, int k)
+{
+  int *lo;
+
+  k = LIM(k + !!(l->flags & CRX_TOP), 0, l->hh->height-1);
+  while (l->hlines <= k) {
+    lo = crx_band_next (l->lh, 1);
+    crx_idwt_line (l->hrow[l->hlines++ & 3], l->width, lo,
+	crx_band_next (l->hh, 1), l->hh->width,
+	l->flags & CRX_LEFT, l->flags & CRX_RIGHT);
+  }
+  return l->hrow[k & 3];
+}
+
+static int *crx_even_row (struct crx_level *l, int n)
+{
+  int *e = l->erow[n & 1], *h0, *h1, i;
+
+  if (n < l->elines) return e;
+  crx_low_row (l);
+  h0 = crx_high_row (l, n-1);
+  h1 = crx_high_row (l, n);
+  for (i=0; i < l->width; i++)
+    e[i] = l->lrow[i] - ((h0[i] + h1[i] + 2) >> 2);
+  l->elines++;
+  return e;
+}
+
+static int *crx_level_row (struct crx_level *l)
+{
+  int y = l->next++, *e0, *e1, *h, i;
+
+  if (l->height == 1) {
+    crx_low_row (l);
+    return l->lrow;
+  }
+  if (!(y & 1)) return crx_even_row (l, y >> 1);
+  e0 = crx_even_row (l, y >> 1);
+  e1 = y+1 < l->height || (l->flags & CRX_BOTTOM) ?
+	crx_even_row (l, (y >> 1) + 1) : e0;
+  h = crx_high_row (l, y >> 1);
+  for (i=0; i < l->width; i++)
+    l->orow[i] = h[i] + ((e0[i] + e1[i]) >> 1);
+  return l->orow;
+}
+
+/*
+   Sizes along one axis of a tile of 'size' samples.  Level j makes
+   out[j] samples from lo[j] low and hi[j] high coefficients.  With a
+   neighbour after the tile, the coefficients the last samples need
+   from beyond it are coded as well: lo_ext[j] and hi_ext[j] of them.
+   With one before it, hi[j] starts with the coefficient before the tile.
+ */
+static void crx_axis (int size, int levels, int before, int after,
+	int *out, int *lo, int *hi, int *lo_ext, int *hi_ext)
+{
+  int j, n=size, m=size;
+
+  for (j=0; j < levels; j++) {
+    out[j] = m;
+    if (after)
+      lo[j] = hi[j] = (m+1) / 2 + !(m & 1);
+    else {
+      lo[j] = (n+1) >> 1;
+      hi[j] = n >> 1;
+    }
+    lo_ext[j] = lo[j] - ((n+1) >> 1);
+    hi_ext[j] = hi[j] - (n >> 1);
+    hi[j] += before;
+    n = (n+1) >> 1;
+    m = lo[j];
+  }
+}
+
+/*
+   Subband 0 is the lowest band, followed by three bands per level from
+   the coarsest, each high horizontally, vertically, and both.
+ */
+static void crx_band_sizes (const struct crx_image *img, struct crx_tile *t)
+{
+  int ow[3], lw[3], hw[3], lwx[3], hwx[3];
+  int oh[3], lh[3], hh[3], lhx[3], hhx[3];
+  int levels = img->levels, j, b, p, hx, hy;
+  struct crx_band *band;
+
+  crx_axis (t->width, levels, !!(t->flags & CRX_LEFT),
+	!!(t->flags & CRX_RIGHT), ow, lw, hw, lwx, hwx);
+  crx_axis (t->height, levels, !!(t->flags & CRX_TOP),
+	!!(t->flags & CRX_BOTTOM), oh, lh, hh, lhx, hhx);
+  for (p=0; p < 4; p++) {
+    band = t->comp[p].band;
+    band[0].width  = levels ? lw[levels-1] : t->width;
+    band[0].height = levels ? lh[levels-1] : t->height;
+    band[0].col0 = band[0].row0 = 0;
+    band[0].col1 = levels ? lwx[levels-1] : 0;
+    band[0].shift = 3 - levels;
+    band[0].qstep = t->qtable ? t->qstep : 0;
+    for (j=0; j < levels; j++)
+      for (b=0; b < 3; b++) {
+	band = t->comp[p].band + 1 + 3*(levels-1-j) + b;
+	hx = b != 1;
+	hy = b != 0;
+	band->width  = hx ? hw[j] : lw[j];
+	band->height = hy ? hh[j] : lh[j];
+	band->col0 = hx && (t->flags & CRX_LEFT);
+	band->col1 = hx ? hwx[j] : lwx[j];
+	band->row0 = hy && (t->flags & CRX_TOP);
+	band->shift = 2 - j;
+	band->qstep = t->qtable ? t->qstep + levels-1-j : 0;
+      }
+  }
+}
+
+/* The QP table of a tile gives quantization steps for 8x2 pixel blocks */
+static int crx_read_qp (const struct crx_image *img, struct crx_tile *t)
+{
+  struct crx_bits bits;
+  int qw = (t->width + 7) >> 3, qh = (t->height + 1) >> 1;
+  int *qp, *line[2], *l0, *l1, row, col, k=0, j, n, i, q;
+  unsigned code, *out;
+
+  memset (&bits, 0, sizeof bits);
+  bits.bp = img->data + t->offset;
+  bits.bend = bits.bp + t->qp_size;
+  qp = (int *) calloc (qw * (qh + 2) + 4, sizeof *qp);
+  t->qtable = (unsigned *) calloc (qw * (qh * 2 + 4), sizeof *t->qtable);
+  if (!qp || !t->qtable) {
+    free (qp);
+    return 2;
+  }
+  line[0] = qp + qw * qh;
+  line[1] = line[0] + qw + 2;
+  for (row=0; row < qh; row++) {
+    l0 = line[row & 1] + 1;
+    l1 = line[~row & 1] + 1;
+    if (!row) {
+      for (l1[-1]=col=0; col < qw; col++) {
+	code = crx_qp_code (&bits, k);
+	l1[col] = l1[col-1] + crx_signed (code);
+	k = crx_next_k (k, code, 7);
+      }
+    } else {
+      l1[-1] = l0[0];
+      for (col=0; col < qw; col++) {
+	code = crx_qp_code (&bits, k);
+	l1[col] = crx_median (l1[col-1], l0[col], l0[col-1])
+		+ crx_signed (code);
+	k = crx_next_k (k, col+1 < qw ?
+		(code + 2 * ABS(l0[col+1] - l0[col])) >> 1 : code, 7);
+      }
+    }
+    l1[qw] = l1[qw-1] + 1;
+    for (col=0; col < qw; col++)
+      qp[row*qw + col] = l1[col] + 4;
+  }
+  /* Coarser levels average 2 and 4 rows of the table */
+  out = t->qtable;
+  for (j=0; j < img->levels; j++) {
+    n = 1 << (img->levels-1 - j);
+    t->qstep[j].table = out;
+    t->qstep[j].width = qw;
+    t->qstep[j].height = (qh + n-1) / n;
+    for (row=0; row < t->qstep[j].height; row++)
+      for (col=0; col < qw; col++) {
+	for (q=i=0; i < n; i++)
+	  q += qp[MIN(row*n + i, qh-1) * qw + col];
+	*out++ = crx_qscale (q / n);
+      }
+  }
+  free (qp);
+  return bits.errors > 0;
+}
+
+/*
+   Returns 0 on success, 1 on damaged data and 2 when out of memory, so
+   that no longjmp() is taken from inside a parallel region.
+ */
+int CLASS crx_decode_tile (struct crx_image *img, struct crx_tile *t, int plane)
+{
+  struct crx_comp *comp = t->comp + plane;
+  struct crx_level level[3];
+  int nbands = img->bands, errors=0, size=0, row, col, i, j, v, *line;
+  int median = 1 << (img->nbits-1), max = (1 << img->nbits) - 1;
+  int pos = plane ^ img->cfa;
+  int *mem, *mp;
+  struct crx_band *b;
+  ushort *pix;
+  short *sp;
+
+  for (i=0; i < nbands; i++)
+    size += 3 * comp->band[i].width + 5;
+  size += img->levels * 8 * t->width;
+  if (!(mem = (int *) calloc (size, sizeof *mem))) return 2;
+  for (mp=mem, i=0; i < nbands; i++) {
+    b = comp->band + i;
+    memset (&b->bits, 0, sizeof b->bits);
+    b->bits.bp = img->data + t->offset + t->qp_size + t->extra
+	+ comp->offset + b->offset;
+    b->bits.bend = b->bits.bp + b->size;
+    b->prev = mp + 1;
+    b->cur = mp + b->width + 3;
+    b->kbuf = mp + 2 * b->width + 4;
+    mp += 3 * b->width + 5;
+    b->line = b->k = b->s = b->qk = 0;
+    b->partial = !i && comp->partial;
+    b->mask = b->partial ? comp->mask : 0;
+    for (b->rbits=1; b->mask >> b->rbits; b->rbits++);
+  }
+  for (j=img->levels-1; j >= 0; j--) {
+    struct crx_level *l = level + j;
+    b = comp->band + 1 + 3*(img->levels-1-j);
+    l->hl = b;
+    l->lh = b+1;
+    l->hh = b+2;
+    l->ll = comp->band;
+    l->src = j+1 < img->levels ? l+1 : 0;
+    l->flags = t->flags;
+    l->hlines = l->elines = l->next = 0;
+    for (i=0; i < 4; i++, mp += t->width)
+      l->hrow[i] = mp;
+    l->erow[0] = mp;
+    l->erow[1] = mp + t->width;
+    l->lrow = mp + 2 * t->width;
+    l->orow = mp + 3 * t->width;
+    mp += 4 * t->width;
+  }
+  for (j=0; j < img->levels; j++) {
+    level[j].width  = j ? level[j-1].lh->width  : t->width;
+    level[j].height = j ? level[j-1].hl->height : t->height;
+  }
+  for (row=0; row < t->height; row++) {
+    line = img->levels ? crx_level_row (level) :
+	crx_band_next (comp->band, 0);
+    if (img->enc == 3) {
+      sp = img->plane + ((size_t) plane * img->height + t->row + row)
+	* img->width + t->col;
+      for (col=0; col < t->width; col++)
+	sp[col] = line[col];
+      continue;
+    }
+    pix = raw_image + ((t->row + row) * 2 + (pos >> 1)) * raw_width
+	+ t->col * 2 + (pos & 1);
+    for (col=0; col < t->width; col++) {
+      v = img->enc == 1 ? LIM(line[col], -median, median-1) :
+	LIM(median + line[col], 0, max);
+      pix[col*2] = v;
+    }
+  }
+  for (i=0; i < nbands; i++)
+    errors += comp->band[i].bits.errors;
+  free (mem);
+  return errors > 0;
+}
+
+/*
+   Every tile starts with a tile header, followed by a header for each
+   of its planes, each followed by the headers of its subbands.  The
+   marker of each header tells its size, and whether it is in the
+   extended format of version 0x200.
+ */
+int CLASS crx_read_headers (struct crx_image *img, uchar *hdr, unsigned size)
+{
+  uchar *bp = hdr, *end = hdr + size;
+  struct crx_tile *t;
+  struct crx_comp *comp;
+  struct crx_band *b;
+  unsigned offset=0, coff, boff, len, bits;
+  int n, p, i, ext, rounded;
+
+  for (n=0; n < img->cols * img->rows; n++) {
+    t = img->tile + n;
+    if (bp + 12 > end) return 1;
+    len = sget2(bp+2);
+    if (!(ext = sget2(bp) == 0xff11) && sget2(bp) != 0xff01) return 1;
+    if ((len != 8 && (!ext || len != 16)) || bp + 4 + len > end ||
+	sget2(bp+8) != n) return 1;
+    t->size = sget4(bp+4);
+    t->offset = offset;
+    offset += t->size;
+    if (len == 16) {
+      t->qp_size = sget4(bp+12);
+      t->extra = sget2(bp+16);
+    }
+    bp += 4 + len;
+    for (coff=0, p=0; p < 4; p++) {
+      comp = t->comp + p;
+      if (bp + 12 > end || sget2(bp) != (ext ? 0xff12 : 0xff02) ||
+	  sget2(bp+2) != 8 || bp[8] >> 4 != p) return 1;
+      comp->size = sget4(bp+4);
+      comp->offset = coff;
+      coff += comp->size;
+      comp->partial = (bp[8] & 8) != 0;
+      comp->mask = 0;
+      if ((rounded = bp[8] >> 1 & 3)) {
+	if (img->levels || !ext) return 1;
+	comp->mask = 1 << (rounded - 1);
+      }
+      bp += 12;
+      for (boff=0, i=0; i < img->bands; i++) {
+	b = comp->band + i;
+	if (bp + (ext ? 20 : 12) > end ||
+	    sget2(bp) != (ext ? 0xff13 : 0xff03) ||
+	    sget2(bp+2) != (ext ? 16 : 8) || bp[8] >> 4 != i) return 1;
+	len = sget4(bp+4);
+	b->offset = boff;
+	boff += len;
+	if (ext) {
+	  if ((sget2(bp+8) & 0xfff) || sget2(bp+18)) return 1;
+	  b->size = len - sget2(bp+16);
+	  b->qmult = sget2(bp+10);
+	  b->qbase = sget4(bp+12);
+	  b->qparam = 4;		/* unquantized without a QP table */
+	  b->qpartial = 0;
+	  bp += 20;
+	} else {
+	  bits = sget4(bp+8);
+	  b->size = len - (bits & 0x7ffff);
+	  b->qpartial = bits >> 27 & 1;
+	  b->qparam = bits >> 19 & 0xff;
+	  bp += 12;
+	}
+	if (b->size > len) return 1;
+      }
+      if (boff > comp->size) return 1;
+    }
+    if ((UINT64) coff + t->qp_size + t->extra > t->size) return 1;
+  }
+  return 0;
+}
+
+void CLASS canon_crx_load_raw()
+{
+  uchar head[85], *hdr;
+  unsigned hdr_size;
+  UINT64 total, flen;
+  struct crx_image img;
+  struct crx_tile *t;
+  uchar *buffer=0;
+  int n, status=0;
+
+  memset (&img, 0, sizeof img);
+  memset (head, 0, sizeof head);
+  order = 0x4d4d;
+  if (crx_cmp1) {
+    fseek (ifp, crx_cmp1, SEEK_SET);
+    fread (head, 1, sizeof head, ifp);
+  }
+  img.version = sget2(head);
+  img.width = sget4(head+8);
+  img.height = sget4(head+12);
+  img.tile_width = sget4(head+16);
+  img.tile_height = sget4(head+20);
+  img.nbits = head[24];
+  img.cfa = head[25] & 15;
+  img.enc = head[26] >> 4;
+  img.levels = head[26] & 15;
+  hdr_size = sget4(head+28);
+  img.median_bits = img.nbits;
+  if (head[32] >> 7 && head[56] >> 6 & 1)
+    img.median_bits = head[84];
+  img.bands = 3 * img.levels + 1;
+  if (!crx_cmp1 || (img.version != 0x100 && img.version != 0x200) ||
+	head[25] >> 4 != 4 || img.cfa > 3 || img.levels > 3 ||
+	(img.enc != 0 && img.enc != 1 && img.enc != 3) ||
+	img.nbits < 9 || img.nbits > (img.enc == 1 ? 15 : 14) ||
+	img.median_bits < 1 || img.median_bits > 16 ||
+	(img.width | img.height | img.tile_width | img.tile_height) & 1 ||
+	img.width != raw_width || img.height != raw_height ||
+	img.tile_width < 44 || img.tile_height < 44 ||
+	img.tile_width > img.width || img.tile_height > img.height ||
+	!hdr_size || hdr_size > 0x1000000) {
+    dcraw_message (DCRAW_ERROR,_("%s: Unsupported Canon CRX compression\n"),
+	ifname_display);
+    longjmp (failure, 3);
+  }
+  /* Planes and tiles are measured in pixels of one colour */
+  img.width >>= 1;
+  img.height >>= 1;
+  img.tile_width >>= 1;
+  img.tile_height >>= 1;
+  img.cols = (img.width + img.tile_width - 1) / img.tile_width;
+  img.rows = (img.height + img.tile_height - 1) / img.tile_height;
+  img.tile = (struct crx_tile *) calloc (img.cols * img.rows, sizeof *img.tile);
+  merror (img.tile, "canon_crx_load_raw()");
+  for (n=0; n < img.cols * img.rows; n++) {
+    t = img.tile + n;
+    t->col = n % img.cols * img.tile_width;
+    t->row = n / img.cols * img.tile_height;
+    t->width = MIN(img.tile_width, img.width - t->col);
+    t->height = MIN(img.tile_height, img.height - t->row);
+    t->flags = (n % img.cols ? CRX_LEFT : 0) |
+	(n % img.cols < img.cols-1 ? CRX_RIGHT : 0) |
+	(n / img.cols ? CRX_TOP : 0) |
+	(n / img.cols < img.rows-1 ? CRX_BOTTOM : 0);
+    if (t->width < 1 << img.levels || t->height < 1 << img.levels)
+      status = 1;
+  }
+  hdr = (uchar *) malloc (hdr_size);
+  merror (hdr, "canon_crx_load_raw()");
+  fseek (ifp, data_offset, SEEK_SET);
+  if (fread (hdr, 1, hdr_size, ifp) < hdr_size) status = 1;
+  if (!status) status = crx_read_headers (&img, hdr, hdr_size);
+  free (hdr);
+  if (ifpBuffer)
+    flen = ifpBufferSize;
+  else {
+    fseek (ifp, 0, SEEK_END);
+    flen = ftell(ifp);
+  }
+  for (total=n=0; n < img.cols * img.rows; n++)
+    total += img.tile[n].size;
+  if (status || data_offset + hdr_size + total > flen) {
+    free (img.tile);
+    dcraw_message (DCRAW_ERROR,_("%s: Unsupported Canon CRX compression\n"),
+	ifname_display);
+    longjmp (failure, 3);
+  }
+  if (ifpBuffer)
+    img.data = ifpBuffer + data_offset + hdr_size;
+  else {
+    buffer = (uchar *) malloc (total);
+    merror (buffer, "canon_crx_load_raw()");
+    fseek (ifp, data_offset + hdr_size, SEEK_SET);
+    if (fread (buffer, 1, total, ifp) < total) derror();
+    img.data = buffer;
+  }
+  if (img.enc == 3) {
+    img.plane = (short *) malloc ((size_t) img.width * img.height * 4
+	* sizeof *img.plane);
+    if (!img.plane) status = 2;
+  }
+  for (n=0; !status && n < img.cols * img.rows; n++) {
+    t = img.tile + n;
+    if (img.levels && t->qp_size) status = crx_read_qp (&img, t);
+    crx_band_sizes (&img, t);
+  }
+  if (!status) {
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) reduction(|:status)
+#endif
+    for (n=0; n < img.cols * img.rows * 4; n++)
+      status |= crx_decode_tile (&img, img.tile + n/4, n%4);
+  }
+  if (!status && img.enc == 3) {
+    /* Decorrelated planes: luma, two colour differences and green */
+    int median = 1 << (img.median_bits-1) << 10;
+    int max = (1 << img.median_bits) - 1;
+    int row, col, pos[4], c;
+    FORC4 pos[c] = c ^ img.cfa;
+#ifdef _OPENMP
+    #pragma omp parallel for private(col,c)
+#endif
+    for (row=0; row < img.height; row++) {
+      size_t size = (size_t) img.width * img.height;
+      const short *p0 = img.plane + (size_t) row * img.width;
+      const short *p1 = p0 + size, *p2 = p1 + size, *p3 = p2 + size;
+      int gr, v[4];
+      for (col=0; col < img.width; col++) {
+	gr = median + p0[col] * 1024 - 168 * p1[col] - 585 * p3[col];
+	gr = gr < 0 ? -((-gr + 512) >> 9 & ~1) : (gr + 512) >> 9 & ~1;
+	v[0] = (median + p0[col] * 1024 + 1510 * p3[col] + 512) >> 10;
+	v[1] = (p2[col] + gr + 1) >> 1;
+	v[2] = (gr - p2[col] + 1) >> 1;
+	v[3] = (median + p0[col] * 1024 + 1927 * p1[col] + 512) >> 10;
+	FORC4 RAW(row*2 + (pos[c] >> 1), col*2 + (pos[c] & 1)) =
+		LIM(v[c], 0, max);
+      }
+    }
+  }
+  if (!buffer && !status) ifpProgress (total);
+  for (n=0; n < img.cols * img.rows; n++)
+    free (img.tile[n].qtable);
+  free (img.tile);
+  free (img.plane);
+  free (buffer);
+  if (status & 2) merror (NULL, "canon_crx_load_raw()");
+  if (status) derror();
 }
 
-void CLASS imacon_full_load_raw()
-{
-  int row, col;
+/*
+   Compressed Fujifilm RAF (X-Trans III and later).  The image is cut
+   into vertical strips (768 pixels wide) that are coded
+   independently, six rows (one X-Trans period) at a time.  Each colour
+   keeps a short history of lines in which samples are predicted from
+   their upper neighbours, with adaptive Golomb-Rice coding of the
+   residuals.
+ */
+enum { FR0, FR1, FR2, FR3, FR4, FG0, FG1, FG2, FG3, FG4, FG5, FG6, FG7,
+	FB0, FB1, FB2, FB3, FB4, FLINES };
 
-  if (!image) return;
-  for (row=0; row < height; row++)
-    for (col=0; col < width; col++)
-      read_shorts (image[row*width+col], 3);
-}
+struct fuji_q {
+  char *q_table;
+  int q_point[5], max_bits, min_value, raw_bits, total_values, max_diff;
+  int line_width, width, block, blocks, lines;
+};
 
-void CLASS packed_load_raw()
+struct fuji_strip {
+  const uchar *bp, *bend;
+  int bit, errors;
+  ushort *linealloc, *linebuf[FLINES];
+  int grad_even[3][41][2], grad_odd[3][41][2];
+};
+
+static int fuji_zerobits (struct fuji_strip *s)
 {
-  int vbits=0, bwide, rbits, bite, half, irow, row, col, val, i;
-  UINT64 bitbuf=0;
+  int count=0, bit;
 
-  bwide = raw_width * tiff_bps / 8;
-  bwide += bwide & load_flags >> 9;
-  rbits = bwide * 8 - raw_width * tiff_bps;
-  if (load_flags & 1) bwide = bwide * 16 / 15;
-  bite = 8 + (load_flags & 56);
-  half = (raw_height+1) >> 1;
-  for (irow=0; irow < raw_height; irow++) {
-    row = irow;
-    if (load_flags & 2 &&
-	(row = irow % half * 2 + irow / half) == 1 &&
-	load_flags & 4) {
-      if (vbits=0, tiff_compress)
-	fseek (ifp, data_offset - (-half*bwide & -2048), SEEK_SET);
-      else {
-	fseek (ifp, 0, SEEK_END);
-	fseek (ifp, ftell(ifp) >> 3 << 2, SEEK_SET);
-      }
+  for (;;) {
+    if (s->bp >= s->bend) {
+      s->errors++;
+      return count;
     }
-    for (col=0; col < raw_width; col++) {
-      for (vbits -= tiff_bps; vbits < 0; vbits += bite) {
-	bitbuf <<= bite;
-	for (i=0; i < bite; i+=8)
-	  bitbuf |= ((UINT64) fgetc(ifp) << i);
-      }
-      val = bitbuf << (64-tiff_bps-vbits) >> (64-tiff_bps);
-      RAW(row,col ^ (load_flags >> 6 & 3)) = val;
-      if (load_flags & 1 && (col % 10) == 9 && fgetc(ifp) &&
-	row < height+top_margin && col < width+left_margin) derror();
+    bit = *s->bp >> (7 - s->bit) & 1;
+    if (++s->bit == 8) {
+      s->bit = 0;
+      s->bp++;
     }
-    vbits -= rbits;
+    if (bit) return count;
+    count++;
   }
 }
 
-void CLASS nokia_load_raw()
+static int fuji_read_code (struct fuji_strip *s, int bits)
 {
-  uchar  *data,  *dp;
-  int rev, dwide, row, col, c;
-  double sum[]={0,0};
+  int data=0, n;
 
-  rev = 3 * (order == 0x4949);
-  dwide = (raw_width * 5 + 1) / 4;
-  data = (uchar *) malloc (dwide*2);
-  merror (data, "nokia_load_raw()");
-  for (row=0; row < raw_height; row++) {
-    if ((int) fread (data+dwide, 1, dwide, ifp) < dwide) derror();
-    FORC(dwide) data[c] = data[dwide+(c ^ rev)];
-    for (dp=data, col=0; col < raw_width; dp+=5, col+=4)
-      FORC4 RAW(row,col+c) = (dp[c] << 2) | (dp[4] >> (c << 1) & 3);
-  }
-  free (data);
-  maximum = 0x3ff;
-  if (strcmp(make,"OmniVision")) return;
-  row = raw_height/2;
-  FORC(width-1) {
-    sum[ c & 1] += SQR(RAW(row,c)-RAW(row+1,c+1));
-    sum[~c & 1] += SQR(RAW(row+1,c)-RAW(row,c+1));
+  while (bits > 0) {
+    if (s->bp >= s->bend) {
+      s->errors++;
+      return data << bits;
+    }
+    n = MIN(bits, 8 - s->bit);
+    data = data << n | (*s->bp >> (8 - s->bit - n) & ((1 << n) - 1));
+    bits -= n;
+    if ((s->bit += n) == 8) {
+      s->bit = 0;
+      s->bp++;
+    }
   }
-  if (sum[1] > sum[0]) filters = 0x4b4b4b4b;
+  return data;
 }
 
-void CLASS canon_rmf_load_raw()
+static int fuji_interp_even (const ushort *cur, int lw)
 {
-  int row, col, bits, orow, ocol, c;
+  int Rb = cur[-2-lw], Rc = cur[-3-lw], Rd = cur[-1-lw], Rf = cur[-4-2*lw];
+  int diffRcRb = ABS(Rc-Rb), diffRfRb = ABS(Rf-Rb), diffRdRb = ABS(Rd-Rb);
 
-  for (row=0; row < raw_height; row++)
-    for (col=0; col < raw_width-2; col+=3) {
-      bits = get4();
-      FORC3 {
-	orow = row;
-	if ((ocol = col+c-4) < 0) {
-	  ocol += raw_width;
-	  if ((orow -= 2) < 0)
-	    orow += raw_height;
-	}
-	RAW(orow,ocol) = curve[bits >> (10*c+2) & 0x3ff];
-      }
-    }
-  maximum = curve[0x3ff];
+  if (diffRcRb > diffRfRb && diffRcRb > diffRdRb)
+    return (Rf + Rd + 2*Rb) >> 2;
+  if (diffRdRb > diffRcRb && diffRdRb > diffRfRb)
+    return (Rf + Rc + 2*Rb) >> 2;
+  return (Rd + Rc + 2*Rb) >> 2;
 }
 
-unsigned CLASS pana_bits (int nbits)
+static void fuji_decode_sample (struct fuji_strip *s, const struct fuji_q *q,
+	ushort *cur, int odd, int (*grads)[2])
 {
-  static uchar buf[0x4000];
-  static int vbits;
-  int byte;
+  const int lw = q->line_width, qp = q->q_point[4];
+  int Ra, Rb = cur[-2-lw], Rc = cur[-3-lw], Rd = cur[-1-lw];
+  int interp, grad, gradient, sample, code, bits=0;
 
-  if (!nbits) return vbits=0;
-  if (!vbits) {
-    fread (buf+load_flags, 1, 0x4000-load_flags, ifp);
-    fread (buf, 1, load_flags, ifp);
+  if (odd) {
+    Ra = cur[-1];
+    grad = 9 * q->q_table[qp + Rb - Rc] + q->q_table[qp + Rc - Ra];
+    if ((Rb > Rc && Rb > Rd) || (Rb < Rc && Rb < Rd))
+      interp = (cur[1] + Ra + 2*Rb) >> 2;
+    else interp = (Ra + cur[1]) >> 1;
+  } else {
+    grad = 9 * q->q_table[qp + Rb - cur[-4-2*lw]] + q->q_table[qp + Rc - Rb];
+    interp = fuji_interp_even (cur, lw);
+  }
+  gradient = ABS(grad);
+  sample = fuji_zerobits (s);
+  if (sample < q->max_bits - q->raw_bits - 1) {
+    if (grads[gradient][1] < grads[gradient][0])
+      while (bits <= 12 && (grads[gradient][1] << ++bits) < grads[gradient][0]);
+    code = fuji_read_code (s, bits) + (sample << bits);
+  } else
+    code = fuji_read_code (s, q->raw_bits) + 1;
+  if (code < 0 || code >= q->total_values) s->errors++;
+  code = code & 1 ? -1 - code/2 : code/2;
+  grads[gradient][0] += ABS(code);
+  if (grads[gradient][1] == q->min_value) {
+    grads[gradient][0] >>= 1;
+    grads[gradient][1] >>= 1;
   }
-  vbits = (vbits - nbits) & 0x1ffff;
-  byte = vbits >> 3 ^ 0x3ff0;
-  return (buf[byte] | buf[byte+1] << 8) >> (vbits & 7) & ~(-1 << nbits);
+  grads[gradient][1]++;
+  interp = grad < 0 ? interp - code : interp + code;
+  if (interp < 0) interp += q->total_values;
+  else if (interp > qp) interp -= q->total_values;
+  *cur = interp < 0 ? 0 : MIN(interp, qp);
 }
 
-void CLASS panasonic_load_raw()
+static void fuji_extend (ushort **linebuf, int lw, int first, int last)
 {
-  int row, col, i, j, sh=0, pred[2], nonz[2];
+  int i;
 
-  pana_bits(0);
-  for (row=0; row < height; row++)
-    for (col=0; col < raw_width; col++) {
-      if ((i = col % 14) == 0)
-	pred[0] = pred[1] = nonz[0] = nonz[1] = 0;
-      if (i % 3 == 2) sh = 4 >> (3 - pana_bits(2));
-      if (nonz[i & 1]) {
-	if ((j = pana_bits(8))) {
-	  if ((pred[i & 1] -= 0x80 << sh) < 0 || sh == 4)
-	       pred[i & 1] &= ~(-1 << sh);
-	  pred[i & 1] += j << sh;
-	}
-      } else if ((nonz[i & 1] = pana_bits(8)) || i > 11)
-	pred[i & 1] = nonz[i & 1] << 4 | pana_bits(4);
-      if ((RAW(row,col) = pred[col & 1]) > 4098 && col < width) derror();
-    }
+  for (i=first; i <= last; i++) {
+    linebuf[i][0] = linebuf[i-1][1];
+    linebuf[i][lw+1] = linebuf[i-1][lw];
+  }
 }
 
-void CLASS olympus_load_raw()
-{
-  ushort huff[4096];
-  int row, col, nbits, sign, low, high, i, c, w, n, nw;
-  int acarry[2][3], *carry, pred, diff;
-
-  huff[n=0] = 0xc0c;
-  for (i=12; i--; )
-    FORC(2048 >> i) huff[++n] = (i+1) << 8 | i;
-  fseek (ifp, 7, SEEK_CUR);
-  getbits(-1);
-  for (row=0; row < height; row++) {
-    memset (acarry, 0, sizeof acarry);
-    for (col=0; col < raw_width; col++) {
-      carry = acarry[col & 1];
-      i = 2 * (carry[2] < 3);
-      for (nbits=2+i; (ushort) carry[0] >> (nbits+i); nbits++);
-      low = (sign = getbits(3)) & 3;
-      sign = sign << 29 >> 31;
-      if ((high = getbithuff(12,huff)) == 12)
-	high = getbits(16-nbits) >> 1;
-      carry[0] = (high << nbits) | getbits(nbits);
-      diff = (carry[0] ^ sign) + carry[1];
-      carry[1] = (diff*3 + carry[1]) >> 5;
-      carry[2] = carry[0] > 16 ? 0 : carry[2]+1;
-      if (col >= width) continue;
-      if (row < 2 && col < 2) pred = 0;
-      else if (row < 2) pred = RAW(row,col-2);
-      else if (col < 2) pred = RAW(row-2,col);
-      else {
-	w  = RAW(row,col-2);
-	n  = RAW(row-2,col);
-	nw = RAW(row-2,col-2);
-	if ((w < nw && nw < n) || (n < nw && nw < w)) {
-	  if (ABS(w-nw) > 32 || ABS(n-nw) > 32)
-	    pred = w + n - nw;
-	  else pred = (w + n) >> 1;
-	} else pred = ABS(w-nw) > ABS(n-nw) ? w : n;
+/*
+   Six passes per row group, each decoding two lines in lockstep.
+   mode[] tells which even samples are interpolated instead of coded:
+   0 = none, 1 = all, 2 = those with pos%4 == 0, 3 = those with pos%4 == 2.
+ */
+static void fuji_decode_rows (struct fuji_strip *s, const struct fuji_q *q)
+{
+  static const char pass[6][5] = {
+    { FR2, FG2, 1, 0, 0 }, { FG3, FB2, 0, 1, 1 }, { FR3, FG4, 2, 1, 2 },
+    { FG5, FB3, 0, 3, 0 }, { FR4, FG6, 3, 0, 1 }, { FG7, FB4, 1, 2, 2 } };
+  const int lw = q->line_width;
+  int p, i, even, odd, mode;
+  ushort *line;
+
+  for (p=0; p < 6; p++) {
+    for (even=0, odd=1; even < lw || odd < lw; ) {
+      if (even < lw) {
+	for (i=0; i < 2; i++) {
+	  line = s->linebuf[(int) pass[p][i]] + 1 + even;
+	  mode = pass[p][2+i];
+	  if (mode == 1 || (mode == 2 && !(even & 3)) ||
+	      (mode == 3 && (even & 3) == 2))
+	    *line = fuji_interp_even (line, lw);
+	  else
+	    fuji_decode_sample (s, q, line, 0, s->grad_even[(int) pass[p][4]]);
+	}
+	even += 2;
+      }
+      if (even > 8) {
+	for (i=0; i < 2; i++)
+	  fuji_decode_sample (s, q, s->linebuf[(int) pass[p][i]] + 1 + odd,
+		1, s->grad_odd[(int) pass[p][4]]);
+	odd += 2;
       }
-      if ((RAW(row,col) = pred + ((diff << 2) | low)) >> 12) derror();
     }
+    for (i=0; i < 2; i++)
+      switch (pass[p][i]) {
+	case FR2: case FR3: case FR4:
+	  fuji_extend (s->linebuf, lw, FR2, FR4);  break;
+	case FB2: case FB3: case FB4:
+	  fuji_extend (s->linebuf, lw, FB2, FB4);  break;
+	default:
+	  fuji_extend (s->linebuf, lw, FG2, FG7);
+      }
   }
 }
 
-void CLASS canon_crx_load_raw()
-{
+/*
+   Returns 0 on success, 1 on a damaged strip and 2 when out of memory,
+   so that no longjmp() is taken from inside a parallel region.
+ */
+int CLASS fuji_decode_strip
+	(const struct fuji_q *q, int block, const uchar *data, unsigned size)
+{
+  static const char mtable[6][2] = { { FR0, FR3 }, { FR1, FR4 },
+	{ FG0, FG6 }, { FG1, FG7 }, { FB0, FB3 }, { FB1, FB4 } };
+  static const char ztable[3][2] = { { FR2, 3 }, { FG2, 6 }, { FB2, 3 } };
+  struct fuji_strip s;
+  const int lw = q->line_width, line_size = sizeof (ushort) * (lw+2);
+  int width, line, row, col, i, j;
+  ushort *pix, *src;
+
+  width = block+1 == q->blocks ?
+	q->width - q->block * block : q->block;
+  memset (&s, 0, sizeof s);
+  s.bp = data;
+  s.bend = data + size;
+  s.linealloc = (ushort *) calloc (FLINES, line_size);
+  if (!s.linealloc) return 2;
+  for (i=0; i < FLINES; i++)
+    s.linebuf[i] = s.linealloc + i * (lw+2);
+  for (i=0; i < 3; i++)
+    for (j=0; j < 41; j++) {
+      s.grad_even[i][j][0] = s.grad_odd[i][j][0] = q->max_diff;
+      s.grad_even[i][j][1] = s.grad_odd[i][j][1] = 1;
+    }
+  for (line=0; line < q->lines; line++) {
+    fuji_decode_rows (&s, q);
+    for (i=0; i < 6; i++)
+      memcpy (s.linebuf[(int) mtable[i][0]], s.linebuf[(int) mtable[i][1]],
+		line_size);
+    for (row=0; row < 6; row++) {
+      pix = raw_image + (line*6 + row) * raw_width + q->block * block;
+      for (col=0; col < width; col++) {
+	switch (xtrans_abs[row][col % 6]) {
+	  case 0:  src = s.linebuf[FR2 + (row >> 1)];  break;
+	  case 2:  src = s.linebuf[FB2 + (row >> 1)];  break;
+	  default: src = s.linebuf[FG2 + row];
+	}
+	pix[col] = src[1 + (((col*2/3) & ~1) | (col % 3 & 1)) + (col % 3 >> 1)];
+      }
+    }
+    for (i=0; i < 3; i++) {
+      src = s.linebuf[(int) ztable[i][0]];
+      memset (src, 0, ztable[i][1] * line_size);
+      src[0] = src[-(lw+2) + 1];
+      src[lw+1] = src[-(lw+2) + lw];
+    }
+  }
+  free (s.linealloc);
+  return s.errors > 0;
 }
 
 void CLASS fuji_xtrans_load_raw()
 {
+  uchar head[16], *buffer=0;
+  const uchar *data;
+  unsigned *sizes, offset, i;
+  UINT64 total, flen;
+  struct fuji_q q;
+  int block, cur, status=0;
+
+  fseek (ifp, data_offset, SEEK_SET);
+  if (fread (head, 1, 16, ifp) < 16) derror();
+  order = 0x4d4d;
+  q.raw_bits = head[4];
+  q.width = sget2(head+9);
+  q.block = sget2(head+11);
+  q.blocks = head[13];
+  q.lines = sget2(head+14);
+  if (sget2(head) != 0x4953 || head[2] != 1 || head[3] != 16 ||
+	(q.raw_bits != 12 && q.raw_bits != 14) || q.block != 0x300 ||
+	q.width > raw_width || q.width % 24 || !q.blocks || q.blocks > 16 ||
+	q.blocks != (q.width + q.block - 1) / q.block ||
+	!q.lines || q.lines * 6 > raw_height) {
+    dcraw_message (DCRAW_ERROR,_("%s: Unsupported Fuji compression\n"),
+	ifname_display);
+    longjmp (failure, 3);
+  }
+  q.line_width = q.block * 2 / 3;
+  q.q_point[0] = 0;
+  q.q_point[1] = 0x12;
+  q.q_point[2] = 0x43;
+  q.q_point[3] = 0x114;
+  q.q_point[4] = (1 << q.raw_bits) - 1;
+  q.min_value = 0x40;
+  q.total_values = 1 << q.raw_bits;
+  q.max_bits = 4 * q.raw_bits;
+  q.max_diff = q.raw_bits == 14 ? 256 : 64;
+  q.q_table = (char *) malloc (2 << q.raw_bits);
+  merror (q.q_table, "fuji_xtrans_load_raw()");
+  for (cur = -q.q_point[4]; cur <= q.q_point[4]; cur++)
+    q.q_table[q.q_point[4] + cur] =
+	cur <= -q.q_point[3] ? -4 : cur <= -q.q_point[2] ? -3 :
+	cur <= -q.q_point[1] ? -2 : cur < 0 ? -1 : cur == 0 ? 0 :
+	cur <  q.q_point[1] ?  1 : cur <  q.q_point[2] ?  2 :
+	cur <  q.q_point[3] ?  3 : 4;
+
+  sizes = (unsigned *) calloc (q.blocks + 1, sizeof *sizes);
+  merror (sizes, "fuji_xtrans_load_raw()");
+  offset = q.blocks * 4;
+  if (offset & 0xc) offset += 0x10 - (offset & 0xc);
+  offset += data_offset + 16;
+  if (ifpBuffer)
+    flen = ifpBufferSize;
+  else {
+    fseek (ifp, 0, SEEK_END);
+    flen = ftell(ifp);
+    fseek (ifp, data_offset + 16, SEEK_SET);
+  }
+  /* Every strip must lie within the file */
+  for (total=i=0; i < (unsigned) q.blocks; i++) {
+    total += sizes[i+1] = get4();
+    if (offset + total > flen) {
+      free (sizes);
+      free (q.q_table);
+      dcraw_message (DCRAW_ERROR,_("%s: Unsupported Fuji compression\n"),
+	ifname_display);
+      longjmp (failure, 3);
+    }
+  }
+  if (ifpBuffer)
+    data = ifpBuffer + offset;
+  else {
+    buffer = (uchar *) malloc (total);
+    merror (buffer, "fuji_xtrans_load_raw()");
+    fseek (ifp, offset, SEEK_SET);
+    if (fread (buffer, 1, total, ifp) < total) derror();
+    data = buffer;
+  }
+  for (i=0; i < (unsigned) q.blocks; i++)
+    sizes[i+1] += sizes[i];
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic) reduction(|:status)
+#endif
+  for (block=0; block < q.blocks; block++)
+    status |= fuji_decode_strip (&q, block, data + sizes[block],
+	sizes[block+1] - sizes[block]);
+  if (!buffer) ifpProgress (total);
+  free (buffer);
+  free (sizes);
+  free (q.q_table);
+  if (status & 2) merror (NULL, "fuji_xtrans_load_raw()");
+  if (status) derror();
 }
 
 void CLASS minolta_rd175_load_raw()
@@ -2401,10 +4289,9 @@ void CLASS lossy_dng_load_raw() {}
 METHODDEF(boolean)
 fill_input_buffer (j_decompress_ptr cinfo)
 {
-  // TODO: The following static variable is not thread-safe
-  static uchar jpeg_buffer[4096];
   size_t nbytes;
   DCRaw *d = (DCRaw*)cinfo->client_data;
+  uchar *jpeg_buffer = d->jpeg_buffer;
 
   nbytes = fread (jpeg_buffer, 1, 4096, d->ifp);
 #if defined(__MINGW64_VERSION_MAJOR) && __MINGW64_VERSION_MAJOR < 4
@@ -2460,6 +4347,63 @@ void CLASS kodak_jpeg_load_raw()
 
 //void CLASS gamma_curve (double pwr, double ts, int mode, int imax);
 
+#if JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED)
+/*
+   Each tile of a lossy DNG is a complete JPEG stream, so with the file
+   in memory every thread decodes whole tiles with its own decompressor.
+ */
+void CLASS lossy_dng_load_tiles (ushort cur[3][256])
+{
+  unsigned across = (raw_width + tile_width - 1) / tile_width;
+  unsigned ntiles = across * ((raw_height + tile_length - 1) / tile_length);
+  unsigned *offset;
+  size_t used=0;
+  int t;
+
+  offset = (unsigned *) calloc (ntiles, sizeof *offset);
+  merror (offset, "lossy_dng_load_tiles()");
+  fseek (ifp, data_offset, SEEK_SET);
+  for (t=0; t < (int) ntiles; t++)
+    offset[t] = get4();
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic) reduction(+:used)
+#endif
+  for (t=0; t < (int) ntiles; t++) {
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPARRAY buf;
+    JSAMPLE (*pixel)[3];
+    unsigned trow = t / across * tile_length, tcol = t % across * tile_width;
+    unsigned row, col, c;
+
+    if (offset[t] >= ifpBufferSize) {
+      derror();
+      continue;
+    }
+    cinfo.err = jpeg_std_error (&jerr);
+    jpeg_create_decompress (&cinfo);
+    jpeg_mem_src (&cinfo, (uchar *) ifpBuffer + offset[t],
+	ifpBufferSize - offset[t]);
+    jpeg_read_header (&cinfo, boolean(TRUE));
+    jpeg_start_decompress (&cinfo);
+    buf = (*cinfo.mem->alloc_sarray)
+	((j_common_ptr) &cinfo, JPOOL_IMAGE, cinfo.output_width*3, 1);
+    while (cinfo.output_scanline < cinfo.output_height &&
+	(row = trow + cinfo.output_scanline) < height) {
+      jpeg_read_scanlines (&cinfo, buf, 1);
+      pixel = (JSAMPLE (*)[3]) buf[0];
+      for (col=0; col < cinfo.output_width && tcol+col < width; col++) {
+	FORC3 image[row*width+tcol+col][c] = cur[c][pixel[col][c]];
+      }
+    }
+    used += cinfo.src->next_input_byte - ((uchar *) ifpBuffer + offset[t]);
+    jpeg_destroy_decompress (&cinfo);
+  }
+  ifpProgress (used);
+  free (offset);
+}
+#endif
+
 void CLASS lossy_dng_load_raw()
 {
   struct jpeg_decompress_struct cinfo;
@@ -2496,6 +4440,13 @@ void CLASS lossy_dng_load_raw()
     gamma_curve (1/2.4, 12.92, 1, 255);
     FORC3 memcpy (cur[c], curve, sizeof cur[0]);
   }
+#if JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED)
+  if (ifpBuffer && tile_length < INT_MAX && tile_width) {
+    lossy_dng_load_tiles (cur);
+    maximum = 0xffff;
+    return;
+  }
+#endif
   cinfo.err = jpeg_std_error (&jerr);
   jpeg_create_decompress (&cinfo);
   while (trow < raw_height) {
@@ -2764,8 +4715,7 @@ void CLASS kodak_thumb_load_raw()
 
 void CLASS sony_decrypt (unsigned *data, int len, int start, int key)
 {
-  // TODO: The following static variables are not thread-safe
-  static unsigned pad[128], p;
+  unsigned *pad=sony_pad, &p=sony_p;
 
   if (start) {
     for (p=0; p < 4; p++)
@@ -2826,30 +4776,96 @@ void CLASS sony_arw_load_raw()
     }
 }
 
+/*
+   An ARW2 row is a sequence of independent 16-byte blocks, each holding
+   16 pixels as an 11-bit maximum and minimum, their 4-bit positions and
+   fourteen 7-bit deltas.  The block is read as two little-endian 64-bit
+   words and every pixel is computed the same way, without branches, so
+   that the compiler can vectorize the loops.
+ */
+void CLASS sony_arw2_block (const uchar *dp, const uchar *end, ushort pix[16])
+{
+  UINT64 lo=0, hi=0;
+  ushort delta[16];
+  int max, min, imax, imin, sh, bit, i, d, v;
+
+  for (i=8; i--; ) {
+    lo = lo << 8 | dp[i];
+    hi = hi << 8 | dp[i+8];
+  }
+  max = 0x7ff & lo;
+  min = 0x7ff & lo >> 11;
+  imax = 0x0f & lo >> 22;
+  imin = 0x0f & lo >> 26;
+  for (sh=0; sh < 4 && 0x80 << sh <= max-min; sh++);
+  for (i=0; i < 14; i++) {
+    bit = 30 + i*7;
+    delta[i] = (bit >= 64 ? hi >> (bit-64) :
+		bit > 57 ? lo >> bit | hi << (64-bit) : lo >> bit) & 0x7f;
+  }
+  /* With imax == imin the deltas run into the following bytes */
+  delta[14] = dp+18 <= end ? (dp[16] | dp[17] << 8) & 0x7f : 0;
+  delta[15] = 0;
+  for (i=0; i < 16; i++) {
+    d = i - (i > imax) - (i > imin && imin != imax);
+    v = (delta[d] << sh) + min;
+    v = v > 0x7ff ? 0x7ff : v;
+    pix[i] = i == imax ? max : i == imin ? min : v;
+  }
+}
+
 void CLASS sony_arw2_load_raw()
 {
   uchar *data, *dp;
+  const uchar *end;
   ushort pix[16];
+  size_t len;
   int row, col, val, max, min, imax, imin, sh, bit, i;
 
-  data = (uchar *) malloc (raw_width+1);
+  if (ifpBuffer && order == 0x4949 &&
+	ftell(ifp) + (size_t) raw_width * height <= ifpBufferSize) {
+    data = (uchar *) ifpBuffer + ftell(ifp);
+    end = ifpBuffer + ifpBufferSize;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) private(dp,col,i,pix)
+#endif
+    for (row=0; row < height; row++)
+      for (dp=data + (size_t) row * raw_width, col=0;
+	   col < raw_width-30; dp+=16) {
+	sony_arw2_block (dp, end, pix);
+	for (i=0; i < 16; i++, col+=2)
+	  RAW(row,col) = curve[pix[i] << 1] >> 2;
+	col -= col & 1 ? 1:31;
+      }
+    ifpProgress ((size_t) raw_width * height);
+    return;
+  }
+  data = (uchar *) malloc (raw_width+2);
   merror (data, "sony_arw2_load_raw()");
   for (row=0; row < height; row++) {
-    fread (data, 1, raw_width, ifp);
+    /* Read ahead into the next row like the in-memory path does */
+    data[raw_width] = data[raw_width+1] = 0;
+    len = fread (data, 1, raw_width+2, ifp);
+    if (len > (size_t) raw_width)
+      fseek (ifp, raw_width - (long) len, SEEK_CUR);
     for (dp=data, col=0; col < raw_width-30; dp+=16) {
-      max = 0x7ff & (val = sget4(dp));
-      min = 0x7ff & val >> 11;
-      imax = 0x0f & val >> 22;
-      imin = 0x0f & val >> 26;
-      for (sh=0; sh < 4 && 0x80 << sh <= max-min; sh++);
-      for (bit=30, i=0; i < 16; i++)
-	if      (i == imax) pix[i] = max;
-	else if (i == imin) pix[i] = min;
-	else {
-	  pix[i] = ((sget2(dp+(bit >> 3)) >> (bit & 7) & 0x7f) << sh) + min;
-	  if (pix[i] > 0x7ff) pix[i] = 0x7ff;
-	  bit += 7;
-	}
+      if (order == 0x4949)
+	sony_arw2_block (dp, data + len, pix);
+      else {
+	max = 0x7ff & (val = sget4(dp));
+	min = 0x7ff & val >> 11;
+	imax = 0x0f & val >> 22;
+	imin = 0x0f & val >> 26;
+	for (sh=0; sh < 4 && 0x80 << sh <= max-min; sh++);
+	for (bit=30, i=0; i < 16; i++)
+	  if      (i == imax) pix[i] = max;
+	  else if (i == imin) pix[i] = min;
+	  else {
+	    pix[i] = ((sget2(dp+(bit >> 3)) >> (bit & 7) & 0x7f) << sh) + min;
+	    if (pix[i] > 0x7ff) pix[i] = 0x7ff;
+	    bit += 7;
+	  }
+      }
       for (i=0; i < 16; i++, col+=2)
 	RAW(row,col) = curve[pix[i] << 1] >> 2;
       col -= col & 1 ? 1:31;
@@ -3164,8 +5180,7 @@ void CLASS redcine_load_raw()
 
 void CLASS foveon_decoder (int size, unsigned code)
 {
-  // TODO: The following static variable is not thread-safe
-  static unsigned huff[1024];
+  unsigned *huff=foveon_decoder_huff;
   struct decode *cur;
   int i, len;
 
@@ -7270,7 +9285,8 @@ void CLASS parse_riff()
 void CLASS parse_crx (int end)
 {
   unsigned i, save, size, tag, base;
-  static int index=0, wide, high, off, len;
+  int &index=crx_index, &wide=crx_wide, &high=crx_high, &off=crx_off,
+      &len=crx_len;
 
   order = 0x4d4d;
   while (ftell(ifp)+7 < end) {
@@ -7306,6 +9322,24 @@ void CLASS parse_crx (int end)
 	wide = get4();
 	high = get4();
 	break;
+      case 0x73747364:				/* stsd */
+	fseek (ifp, 8, SEEK_CUR);
+	parse_crx (save+size);
+	break;
+      case 0x43524157:				/* CRAW */
+	fseek (ifp, 82, SEEK_CUR);
+	parse_crx (save+size);
+	break;
+      case 0x434d5031:				/* CMP1 */
+	if (index != 3) break;
+	crx_cmp1 = ftell(ifp);
+	fseek (ifp, 8, SEEK_CUR);
+	wide = get4();
+	high = get4();
+	fseek (ifp, 8, SEEK_CUR);
+	tiff_bps = fgetc(ifp);
+	filters = 0x01010101U * (uchar) "\x94\x61\x49\x16"[fgetc(ifp) & 3];
+	break;
       case 0x7374737a:				/* stsz */
 	len = (get4(),get4());
 	break;
@@ -9435,7 +11469,8 @@ void CLASS identify()
     if (height   > width) pixel_aspect = 2;
     filters = 0;
     simple_coeff(0);
-  } else if (!strcmp(make,"Canon") && tiff_bps == 15) {
+  } else if (!strcmp(make,"Canon") && tiff_bps == 15 &&
+	load_raw != &CLASS canon_crx_load_raw) {
     switch (width) {
       case 3344: width -= 66;
       case 3872: width -= 6;
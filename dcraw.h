@@ -92,6 +92,20 @@ public:
         float tag_210;
     } ph1;
 
+    /* Decoder state that used to be kept in static variables. Keeping it
+       in the object allows several instances to decode concurrently. */
+    unsigned getbithuff_bitbuf;
+    int getbithuff_vbits, getbithuff_reset;
+    unsigned long long ph1_bitbuf;
+    int ph1_vbits;
+    uchar pana_buf[0x4000];
+    int pana_vbits;
+    unsigned sony_pad[128], sony_p;
+    unsigned foveon_decoder_huff[1024];
+    uchar jpeg_buffer[4096];
+    float ljpeg_cs[106];
+    int crx_index, crx_wide, crx_high, crx_off, crx_len, crx_cmp1;
+
     int tone_curve_size, tone_curve_offset; /* Nikon Tone Curves UF*/
     int tone_mode_offset, tone_mode_size; /* Nikon ToneComp UF*/
 
@@ -99,6 +113,9 @@ public:
     char *messageBuffer;
     int lastStatus;
 
+    void *ifpMapping; /* Mapped input file, handled by dcraw_api.cc */
+    const uchar *ifpBuffer; /* Contents of ifp, if it is in memory */
+    size_t ifpBufferSize;
     unsigned ifpReadCount;
     unsigned ifpSize;
     unsigned ifpStepProgress;
@@ -148,12 +165,19 @@ public:
     int ljpeg_start(struct jhead *jh, int info_only);
     void ljpeg_end(struct jhead *jh);
     int ljpeg_diff(ushort *huff);
+    int ljpeg_make_lut(struct jhead *jh);
+    int ljpeg_getc(struct jhead *jh);
+    void ljpeg_fill(struct jhead *jh);
+    int ljpeg_fast_diff(struct jhead *jh, int c);
     ushort * ljpeg_row(int jrow, struct jhead *jh);
     void lossless_jpeg_load_raw();
     void canon_sraw_load_raw();
     void adobe_copy_pixel(unsigned row, unsigned col, ushort **rp);
     void ljpeg_idct(struct jhead *jh);
+    void lossless_dng_tile(struct jhead *jh, unsigned trow, unsigned tcol);
+    void lossless_dng_load_tiles();
     void lossless_dng_load_raw();
+    void packed_dng_load_rows();
     void packed_dng_load_raw();
     void pentax_load_raw();
     void nikon_load_raw();
@@ -172,22 +196,33 @@ public:
     void phase_one_correct();
     void phase_one_load_raw();
     unsigned ph1_bithuff(int nbits, ushort *huff);
+    int phase_one_decode_row(struct ph1_stream *s, ushort *pixel, int len[2]);
+    int phase_one_load_row(int row, int *offset, short (*cblack)[2],
+                           short (*rblack)[2], ushort *pixel, int len[2],
+                           unsigned *bytes);
+    void phase_one_load_rows(int *offset, short (*cblack)[2],
+	short (*rblack)[2]);
     void phase_one_load_raw_c();
     void hasselblad_load_raw();
     void leaf_hdr_load_raw();
+    void unpacked_load_rows(unsigned count, int bits);
     void unpacked_load_raw();
     void sinar_4shot_load_raw();
     void imacon_full_load_raw();
+    int packed_load_rows(int bwide, int bite);
     void packed_load_raw();
     void nokia_load_raw();
     void canon_rmf_load_raw();
     unsigned pana_bits(int nbits);
+    int panasonic_decode_group(const uchar *gp, ushort *pix);
+    int panasonic_load_rows();
     void panasonic_load_raw();
     void olympus_load_raw();
     void minolta_rd175_load_raw();
     void quicktake_100_load_raw();
     void kodak_radc_load_raw();
     void kodak_jpeg_load_raw();
+    void lossy_dng_load_tiles(ushort cur[3][256]);
     void lossy_dng_load_raw();
     void kodak_dc120_load_raw();
     void eight_bit_load_raw();
@@ -202,6 +237,7 @@ public:
     void sony_decrypt(unsigned *data, int len, int start, int key);
     void sony_load_raw();
     void sony_arw_load_raw();
+    void sony_arw2_block(const uchar *dp, const uchar *end, ushort pix[16]);
     void sony_arw2_load_raw();
     void samsung_load_raw();
     void samsung2_load_raw();
@@ -217,7 +253,11 @@ public:
     void foveon_sd_load_raw();
     void foveon_huff(ushort *huff);
     void foveon_dp_load_raw();
+    int crx_decode_tile(struct crx_image *img, struct crx_tile *t, int plane);
+    int crx_read_headers(struct crx_image *img, uchar *hdr, unsigned size);
     void canon_crx_load_raw();
+    int fuji_decode_strip(const struct fuji_q *q, int block,
+	const uchar *data, unsigned size);
     void fuji_xtrans_load_raw();
     void parse_crx (int end);
     void foveon_load_camf();
@@ -29,6 +29,9 @@
 #include <sys/types.h>
 #include "dcraw_api.h"
 #include "dcraw.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define FORC(cnt) for (c=0; c < cnt; c++)
 #define FORC3 FORC(3)
@@ -72,7 +75,67 @@ extern "C" {
     void fuji_rotate_INDI(gushort(**image_p)[4], int *height_p, int *width_p,
                           int *fuji_width_p, const int colors, const double step, void *dcraw);
 
-    int dcraw_open(dcraw_data *h, char *filename)
+    /* Close the input stream and release the memory backing it. */
+    static void dcraw_close_ifp(DCRaw *d)
+    {
+        if (d->ifp != NULL)
+            fclose(d->ifp);
+        d->ifp = NULL;
+        if (d->ifpMapping != NULL)
+            g_mapped_file_unref((GMappedFile *)d->ifpMapping);
+        d->ifpMapping = NULL;
+        d->ifpBuffer = NULL;
+        d->ifpBufferSize = 0;
+    }
+
+    /* Open the input for reading. If 'buffer' is given it holds the
+     * contents of the file. Otherwise, when possible, the file is mapped
+     * into memory so that the decoders read it without any system calls. */
+    static FILE *dcraw_open_ifp(DCRaw *d, char *buffer, size_t length)
+    {
+#ifdef HAVE_FMEMOPEN
+        if (buffer != NULL) {
+            d->ifpBuffer = (uchar *)buffer;
+            d->ifpBufferSize = length;
+            return fmemopen(buffer, length, "rb");
+        }
+        GMappedFile *map = g_mapped_file_new(d->ifname, FALSE, NULL);
+        if (map != NULL) {
+            FILE *ifp = NULL;
+            if (g_mapped_file_get_length(map) > 0)
+                ifp = fmemopen(g_mapped_file_get_contents(map),
+                               g_mapped_file_get_length(map), "rb");
+            if (ifp != NULL) {
+                d->ifpMapping = map;
+                d->ifpBuffer = (uchar *)g_mapped_file_get_contents(map);
+                d->ifpBufferSize = g_mapped_file_get_length(map);
+                return ifp;
+            }
+            g_mapped_file_unref(map);
+        }
+#else
+        if (buffer != NULL) {
+            (void)length;
+            errno = ENOSYS;
+            return NULL;
+        }
+#endif
+        return g_fopen(d->ifname, "rb");
+    }
+
+    /* Pentax pixel shift has four frames, Fuji Super CCD SR and EXR
+     * have two. They are identified up front and decoded together. */
+    static int dcraw_frame_count(DCRaw *d)
+    {
+        if (d->is_raw == 4 && !strncasecmp(d->make, "Pentax", 6))
+            return 4;
+        if (d->is_raw == 2 && !strncasecmp(d->make, "Fujifilm", 8))
+            return 2;
+        return 1;
+    }
+
+    static int dcraw_open_input(dcraw_data *h, char *filename,
+                                char *buffer, size_t length)
     {
         DCRaw *d = new DCRaw;
         int c, i;
@@ -89,10 +152,11 @@ extern "C" {
         if (setjmp(d->failure)) {
             d->dcraw_message(DCRAW_ERROR, _("Fatal internal error\n"));
             h->message = d->messageBuffer;
+            dcraw_close_ifp(d);
             delete d;
             return DCRAW_ERROR;
         }
-        if (!(d->ifp = g_fopen(d->ifname, "rb"))) {
+        if (!(d->ifp = dcraw_open_ifp(d, buffer, length))) {
             gchar *err_u8 = g_locale_to_utf8(strerror(errno), -1, NULL, NULL, NULL);
             d->dcraw_message(DCRAW_OPEN_ERROR, _("Cannot open file %s: %s\n"),
                              d->ifname_display, err_u8);
@@ -107,7 +171,7 @@ extern "C" {
         if (!d->make[0]) {
             d->dcraw_message(DCRAW_OPEN_ERROR, _("%s: unsupported file format.\n"),
                              d->ifname_display);
-            fclose(d->ifp);
+            dcraw_close_ifp(d);
             h->message = d->messageBuffer;
             int lastStatus = d->lastStatus;
             delete d;
@@ -117,7 +181,7 @@ extern "C" {
         if (!d->is_raw) {
             d->dcraw_message(DCRAW_OPEN_ERROR, _("Cannot decode file %s\n"),
                              d->ifname_display);
-            fclose(d->ifp);
+            dcraw_close_ifp(d);
             h->message = d->messageBuffer;
             int lastStatus = d->lastStatus;
             delete d;
@@ -158,6 +222,7 @@ extern "C" {
         d->black += i;
         h->black = d->black;
         h->shrink = d->shrink = (h->filters == 1 || h->filters > 1000);
+        h->frames = dcraw_frame_count(d);
         h->pixel_aspect = d->pixel_aspect;
         /* copied from dcraw's main() */
         switch ((d->flip + 3600) % 360) {
@@ -189,6 +254,17 @@ extern "C" {
         return d->lastStatus;
     }
 
+    int dcraw_open(dcraw_data *h, char *filename)
+    {
+        return dcraw_open_input(h, filename, NULL, 0);
+    }
+
+    int dcraw_open_buffer(dcraw_data *h, char *filename,
+                          char *buffer, size_t length)
+    {
+        return dcraw_open_input(h, filename, buffer, length);
+    }
+
     void dcraw_image_dimensions(dcraw_data *raw, int flip, int shrink,
                                 int *height, int *width)
     {
@@ -251,6 +327,9 @@ extern "C" {
                 mul[0][2] = mul[1][0] = mul[2][2] = mul[3][0] = d->cam_mul[2] / saved_cam_mul[2];
             }
 
+#ifdef _OPENMP
+            #pragma omp parallel for private(j, S, R, w)
+#endif
             for (i = 0 ; i < d->raw_height; i++)
                 for (j = 0 ; j < d->raw_width; j++) {
 
@@ -296,6 +375,9 @@ extern "C" {
                 m += 1;
                 l *= m;
 
+#ifdef _OPENMP
+                #pragma omp parallel for private(S, R, w)
+#endif
                 for (i = 0 ; i < d->raw_height * d->raw_width; i++) {
 
                     /* Range check to avoid problems when value is below black. */
@@ -329,6 +411,9 @@ extern "C" {
 
             } else { /* Low-noise-mode */
 
+#ifdef _OPENMP
+                #pragma omp parallel for
+#endif
                 for (i = 0 ; i < d->raw_height * d->raw_width ; i++)
                     d->raw_image[i] += saved_raw_image[i];
 
@@ -341,14 +426,141 @@ extern "C" {
         }
     }
 
+#define DCRAW_MAX_FRAMES 4
+
+    static ushort *dcraw_alloc_raw_image(DCRaw *d)
+    {
+        if (d->colors == 1 || d->filters == 1 || d->filters > 1000)
+            return (ushort *) g_malloc((d->raw_height + 7) * d->raw_width * 2);
+        return (ushort *) g_malloc(sizeof(dcraw_image_type) *
+                                   (d->raw_height + 7) * d->raw_width);
+    }
+
+    /* Copy 'd' with an input stream of its own, so that another frame of
+     * a multi-frame raw can be decoded concurrently. */
+    static DCRaw *dcraw_frame_open(DCRaw *d)
+    {
+        DCRaw *f = new DCRaw(*d);
+
+        f->ifname = g_strdup(d->ifname);
+        f->ifname_display = g_strdup(d->ifname_display);
+        f->messageBuffer = NULL;
+        f->lastStatus = DCRAW_SUCCESS;
+        f->raw_image = NULL;
+        f->image = NULL;
+        f->meta_data = NULL;
+        f->ifp = NULL;
+        f->ifpMapping = NULL;
+        f->ifpBuffer = NULL;
+        f->ifpBufferSize = 0;
+        /* Only the frame in 'd' reports progress. */
+        f->ifpSize = 0;
+#ifdef HAVE_FMEMOPEN
+        if (d->ifpBuffer != NULL) {
+            f->ifp = fmemopen((void *)d->ifpBuffer, d->ifpBufferSize, "rb");
+            if (f->ifp != NULL) {
+                f->ifpBuffer = d->ifpBuffer;
+                f->ifpBufferSize = d->ifpBufferSize;
+                if (d->ifpMapping != NULL)
+                    f->ifpMapping = g_mapped_file_ref((GMappedFile *)d->ifpMapping);
+            }
+        }
+#endif
+        if (f->ifp == NULL && (f->ifp = g_fopen(f->ifname, "rb")) == NULL) {
+            f->dcraw_message(DCRAW_ERROR, _("Cannot open file %s: %s\n"),
+                             f->ifname_display, g_strerror(errno));
+        }
+        return f;
+    }
+
+    static void dcraw_frame_identify(DCRaw *f, int shot)
+    {
+        if (f->ifp == NULL)
+            return;
+        if (f->shot_select != (unsigned)shot) {
+            f->shot_select = shot;
+            fseek(f->ifp, 0, SEEK_SET);
+            f->identify();
+        }
+        f->raw_image = dcraw_alloc_raw_image(f);
+    }
+
+    static void dcraw_frames_free(DCRaw *d, DCRaw **frames)
+    {
+        int n;
+        for (n = 0; n < DCRAW_MAX_FRAMES; n++) {
+            if (frames[n] == NULL || frames[n] == d)
+                continue;
+            g_free(frames[n]->raw_image);
+            g_free(frames[n]->messageBuffer);
+            dcraw_close_ifp(frames[n]);
+            delete frames[n];
+            frames[n] = NULL;
+        }
+    }
+
+    /* Decode one frame. A failure returns here instead of unwinding
+     * across the worker thread. */
+    static int dcraw_load_frame(DCRaw *f)
+    {
+        jmp_buf failure;
+
+        if (f->ifp == NULL)
+            return 1;
+        memcpy(failure, f->failure, sizeof failure);
+        if (setjmp(f->failure)) {
+            memcpy(f->failure, failure, sizeof failure);
+            return 1;
+        }
+        fseek(f->ifp, f->data_offset, SEEK_SET);
+        (f->*f->load_raw)();
+        memcpy(f->failure, failure, sizeof failure);
+        return 0;
+    }
+
+    /* Decode all frames at once, splitting the threads between them.
+     * The last frame is 'd' itself, which runs on the calling thread
+     * since it reports the progress. */
+    static void dcraw_load_frames(DCRaw *d, DCRaw **frames, int count)
+    {
+        int n, failed = 0;
+
+#ifdef _OPENMP
+        int levels = omp_get_max_active_levels();
+        int threads = omp_get_max_threads();
+        omp_set_max_active_levels(MAX(levels, 2));
+        #pragma omp parallel for schedule(static,1) num_threads(count) reduction(+:failed)
+#endif
+        for (n = 0; n < count; n++) {
+#ifdef _OPENMP
+            omp_set_num_threads(MAX(threads / count, 1));
+#endif
+            failed += dcraw_load_frame(frames[count - 1 - n]);
+        }
+#ifdef _OPENMP
+        omp_set_max_active_levels(levels);
+#endif
+        for (n = 0; n < count - 1; n++) {
+            if (frames[n]->messageBuffer != NULL)
+                d->dcraw_message(frames[n]->lastStatus, "%s",
+                                 frames[n]->messageBuffer);
+            d->data_error += frames[n]->data_error;
+        }
+        if (failed)
+            longjmp(d->failure, 1);
+    }
+
     int dcraw_load_raw(dcraw_data *h)
     {
         /* 'volatile' supresses clobbering warning */
         DCRaw * volatile d = (DCRaw *)h->dcraw;
-        int c, i, j;
+        int c, i, j, n;
         double dmin;
+        /* The frames of a multi-frame raw, in shot order. The last one is
+         * 'd', the others are decoded by copies of it. */
+        DCRaw * volatile frames[DCRAW_MAX_FRAMES] = { NULL };
+        int volatile frame_count = 1;
 
-start:
         g_free(d->messageBuffer);
         d->messageBuffer = NULL;
         d->lastStatus = DCRAW_SUCCESS;
@@ -356,18 +568,28 @@ start:
         if (setjmp(d->failure)) {
             d->dcraw_message(DCRAW_ERROR, _("Fatal internal error\n"));
             h->message = d->messageBuffer;
+            dcraw_frames_free(d, (DCRaw **)frames);
+            dcraw_close_ifp(d);
             delete d;
             return DCRAW_ERROR;
         }
+        frame_count = dcraw_frame_count(d);
+        if (frame_count > 1) {
+            for (n = 0; n < frame_count - 1; n++) {
+                frames[n] = dcraw_frame_open(d);
+                dcraw_frame_identify(frames[n], n);
+            }
+            d->shot_select = frame_count - 1;
+            fseek(d->ifp, 0, SEEK_SET);
+            d->identify();
+        }
+        frames[frame_count - 1] = d;
         h->raw.height = d->iheight = (h->height + h->shrink) >> h->shrink;
         h->raw.width = d->iwidth = (h->width + h->shrink) >> h->shrink;
         h->raw.colors = d->colors;
         h->fourColorFilters = d->filters;
         if (d->filters || d->colors == 1) {
-            if (d->colors == 1 || d->filters == 1 || d->filters > 1000)
-                d->raw_image = (ushort *) g_malloc((d->raw_height + 7) * d->raw_width * 2);
-            else
-                d->raw_image = (ushort *) g_malloc(sizeof(dcraw_image_type) * (d->raw_height + 7) * d->raw_width);
+            d->raw_image = dcraw_alloc_raw_image(d);
         } else {
             h->raw.image = d->image = g_new0(dcraw_image_type, d->iheight * d->iwidth
                                              + d->meta_length);
@@ -378,41 +600,36 @@ start:
         fseek(d->ifp, 0, SEEK_END);
         d->ifpSize = ftell(d->ifp);
         fseek(d->ifp, d->data_offset, SEEK_SET);
-        (d->*d->load_raw)();
+        if (frame_count > 1)
+            dcraw_load_frames(d, (DCRaw **)frames, frame_count);
+        else
+            (d->*d->load_raw)();
 
         /* multishot support, for now Pentax only. */
-        if (d->is_raw == 4 && !strncasecmp(d->make, "Pentax", 6)) {
+        if (frame_count == 4) {
 
-            int row, col, i;
+            int row, col;
             int positions[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
-            static dcraw_image_type *tmp = NULL;
-
-            if (!tmp)
-                tmp = d->image = g_new0(dcraw_image_type, d->height * d->width + d->meta_length);
+            dcraw_image_type *tmp = g_new0(dcraw_image_type,
+                                           d->height * d->width + d->meta_length);
 
+            /* Place the four shifted frames and average the greens in one
+             * pass. Frames are taken in shot order, as they were shot. */
 #ifdef _OPENMP
-            #pragma omp parallel for private(col)
+            #pragma omp parallel for private(col, n)
 #endif
             for (row = 0 ; row < d->height ; row++)
-                for (col = 0 ; col < d->width ; col++)
-                    tmp[row * d->width + col][fcol_INDI(d->filters, row + positions[d->shot_select][0], col + positions[d->shot_select][1], d->top_margin, d->left_margin, d->xtrans)] = d->raw_image[(row + d->top_margin + positions[d->shot_select][0]) * d->raw_width + col + d->left_margin + positions[d->shot_select][1]];
+                for (col = 0 ; col < d->width ; col++) {
+                    for (n = 0 ; n < 4 ; n++) {
+                        DCRaw *f = frames[n];
+                        tmp[row * d->width + col][fcol_INDI(f->filters, row + positions[n][0], col + positions[n][1], f->top_margin, f->left_margin, f->xtrans)] = f->raw_image[(row + f->top_margin + positions[n][0]) * f->raw_width + col + f->left_margin + positions[n][1]];
+                    }
+                    tmp[row * d->width + col][1] = (tmp[row * d->width + col][1] + tmp[row * d->width + col][3]) / 2;
+                }
 
             g_free(d->raw_image);
             d->raw_image = NULL;
-
-            if (d->shot_select < 3) {
-                d->shot_select++;
-                fseek(d->ifp, 0, SEEK_SET);
-                d->identify();
-                goto start;
-            }
-
-            if (d->shot_select == 3) /* Just to keep the compiler happy. */
-#ifdef _OPENMP
-                #pragma omp parallel for
-#endif
-                for (i = 0 ; i < d->height * d->width ; i++)
-                    tmp[i][1] = (tmp[i][1] + tmp[i][3]) / 2;
+            dcraw_frames_free(d, (DCRaw **)frames);
 
             d->image = tmp;
             d->shot_select = 0;
@@ -424,34 +641,14 @@ start:
             h->raw.image = tmp;
             h->filters = 0;
             h->shrink = 0;
-
-            tmp = NULL;
         }
 
         /* Fuji Super CCD SR and EXR support */
-        if (d->is_raw == 2 && !strncasecmp(d->make, "Fujifilm", 8)) {
+        if (frame_count == 2) {
 
-            static int saved_fuji_dr;
-            static float saved_cam_mul[4];
-            static guint16 *saved_raw_image = NULL;
-
-            if (!saved_raw_image) {
-
-                saved_raw_image = d->raw_image;
-                d->raw_image = NULL;
-                saved_fuji_dr = d->fuji_dr;
-                FORC4 saved_cam_mul[c] = d->cam_mul[c];
-
-                d->shot_select++;
-                fseek(d->ifp, 0, SEEK_SET);
-                d->identify();
-                goto start;
-            }
-
-            fuji_merge(d, saved_raw_image, saved_cam_mul, saved_fuji_dr);
-
-            free(saved_raw_image);
-            saved_raw_image = NULL;
+            fuji_merge(d, frames[0]->raw_image, frames[0]->cam_mul,
+                       frames[0]->fuji_dr);
+            dcraw_frames_free(d, (DCRaw **)frames);
             d->shot_select--;
 
             FORC4 h->cam_mul[c] = d->cam_mul[c];
@@ -484,7 +681,7 @@ start:
             h->raw.width = h->width = d->width;
             h->raw.height = h->height = d->height;
         }
-        fclose(d->ifp);
+        dcraw_close_ifp(d);
         h->ifp = NULL;
         // TODO: Go over the following settings to see if they change during
         // load_raw. If they change, document where. If not, move to dcraw_open().
@@ -926,10 +1123,158 @@ start:
         }
     }
 
+    static void demosaic_bilinear(dcraw_data *h, dcraw_image_data *f,
+                                  unsigned filters, int colors)
+    {
+        lin_interpolate_INDI(f->image, filters, f->width, f->height, colors,
+                             h->dcraw, h);
+    }
+
+    static void demosaic_vng(dcraw_data *h, dcraw_image_data *f,
+                             unsigned filters, int colors)
+    {
+        vng_interpolate_INDI(f->image, filters, f->width, f->height, colors,
+                             0xFFFF, h->dcraw, h);
+    }
+
+    static void demosaic_ppg(dcraw_data *h, dcraw_image_data *f,
+                             unsigned filters, int colors)
+    {
+        ppg_interpolate_INDI(f->image, filters, f->width, f->height, colors,
+                             h->dcraw, h);
+    }
+
+    static void demosaic_ahd(dcraw_data *h, dcraw_image_data *f,
+                             unsigned filters, int colors)
+    {
+        ahd_interpolate_INDI(f->image, filters, f->width, f->height, colors,
+                             h->rgb_cam, h->dcraw, h);
+    }
+
+    static void demosaic_xtrans(dcraw_data *h, dcraw_image_data *f,
+                                unsigned /*filters*/, int /*colors*/)
+    {
+        xtrans_interpolate_INDI(f->image, h->filters, f->width, f->height,
+                                h->colors, h->rgb_cam, h->dcraw, h, 3);
+    }
+
+    static void demosaic_xtrans_1pass(dcraw_data *h, dcraw_image_data *f,
+                                      unsigned /*filters*/, int /*colors*/)
+    {
+        xtrans_interpolate_INDI(f->image, h->filters, f->width, f->height,
+                                h->colors, h->rgb_cam, h->dcraw, h, 1);
+    }
+
+    /* The built in engines. Costs are rough timings relative to bilinear.
+     * For ties the earlier engine is preferred. "none" is listed even
+     * without ENABLE_INTERP_NONE, which only hides it in the GUI. */
+    static const dcraw_demosaic demosaicBuiltin[] = {
+        {
+            "ahd", dcraw_ahd_interpolation, dcraw_cfa_bayer | dcraw_cfa_leaf,
+            3, 5, TRUE, FALSE, 10, 8, 3, demosaic_ahd
+        },
+        {
+            "vng", dcraw_vng_interpolation, dcraw_cfa_bayer | dcraw_cfa_leaf,
+            4, 3, TRUE, FALSE, 14, 6, 1, demosaic_vng
+        },
+        {
+            "four-color", dcraw_four_color_interpolation,
+            dcraw_cfa_bayer | dcraw_cfa_leaf,
+            4, 3, TRUE, TRUE, 14, 5, 1, demosaic_vng
+        },
+        {
+            "ppg", dcraw_ppg_interpolation, dcraw_cfa_bayer,
+            3, 3, TRUE, FALSE, 3, 4, 1, demosaic_ppg
+        },
+        {
+            "xtrans", dcraw_xtrans_interpolation, dcraw_cfa_xtrans,
+            3, 16, TRUE, FALSE, 60, 10, 3, demosaic_xtrans
+        },
+        {
+            "xtrans-1pass", dcraw_xtrans_1pass_interpolation, dcraw_cfa_xtrans,
+            3, 16, TRUE, FALSE, 25, 7, 1, demosaic_xtrans_1pass
+        },
+        {
+            "bilinear", dcraw_bilinear_interpolation,
+            dcraw_cfa_bayer | dcraw_cfa_leaf | dcraw_cfa_xtrans,
+            4, 1, TRUE, FALSE, 1, 1, 1, demosaic_bilinear
+        },
+        {
+            "none", dcraw_none_interpolation,
+            dcraw_cfa_bayer | dcraw_cfa_leaf | dcraw_cfa_xtrans,
+            4, 0, TRUE, FALSE, 0, 0, 0, NULL
+        },
+    };
+
+#define DEMOSAIC_MAX 32
+#define DEMOSAIC_BUILTIN \
+        (int)(sizeof demosaicBuiltin / sizeof demosaicBuiltin[0])
+    /* The built in engines are there from the start, so that readers never
+     * race with a lazy initialization. Registering takes a lock and
+     * publishes the new count only after the engine is in place. */
+    static const dcraw_demosaic *demosaicEngine[DEMOSAIC_MAX] = {
+        &demosaicBuiltin[0], &demosaicBuiltin[1], &demosaicBuiltin[2],
+        &demosaicBuiltin[3], &demosaicBuiltin[4], &demosaicBuiltin[5],
+        &demosaicBuiltin[6], &demosaicBuiltin[7]
+    };
+    static volatile gint demosaicCount = DEMOSAIC_BUILTIN;
+    G_LOCK_DEFINE_STATIC(demosaicEngine);
+
+    gboolean dcraw_demosaic_register(const dcraw_demosaic *engine)
+    {
+        gboolean registered = FALSE;
+        G_LOCK(demosaicEngine);
+        int count = g_atomic_int_get(&demosaicCount);
+        if (count < DEMOSAIC_MAX) {
+            demosaicEngine[count] = engine;
+            g_atomic_int_set(&demosaicCount, count + 1);
+            registered = TRUE;
+        }
+        G_UNLOCK(demosaicEngine);
+        return registered;
+    }
+
+    static gboolean demosaic_capable(const dcraw_demosaic *e, const dcraw_data *h)
+    {
+        int cfa = h->filters == 9 ? dcraw_cfa_xtrans :
+                  h->filters == 1 ? dcraw_cfa_leaf : dcraw_cfa_bayer;
+        return (e->cfa & cfa) && h->colors <= e->maxColors;
+    }
+
+    /* For the export the requested engine is used if it can handle the
+     * sensor, otherwise the best one that can. The preview takes the
+     * cheapest one. Engines that cost nothing do nothing, and are only
+     * used on request. */
+    const dcraw_demosaic *dcraw_demosaic_select(const dcraw_data *h,
+            int interpolation, int use)
+    {
+        const dcraw_demosaic *e, *best = NULL;
+        int count = g_atomic_int_get(&demosaicCount);
+        int i;
+
+        for (i = 0; i < count; i++) {
+            e = demosaicEngine[i];
+            if (e->interpolation == interpolation && demosaic_capable(e, h) &&
+                    (use == dcraw_demosaic_export || e->cost == 0))
+                return e;
+        }
+        for (i = 0; i < count; i++) {
+            e = demosaicEngine[i];
+            if (e->cost == 0 || !demosaic_capable(e, h))
+                continue;
+            if (best == NULL ||
+                    (use == dcraw_demosaic_preview && e->cost < best->cost) ||
+                    (use == dcraw_demosaic_export && e->quality > best->quality))
+                best = e;
+        }
+        return best;
+    }
+
     int dcraw_finalize_interpolate(dcraw_image_data *f, dcraw_data *h,
-                                   int interpolation, int smoothing)
+                                   int interpolation, int smoothing, int use)
     {
         DCRaw *d = (DCRaw *)h->dcraw;
+        const dcraw_demosaic *engine;
         int fujiWidth, i, r, c, cl;
         unsigned ff, f4;
 
@@ -948,23 +1293,17 @@ start:
         if (h->filters == 0)
             return DCRAW_ERROR;
 
+        /* (dcraw also forbids AHD for Fuji rotated images) */
+        engine = dcraw_demosaic_select(h, interpolation, use);
+        if (engine == NULL)
+            return DCRAW_ERROR;
         cl = h->colors;
-        if (interpolation == dcraw_four_color_interpolation || h->colors == 4) {
+        if (engine->fourColor || h->colors == 4) {
             ff = h->fourColorFilters;
             cl = 4;
-            interpolation = dcraw_vng_interpolation;
         } else {
             ff = h->filters &= ~((h->filters & 0x55555555) << 1);
         }
-
-        /* It might be better to report an error here: */
-        /* (dcraw also forbids AHD for Fuji rotated images) */
-        if (h->filters == 9 && interpolation != dcraw_bilinear_interpolation)
-            interpolation = dcraw_xtrans_interpolation;
-        if (interpolation == dcraw_ahd_interpolation && h->colors > 3)
-            interpolation = dcraw_vng_interpolation;
-        if (interpolation == dcraw_ppg_interpolation && h->colors > 3)
-            interpolation = dcraw_vng_interpolation;
         f4 = h->fourColorFilters;
         if (h->filters == 1 || h->filters > 1000) {
             for (r = 0; r < h->height; r++)
@@ -975,29 +1314,10 @@ start:
                 }
         } else
             memcpy(f->image, h->raw.image, h->height * h->width * sizeof(dcraw_image_type));
-        int smoothPasses = 1;
-        if (interpolation == dcraw_bilinear_interpolation && (h->filters == 1 || h->filters > 1000))
-            lin_interpolate_INDI(f->image, ff, f->width, f->height, cl, d, h);
-#ifdef ENABLE_INTERP_NONE
-        else if (interpolation == dcraw_none_interpolation)
-            smoothing = 0;
-#endif
-        else if (interpolation == dcraw_vng_interpolation || h->colors > 3)
-            vng_interpolate_INDI(f->image, ff, f->width, f->height, cl, 0xFFFF, d, h);
-        else if (interpolation == dcraw_ppg_interpolation && h->filters > 1000)
-            ppg_interpolate_INDI(f->image, ff, f->width, f->height, cl, d, h);
-
-        else if (interpolation == dcraw_xtrans_interpolation) {
-            xtrans_interpolate_INDI(f->image, h->filters, f->width, f->height,
-                                    h->colors, h->rgb_cam, d, h, 3);
-            smoothPasses = 3;
-        } else if (interpolation == dcraw_ahd_interpolation) {
-            ahd_interpolate_INDI(f->image, ff, f->width, f->height, cl,
-                                 h->rgb_cam, d, h);
-            smoothPasses = 3;
-        }
-        if (smoothing)
-            color_smooth(f->image, f->width, f->height, smoothPasses);
+        if (engine->run != NULL)
+            engine->run(h, f, ff, cl);
+        if (smoothing && engine->smoothPasses > 0)
+            color_smooth(f->image, f->width, f->height, engine->smoothPasses);
 
         if (cl == 4 && h->colors == 3) {
             for (i = 0; i < f->height * f->width; i++)
@@ -1014,6 +1334,7 @@ start:
     {
         DCRaw *d = (DCRaw *)h->dcraw;
         g_free(h->raw.image);
+        dcraw_close_ifp(d);
         delete d;
     }
 
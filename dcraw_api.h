@@ -33,6 +33,7 @@ typedef struct {
     int width, height, colors, fourColorFilters, raw_color;
     unsigned filters;
     int top_margin, left_margin, flip, shrink;
+    int frames;		/* Frames dcraw_load_raw() decodes together */
     double pixel_aspect;
     dcraw_image_data raw;
     dcraw_image_type thresholds;
@@ -54,10 +55,49 @@ typedef struct {
 enum { dcraw_ahd_interpolation,
        dcraw_vng_interpolation, dcraw_four_color_interpolation,
        dcraw_ppg_interpolation, dcraw_bilinear_interpolation,
-       dcraw_xtrans_interpolation, dcraw_none_interpolation
+       dcraw_xtrans_interpolation, dcraw_xtrans_1pass_interpolation,
+       dcraw_none_interpolation
      };
 enum { unknown_thumb_type, jpeg_thumb_type, ppm_thumb_type };
+
+/* Color filter array layouts, as a mask in dcraw_demosaic.cfa */
+enum { dcraw_cfa_bayer = 1,	/* 8x2 pattern in filters */
+       dcraw_cfa_leaf = 2,	/* 16x16 pattern, filters == 1 */
+       dcraw_cfa_xtrans = 4	/* 6x6 pattern, filters == 9 */
+     };
+/* What the demosaiced image is for. The preview uses the cheapest capable
+ * engine, the export the requested one or else the best one that can. */
+enum { dcraw_demosaic_export, dcraw_demosaic_preview };
+
+/* A demosaic engine. dcraw_finalize_interpolate() picks one from the
+ * registry by the requested interpolation and these capabilities. */
+typedef struct {
+    const char *name;
+    int interpolation;	/* dcraw_*_interpolation it implements */
+    int cfa;		/* dcraw_cfa_* mask of supported layouts */
+    int maxColors;	/* Most CFA colors it can handle */
+    int border;		/* Reach in pixels of an output pixel's input */
+    gboolean tileable;	/* Can run on a band of the image */
+    gboolean fourColor;	/* Interpolates the two greens separately */
+    int cost;		/* Relative time per pixel, bilinear is 1 */
+    int quality;	/* Rank of the result, higher is better */
+    int smoothPasses;	/* Color smoothing passes to follow with */
+    /* Interpolate f->image in place. NULL leaves it as it is. */
+    void (*run)(dcraw_data *h, dcraw_image_data *f, unsigned filters,
+                int colors);
+} dcraw_demosaic;
+
+/* Add an engine to the registry. It is used for its interpolation and as
+ * a fallback for the others. Returns FALSE if the registry is full. */
+gboolean dcraw_demosaic_register(const dcraw_demosaic *engine);
+const dcraw_demosaic *dcraw_demosaic_select(const dcraw_data *h,
+        int interpolation, int use);
 int dcraw_open(dcraw_data *h, char *filename);
+/* Open an image from its contents in memory. 'filename' is only used for
+ * messages. The buffer must stay valid until dcraw_load_raw() returns or
+ * dcraw_close() is called. Requires fmemopen(). */
+int dcraw_open_buffer(dcraw_data *h, char *filename,
+                      char *buffer, size_t length);
 int dcraw_load_raw(dcraw_data *h);
 int dcraw_load_thumb(dcraw_data *h, dcraw_image_data *thumb);
 int dcraw_finalize_shrink(dcraw_image_data *f, dcraw_data *h,
@@ -70,7 +110,7 @@ void dcraw_wavelet_denoise(dcraw_data *h, float threshold);
 void dcraw_wavelet_denoise_shrinked(dcraw_image_data *f, float threshold);
 void dcraw_finalize_raw(dcraw_data *h, dcraw_data *dark, int rgbWB[4]);
 int dcraw_finalize_interpolate(dcraw_image_data *f, dcraw_data *h,
-                               int interpolation, int smoothing);
+                               int interpolation, int smoothing, int use);
 void dcraw_close(dcraw_data *h);
 void dcraw_image_dimensions(dcraw_data *raw, int flip, int shrink,
                             int *height, int *width);
@@ -325,6 +325,8 @@ void CLASS lin_interpolate_INDI(ushort(*image)[4], const unsigned filters,
     }
 }
 
+#define VNG_BAND 64	/* Rows per band of VNG work */
+
 /*
    This algorithm is officially called:
 
@@ -362,11 +364,10 @@ void CLASS vng_interpolate_INDI(ushort(*image)[4], const unsigned filters,
         +1, -1, +1, +1, 0, 0x88, +1, +0, +1, +2, 0, 0x08, +1, +0, +2, -1, 0, 0x40,
         +1, +0, +2, +1, 0, 0x10
     }, chood[] = { -1, -1, -1, 0, -1, +1, 0, +1, +1, +1, +1, 0, +1, -1, 0, -1 };
-    ushort(*brow[4])[4], *pix;
+    ushort(*brow[4])[4], *pix, (*edge)[4];
     int prow = 8, pcol = 2, *ip, *code[16][16], gval[8], gmin, gmax, sum[4];
     int row, col, x, y, x1, x2, y1, y2, t, weight, grads, color, diag;
-    int g, diff, thold, num, c;
-    ushort rowtmp[4][width * 4];
+    int g, diff, thold, num, c, band, bands, top, bottom, slot;
 
     lin_interpolate_INDI(image, filters, width, height, colors, dcraw, h); /*UF*/
     dcraw_message(dcraw, DCRAW_VERBOSE, _("VNG interpolation...\n")); /*UF*/
@@ -378,6 +379,9 @@ void CLASS vng_interpolate_INDI(ushort(*image)[4], const unsigned filters,
     for (row = 0; row < prow; row++)		/* Precalculate for VNG */
         for (col = 0; col < pcol; col++) {
             code[row][col] = ip;
+            /* The color of the pixel itself, so that the main loop
+               does not have to look it up for every pixel. */
+            *ip++ = fcol_INDI(filters, row, col, h->top_margin, h->left_margin, h->xtrans);
             for (cp = terms, t = 0; t < 64; t++) {
                 y1 = *cp++;
                 x1 = *cp++;
@@ -408,72 +412,97 @@ void CLASS vng_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                     *ip++ = 0;
             }
         }
+    /* Every output row is computed from the two rows above and below it
+       as they were before VNG. Within a band a row is written back once
+       the two rows after it are done. The first and last two rows of
+       each band are also read by the neighbouring bands, so they are
+       kept aside until all bands are finished. */
+    bands = (height - 4 + VNG_BAND - 1) / VNG_BAND;
+    edge = (ushort(*)[4]) malloc(bands * 4 * width * sizeof * edge);
+    merror(edge, "vng_interpolate()");
     progress(PROGRESS_INTERPOLATE, -height);
 #ifdef _OPENMP
     #pragma omp parallel				\
-    shared(image,code,prow,pcol,h)			\
-    private(row,col,g,brow,rowtmp,pix,ip,gval,diff,gmin,gmax,thold,sum,color,num,c,t)
+    default(shared)					\
+    private(band,top,bottom,slot,row,col,g,brow,pix,ip,gval,diff,gmin,gmax,thold,sum,color,num,c,t)
 #endif
     {
-        int slice = (height - 4) / uf_omp_get_num_threads();
-        int start_row = 2 + slice * uf_omp_get_thread_num();
-        int end_row = MIN(start_row + slice, height - 2);
-        for (row = start_row; row < end_row; row++) { /* Do VNG interpolation */
-            progress(PROGRESS_INTERPOLATE, 1);
-            for (g = 0; g < 4; g++)
-                brow[g] = &rowtmp[(row + g - 2) % 4];
-            for (col = 2; col < width - 2; col++) {
-                pix = image[row * width + col];
-                ip = code[row % prow][col % pcol];
-                memset(gval, 0, sizeof gval);
-                while ((g = ip[0]) != INT_MAX) { /* Calculate gradients */
-                    diff = ABS(pix[g] - pix[ip[1]]) << ip[2];
-                    gval[ip[3]] += diff;
-                    ip += 5;
-                    if ((g = ip[-1]) == -1) continue;
-                    gval[g] += diff;
-                    while ((g = *ip++) != -1)
+        ushort rowtmp[4][width * 4];
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic)
+#endif
+        for (band = 0; band < bands; band++) {
+            top = 2 + band * VNG_BAND;
+            bottom = MIN(top + VNG_BAND, height - 2);
+            progress(PROGRESS_INTERPOLATE, bottom - top);
+            for (row = top; row < bottom; row++) { /* Do VNG interpolation */
+                for (g = 0; g < 4; g++)
+                    brow[g] = &rowtmp[(row + g - 2) % 4];
+                for (col = 2; col < width - 2; col++) {
+                    pix = image[row * width + col];
+                    ip = code[row % prow][col % pcol];
+                    color = *ip++;
+                    memset(gval, 0, sizeof gval);
+                    while ((g = ip[0]) != INT_MAX) { /* Calculate gradients */
+                        diff = ABS(pix[g] - pix[ip[1]]) << ip[2];
+                        gval[ip[3]] += diff;
+                        ip += 5;
+                        if ((g = ip[-1]) == -1) continue;
                         gval[g] += diff;
-                }
-                ip++;
-                gmin = gmax = gval[0]; /* Choose a threshold */
-                for (g = 1; g < 8; g++) {
-                    if (gmin > gval[g]) gmin = gval[g];
-                    if (gmax < gval[g]) gmax = gval[g];
-                }
-                if (gmax == 0) {
-                    memcpy(brow[2][col], pix, sizeof * image);
-                    continue;
-                }
-                thold = gmin + (gmax >> 1);
-                memset(sum, 0, sizeof sum);
-                color = fcol_INDI(filters, row, col, h->top_margin, h->left_margin, h->xtrans);
-                for (num = g = 0; g < 8; g++, ip += 2) { /* Average the neighbors */
-                    if (gval[g] <= thold) {
-                        FORCC
-                        if (c == color && ip[1])
-                            sum[c] += (pix[c] + pix[ip[1]]) >> 1;
-                        else
-                            sum[c] += pix[ip[0] + c];
-                        num++;
+                        while ((g = *ip++) != -1)
+                            gval[g] += diff;
+                    }
+                    ip++;
+                    gmin = gmax = gval[0]; /* Choose a threshold */
+                    for (g = 1; g < 8; g++) {
+                        if (gmin > gval[g]) gmin = gval[g];
+                        if (gmax < gval[g]) gmax = gval[g];
+                    }
+                    if (gmax == 0) {
+                        memcpy(brow[2][col], pix, sizeof * image);
+                        continue;
+                    }
+                    thold = gmin + (gmax >> 1);
+                    memset(sum, 0, sizeof sum);
+                    for (num = g = 0; g < 8; g++, ip += 2) { /* Average the neighbors */
+                        if (gval[g] <= thold) {
+                            FORCC
+                            if (c == color && ip[1])
+                                sum[c] += (pix[c] + pix[ip[1]]) >> 1;
+                            else
+                                sum[c] += pix[ip[0] + c];
+                            num++;
+                        }
+                    }
+                    FORCC {				/* Save to buffer */
+                        t = pix[color];
+                        if (c != color)
+                            t += (sum[c] - sum[color]) / num;
+                        brow[2][col][c] = CLIP(t);
                     }
                 }
-                FORCC {				/* Save to buffer */
-                    t = pix[color];
-                    if (c != color)
-                        t += (sum[c] - sum[color]) / num;
-                    brow[2][col][c] = CLIP(t);
-                }
-            }
-            /* Write buffer to image */
-            if ((row > start_row + 1) || (row == height - 2))
-                memcpy(image[(row - 2)*width + 2], brow[0] + 2, (width - 4)*sizeof * image);
-            if (row == height - 2) {
-                memcpy(image[(row - 1)*width + 2], brow[1] + 2, (width - 4)*sizeof * image);
-                break;
+                /* Keep the rows the neighbouring bands still read */
+                slot = row - top < 2 ? row - top : row - bottom + 4;
+                if (row - top < 2 || bottom - row <= 2)
+                    memcpy(edge[(band * 4 + slot) * width + 2], brow[2] + 2,
+                           (width - 4)*sizeof * image);
+                /* Write buffer to image */
+                if (row - 2 >= top + 2 && row - 2 < bottom - 2)
+                    memcpy(image[(row - 2)*width + 2], brow[0] + 2, (width - 4)*sizeof * image);
             }
         }
+    } /* _OPENMP */
+    for (band = 0; band < bands; band++) {
+        top = 2 + band * VNG_BAND;
+        bottom = MIN(top + VNG_BAND, height - 2);
+        for (row = top; row < bottom; row++) {
+            if (row - top >= 2 && bottom - row > 2) continue;
+            slot = row - top < 2 ? row - top : row - bottom + 4;
+            memcpy(image[row * width + 2], edge[(band * 4 + slot) * width + 2],
+                   (width - 4)*sizeof * image);
+        }
     }
+    free(edge);
     free(ipalloc);
 }
 
@@ -552,12 +581,18 @@ void CLASS ppg_interpolate_INDI(ushort(*image)[4], const unsigned filters,
     }
 }
 
+/* The CIELab tables belong to the interpolation that uses them, so that
+   images can be interpolated concurrently with different colors. */
+typedef struct {
+    float cbrt[0x10000], xyz_cam[3][4];
+} cielab_table;
+
 void CLASS cielab_INDI(ushort rgb[3], short lab[3], const int colors,
-                       const float rgb_cam[3][4])
+                       const float rgb_cam[3][4], cielab_table *table)
 {
     int c, i, j, k;
     float r, xyz[3];
-    static float cbrt[0x10000], xyz_cam[3][4];
+    float *cbrt = table->cbrt, (*xyz_cam)[4] = table->xyz_cam;
 
     if (!rgb) {
         for (i = 0; i < 0x10000; i++) {
@@ -594,7 +629,8 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                                    void *dcraw, dcraw_data *hh, const int passes)
 {
     int c, d, f, g, h, i, v, ng, row, col, top, left, mrow, mcol;
-    int val, ndir, pass, hm[8], avg[4], color[3][8];
+    int val, ndir, pass, hm[8], hv[8][TS], avg[4], color[3][8];
+    int phase, tile, tiles;
     static const short orth[12] = { 1, 0, 0, 1, -1, 0, 0, -1, 1, 0, 0, 1 },
     patt[2][16] = { { 0, 1, 0, -1, 2, 0, -1, 0, 1, 1, 1, -1, 0, 0, 0, 0 },
         { 0, 1, 0, -2, 1, 0, -2, 0, 1, 1, -2, -2, 1, -1, -1, 1 }
@@ -605,11 +641,14 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
     ushort(*rgb)[TS][TS][3], (*rix)[3], (*pix)[4];
     short(*lab)    [TS][3], (*lix)[3];
     float(*drv)[TS][TS], diff[6], tr;
-    char(*homo)[TS][TS], *buffer;
+    char(*homo)[TS][TS], *buffer, (*fc)[6] = hh->xtrans;
+    cielab_table *cielab;
 
     dcraw_message(dcraw, DCRAW_VERBOSE, _("%d-pass X-Trans interpolation...\n"), passes); /*NKBJ*/
 
-    cielab_INDI(0, 0, colors, rgb_cam);
+    cielab = (cielab_table *) malloc(sizeof(cielab_table));
+    merror(cielab, "xtrans_interpolate()");
+    cielab_INDI(0, 0, colors, rgb_cam, cielab);
     ndir = 4 << (passes > 1);
 
     /* Map a green hexagon around each non-green pixel and vice versa:      */
@@ -631,10 +670,12 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                 }
             }
 
+    progress(PROGRESS_INTERPOLATE, -height);
+
     /* Set green1 and green3 to the minimum and maximum allowed values:     */
     for (row = 2; row < height - 2; row++)
         for (min = ~(max = 0), col = 2; col < width - 2; col++) {
-            if (fcol_INDI(filters, row, col, hh->top_margin, hh->left_margin, hh->xtrans) == 1 && (min = ~(max = 0))) continue;
+            if (fc[row % 6][col % 6] == 1 && (min = ~(max = 0))) continue;
             pix = image + row * width + col;
             hex = allhex[row % 3][col % 3][0];
             if (!max) FORC(6) {
@@ -657,10 +698,14 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
         }
 
 
+    /* Each tile writes its result over pixels that the tiles above and
+       below it still read. Even tile rows are done first and odd ones
+       after them, so the result does not depend on the thread timing. */
+    tiles = height > 22 ? (height - 23) / (TS - 16) + 1 : 0;
 #ifdef _OPENMP
     #pragma omp parallel				\
     default(shared)					\
-    private(top, left, row, col, pix, mrow, mcol, hex, color, c, pass, rix, val, d, f, g, h, i, diff, lix, tr, avg, v, buffer, rgb, lab, drv, homo, hm, max)
+    private(top, left, row, col, pix, mrow, mcol, hex, color, c, pass, rix, val, d, f, g, h, i, diff, lix, tr, avg, v, buffer, rgb, lab, drv, homo, hm, hv, max, phase, tile)
 #endif
     {
         buffer = (char *) malloc(TS * TS * (ndir * 11 + 6));
@@ -670,180 +715,194 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
         drv  = (float(*)[TS][TS])(buffer + TS * TS * (ndir * 6 + 6));
         homo = (char(*)[TS][TS])(buffer + TS * TS * (ndir * 10 + 6));
 
-        progress(PROGRESS_INTERPOLATE, -height);
-
+        for (phase = 0; phase < 2; phase++) {
 #ifdef _OPENMP
-        #pragma omp for
+            #pragma omp for schedule(dynamic)
 #endif
+            for (tile = phase; tile < tiles; tile += 2) {
+                top = 3 + tile * (TS - 16);
+                progress(PROGRESS_INTERPOLATE, TS - 16);
+                for (left = 3; left < width - 19; left += TS - 16) {
+                    mrow = MIN(top + TS, height - 3);
+                    mcol = MIN(left + TS, width - 3);
+                    for (row = top; row < mrow; row++)
+                        for (col = left; col < mcol; col++)
+                            memcpy(rgb[0][row - top][col - left], image[row * width + col], 6);
+                    FORC3 memcpy(rgb[c + 1], rgb[0], sizeof * rgb);
+
+                    /* Interpolate green horizontally, vertically, and along both diagonals: */
+                    for (row = top; row < mrow; row++)
+                        for (col = left; col < mcol; col++) {
+                            if ((f = fc[row % 6][col % 6]) == 1) continue;
+                            pix = image + row * width + col;
+                            hex = allhex[row % 3][col % 3][0];
+                            color[1][0] = 174 * (pix[  hex[1]][1] + pix[  hex[0]][1]) -
+                                          46 * (pix[2 * hex[1]][1] + pix[2 * hex[0]][1]);
+                            color[1][1] = 223 *  pix[  hex[3]][1] + pix[  hex[2]][1] * 33 +
+                                          92 * (pix[      0 ][f] - pix[ -hex[2]][f]);
+                            FORC(2) color[1][2 + c] =
+                                164 * pix[hex[4 + c]][1] + 92 * pix[-2 * hex[4 + c]][1] + 33 *
+                                (2 * pix[0][f] - pix[3 * hex[4 + c]][f] - pix[-3 * hex[4 + c]][f]);
+                            FORC4 rgb[c ^ !((row - sgrow) % 3)][row - top][col - left][1] =
+                                LIM(color[1][c] >> 8, pix[0][1], pix[0][3]);
+                        }
 
-        for (top = 3; top < height - 19; top += TS - 16) {
-            progress(PROGRESS_INTERPOLATE, TS - 16);
-            for (left = 3; left < width - 19; left += TS - 16) {
-                mrow = MIN(top + TS, height - 3);
-                mcol = MIN(left + TS, width - 3);
-                for (row = top; row < mrow; row++)
-                    for (col = left; col < mcol; col++)
-                        memcpy(rgb[0][row - top][col - left], image[row * width + col], 6);
-                FORC3 memcpy(rgb[c + 1], rgb[0], sizeof * rgb);
-
-                /* Interpolate green horizontally, vertically, and along both diagonals: */
-                for (row = top; row < mrow; row++)
-                    for (col = left; col < mcol; col++) {
-                        if ((f = fcol_INDI(filters, row, col, hh->top_margin, hh->left_margin, hh->xtrans)) == 1) continue;
-                        pix = image + row * width + col;
-                        hex = allhex[row % 3][col % 3][0];
-                        color[1][0] = 174 * (pix[  hex[1]][1] + pix[  hex[0]][1]) -
-                                      46 * (pix[2 * hex[1]][1] + pix[2 * hex[0]][1]);
-                        color[1][1] = 223 *  pix[  hex[3]][1] + pix[  hex[2]][1] * 33 +
-                                      92 * (pix[      0 ][f] - pix[ -hex[2]][f]);
-                        FORC(2) color[1][2 + c] =
-                            164 * pix[hex[4 + c]][1] + 92 * pix[-2 * hex[4 + c]][1] + 33 *
-                            (2 * pix[0][f] - pix[3 * hex[4 + c]][f] - pix[-3 * hex[4 + c]][f]);
-                        FORC4 rgb[c ^ !((row - sgrow) % 3)][row - top][col - left][1] =
-                            LIM(color[1][c] >> 8, pix[0][1], pix[0][3]);
-                    }
+                    for (pass = 0; pass < passes; pass++) {
+                        if (pass == 1)
+                            memcpy(rgb += 4, buffer, 4 * sizeof * rgb);
 
-                for (pass = 0; pass < passes; pass++) {
-                    if (pass == 1)
-                        memcpy(rgb += 4, buffer, 4 * sizeof * rgb);
-
-                    /* Recalculate green from interpolated values of closer pixels: */
-                    if (pass) {
-                        for (row = top + 2; row < mrow - 2; row++)
-                            for (col = left + 2; col < mcol - 2; col++) {
-                                if ((f = fcol_INDI(filters, row, col, hh->top_margin, hh->left_margin, hh->xtrans)) == 1) continue;
-                                pix = image + row * width + col;
-                                hex = allhex[row % 3][col % 3][1];
-                                for (d = 3; d < 6; d++) {
-                                    rix = &rgb[(d - 2) ^ !((row - sgrow) % 3)][row - top][col - left];
-                                    val = rix[-2 * hex[d]][1] + 2 * rix[hex[d]][1]
-                                          - rix[-2 * hex[d]][f] - 2 * rix[hex[d]][f] + 3 * rix[0][f];
-                                    rix[0][1] = LIM(val / 3, pix[0][1], pix[0][3]);
+                        /* Recalculate green from interpolated values of closer pixels: */
+                        if (pass) {
+                            for (row = top + 2; row < mrow - 2; row++)
+                                for (col = left + 2; col < mcol - 2; col++) {
+                                    if ((f = fc[row % 6][col % 6]) == 1) continue;
+                                    pix = image + row * width + col;
+                                    hex = allhex[row % 3][col % 3][1];
+                                    for (d = 3; d < 6; d++) {
+                                        rix = &rgb[(d - 2) ^ !((row - sgrow) % 3)][row - top][col - left];
+                                        val = rix[-2 * hex[d]][1] + 2 * rix[hex[d]][1]
+                                              - rix[-2 * hex[d]][f] - 2 * rix[hex[d]][f] + 3 * rix[0][f];
+                                        rix[0][1] = LIM(val / 3, pix[0][1], pix[0][3]);
+                                    }
                                 }
-                            }
-                    }
+                        }
 
-                    /* Interpolate red and blue values for solitary green pixels:   */
-                    for (row = (top - sgrow + 4) / 3 * 3 + sgrow; row < mrow - 2; row += 3)
-                        for (col = (left - sgcol + 4) / 3 * 3 + sgcol; col < mcol - 2; col += 3) {
-                            rix = &rgb[0][row - top][col - left];
-                            h = fcol_INDI(filters, row, col + 1, hh->top_margin, hh->left_margin, hh->xtrans);
-                            memset(diff, 0, sizeof diff);
-                            for (i = 1, d = 0; d < 6; d++, i ^= TS ^ 1, h ^= 2) {
-                                for (c = 0; c < 2; c++, h ^= 2) {
-                                    g = 2 * rix[0][1] - rix[i << c][1] - rix[-i << c][1];
-                                    color[h][d] = g + rix[i << c][h] + rix[-i << c][h];
-                                    if (d > 1)
-                                        diff[d] += SQR(rix[i << c][1] - rix[-i << c][1]
-                                                       - rix[i << c][h] + rix[-i << c][h]) + SQR(g);
+                        /* Interpolate red and blue values for solitary green pixels:   */
+                        for (row = (top - sgrow + 4) / 3 * 3 + sgrow; row < mrow - 2; row += 3)
+                            for (col = (left - sgcol + 4) / 3 * 3 + sgcol; col < mcol - 2; col += 3) {
+                                rix = &rgb[0][row - top][col - left];
+                                h = fc[row % 6][(col + 1) % 6];
+                                memset(diff, 0, sizeof diff);
+                                for (i = 1, d = 0; d < 6; d++, i ^= TS ^ 1, h ^= 2) {
+                                    for (c = 0; c < 2; c++, h ^= 2) {
+                                        g = 2 * rix[0][1] - rix[i << c][1] - rix[-i << c][1];
+                                        color[h][d] = g + rix[i << c][h] + rix[-i << c][h];
+                                        if (d > 1)
+                                            diff[d] += SQR(rix[i << c][1] - rix[-i << c][1]
+                                                           - rix[i << c][h] + rix[-i << c][h]) + SQR(g);
+                                    }
+                                    if (d > 1 && (d & 1))
+                                        if (diff[d - 1] < diff[d])
+                                            FORC(2) color[c * 2][d] = color[c * 2][d - 1];
+                                    if (d < 2 || (d & 1)) {
+                                        FORC(2) rix[0][c * 2] = CLIP(color[c * 2][d] / 2);
+                                        rix += TS * TS;
+                                    }
                                 }
-                                if (d > 1 && (d & 1))
-                                    if (diff[d - 1] < diff[d])
-                                        FORC(2) color[c * 2][d] = color[c * 2][d - 1];
-                                if (d < 2 || (d & 1)) {
-                                    FORC(2) rix[0][c * 2] = CLIP(color[c * 2][d] / 2);
-                                    rix += TS * TS;
+                            }
+
+                        /* Interpolate red for blue pixels and vice versa:              */
+                        for (row = top + 3; row < mrow - 3; row++)
+                            for (col = left + 3; col < mcol - 3; col++) {
+                                if ((f = 2 - fc[row % 6][col % 6]) == 1) continue;
+                                rix = &rgb[0][row - top][col - left];
+                                c = (row - sgrow) % 3 ? TS : 1;
+                                h = 3 * (c ^ TS ^ 1);
+                                for (d = 0; d < 4; d++, rix += TS * TS) {
+                                    i = d > 1 || ((d ^ c) & 1) ||
+                                        ((ABS(rix[0][1] - rix[c][1]) + ABS(rix[0][1] - rix[-c][1])) <
+                                         2 * (ABS(rix[0][1] - rix[h][1]) + ABS(rix[0][1] - rix[-h][1]))) ? c : h;
+                                    rix[0][f] = CLIP((rix[i][f] + rix[-i][f] +
+                                                      2 * rix[0][1] - rix[i][1] - rix[-i][1]) / 2);
                                 }
                             }
-                        }
 
-                    /* Interpolate red for blue pixels and vice versa:              */
-                    for (row = top + 3; row < mrow - 3; row++)
-                        for (col = left + 3; col < mcol - 3; col++) {
-                            if ((f = 2 - fcol_INDI(filters, row, col, hh->top_margin, hh->left_margin, hh->xtrans)) == 1) continue;
-                            rix = &rgb[0][row - top][col - left];
-                            c = (row - sgrow) % 3 ? TS : 1;
-                            h = 3 * (c ^ TS ^ 1);
-                            for (d = 0; d < 4; d++, rix += TS * TS) {
-                                i = d > 1 || ((d ^ c) & 1) ||
-                                    ((ABS(rix[0][1] - rix[c][1]) + ABS(rix[0][1] - rix[-c][1])) <
-                                     2 * (ABS(rix[0][1] - rix[h][1]) + ABS(rix[0][1] - rix[-h][1]))) ? c : h;
-                                rix[0][f] = CLIP((rix[i][f] + rix[-i][f] +
-                                                  2 * rix[0][1] - rix[i][1] - rix[-i][1]) / 2);
+                        /* Fill in red and blue for 2x2 blocks of green:                */
+                        for (row = top + 2; row < mrow - 2; row++) if ((row - sgrow) % 3)
+                                for (col = left + 2; col < mcol - 2; col++) if ((col - sgcol) % 3) {
+                                        rix = &rgb[0][row - top][col - left];
+                                        hex = allhex[row % 3][col % 3][1];
+                                        for (d = 0; d < ndir; d += 2, rix += TS * TS)
+                                            if (hex[d] + hex[d + 1]) {
+                                                g = 3 * rix[0][1] - 2 * rix[hex[d]][1] - rix[hex[d + 1]][1];
+                                                for (c = 0; c < 4; c += 2) rix[0][c] =
+                                                        CLIP((g + 2 * rix[hex[d]][c] + rix[hex[d + 1]][c]) / 3);
+                                            } else {
+                                                g = 2 * rix[0][1] - rix[hex[d]][1] - rix[hex[d + 1]][1];
+                                                for (c = 0; c < 4; c += 2) rix[0][c] =
+                                                        CLIP((g + rix[hex[d]][c] + rix[hex[d + 1]][c]) / 2);
+                                            }
+                                    }
+                    }
+                    rgb = (ushort(*)[TS][TS][3]) buffer;
+                    mrow -= top;
+                    mcol -= left;
+
+                    /* Convert to CIELab and differentiate in all directions:       */
+                    for (d = 0; d < ndir; d++) {
+                        for (row = 2; row < mrow - 2; row++)
+                            for (col = 2; col < mcol - 2; col++)
+                                cielab_INDI(rgb[d][row][col], lab[row][col], colors, rgb_cam, cielab);
+                        for (f = dir[d & 3], row = 3; row < mrow - 3; row++)
+                            for (col = 3; col < mcol - 3; col++) {
+                                lix = &lab[row][col];
+                                g = 2 * lix[0][0] - lix[f][0] - lix[-f][0];
+                                drv[d][row][col] = SQR(g)
+                                                   + SQR((2 * lix[0][1] - lix[f][1] - lix[-f][1] + g * 500 / 232))
+                                                   + SQR((2 * lix[0][2] - lix[f][2] - lix[-f][2] - g * 500 / 580));
                             }
+                    }
+
+                    /* Build homogeneity maps from the derivatives:                 */
+                    memset(homo, 0, ndir * TS * TS);
+                    for (row = 4; row < mrow - 4; row++)
+                        for (col = 4; col < mcol - 4; col++) {
+                            for (tr = FLT_MAX, d = 0; d < ndir; d++)
+                                if (tr > drv[d][row][col])
+                                    tr = drv[d][row][col];
+                            tr *= 8;
+                            for (d = 0; d < ndir; d++)
+                                for (v = -1; v <= 1; v++)
+                                    for (h = -1; h <= 1; h++)
+                                        if (drv[d][row + v][col + h] <= tr)
+                                            homo[d][row][col]++;
                         }
 
-                    /* Fill in red and blue for 2x2 blocks of green:                */
-                    for (row = top + 2; row < mrow - 2; row++) if ((row - sgrow) % 3)
-                            for (col = left + 2; col < mcol - 2; col++) if ((col - sgcol) % 3) {
-                                    rix = &rgb[0][row - top][col - left];
-                                    hex = allhex[row % 3][col % 3][1];
-                                    for (d = 0; d < ndir; d += 2, rix += TS * TS)
-                                        if (hex[d] + hex[d + 1]) {
-                                            g = 3 * rix[0][1] - 2 * rix[hex[d]][1] - rix[hex[d + 1]][1];
-                                            for (c = 0; c < 4; c += 2) rix[0][c] =
-                                                    CLIP((g + 2 * rix[hex[d]][c] + rix[hex[d + 1]][c]) / 3);
-                                        } else {
-                                            g = 2 * rix[0][1] - rix[hex[d]][1] - rix[hex[d + 1]][1];
-                                            for (c = 0; c < 4; c += 2) rix[0][c] =
-                                                    CLIP((g + rix[hex[d]][c] + rix[hex[d + 1]][c]) / 2);
-                                        }
+                    /* Average the most homogenous pixels for the final result:     */
+                    if (height - top < TS + 4) mrow = height - top + 2;
+                    if (width - left < TS + 4) mcol = width - left + 2;
+                    for (row = MIN(top, 8); row < mrow - 8; row++) {
+                        /* The 5x5 sums are built from column sums shared
+                           by five neighbouring pixels. */
+                        for (col = MIN(left, 8) - 2; col < mcol - 6; col++)
+                            for (d = 0; d < ndir; d++)
+                                for (hv[d][col] = 0, v = -2; v <= 2; v++)
+                                    hv[d][col] += homo[d][row + v][col];
+                        for (col = MIN(left, 8); col < mcol - 8; col++) {
+                            for (d = 0; d < ndir; d++)
+                                for (hm[d] = 0, h = -2; h <= 2; h++)
+                                    hm[d] += hv[d][col + h];
+                            for (d = 0; d < ndir - 4; d++)
+                                if (hm[d] < hm[d + 4]) hm[d  ] = 0;
+                                else if (hm[d] > hm[d + 4]) hm[d + 4] = 0;
+                            for (max = hm[0], d = 1; d < ndir; d++)
+                                if (max < hm[d]) max = hm[d];
+                            max -= max >> 3;
+                            memset(avg, 0, sizeof avg);
+                            for (d = 0; d < ndir; d++)
+                                if (hm[d] >= max) {
+                                    FORC3 avg[c] += rgb[d][row][col][c];
+                                    avg[3]++;
                                 }
-                }
-                rgb = (ushort(*)[TS][TS][3]) buffer;
-                mrow -= top;
-                mcol -= left;
-
-                /* Convert to CIELab and differentiate in all directions:       */
-                for (d = 0; d < ndir; d++) {
-                    for (row = 2; row < mrow - 2; row++)
-                        for (col = 2; col < mcol - 2; col++)
-                            cielab_INDI(rgb[d][row][col], lab[row][col], colors, rgb_cam);
-                    for (f = dir[d & 3], row = 3; row < mrow - 3; row++)
-                        for (col = 3; col < mcol - 3; col++) {
-                            lix = &lab[row][col];
-                            g = 2 * lix[0][0] - lix[f][0] - lix[-f][0];
-                            drv[d][row][col] = SQR(g)
-                                               + SQR((2 * lix[0][1] - lix[f][1] - lix[-f][1] + g * 500 / 232))
-                                               + SQR((2 * lix[0][2] - lix[f][2] - lix[-f][2] - g * 500 / 580));
+                            FORC3 image[(row + top)*width + col + left][c] = avg[c] / avg[3];
                         }
-                }
-
-                /* Build homogeneity maps from the derivatives:                 */
-                memset(homo, 0, ndir * TS * TS);
-                for (row = 4; row < mrow - 4; row++)
-                    for (col = 4; col < mcol - 4; col++) {
-                        for (tr = FLT_MAX, d = 0; d < ndir; d++)
-                            if (tr > drv[d][row][col])
-                                tr = drv[d][row][col];
-                        tr *= 8;
-                        for (d = 0; d < ndir; d++)
-                            for (v = -1; v <= 1; v++)
-                                for (h = -1; h <= 1; h++)
-                                    if (drv[d][row + v][col + h] <= tr)
-                                        homo[d][row][col]++;
-                    }
-
-                /* Average the most homogenous pixels for the final result:     */
-                if (height - top < TS + 4) mrow = height - top + 2;
-                if (width - left < TS + 4) mcol = width - left + 2;
-                for (row = MIN(top, 8); row < mrow - 8; row++)
-                    for (col = MIN(left, 8); col < mcol - 8; col++) {
-                        for (d = 0; d < ndir; d++)
-                            for (hm[d] = 0, v = -2; v <= 2; v++)
-                                for (h = -2; h <= 2; h++)
-                                    hm[d] += homo[d][row + v][col + h];
-                        for (d = 0; d < ndir - 4; d++)
-                            if (hm[d] < hm[d + 4]) hm[d  ] = 0;
-                            else if (hm[d] > hm[d + 4]) hm[d + 4] = 0;
-                        for (max = hm[0], d = 1; d < ndir; d++)
-                            if (max < hm[d]) max = hm[d];
-                        max -= max >> 3;
-                        memset(avg, 0, sizeof avg);
-                        for (d = 0; d < ndir; d++)
-                            if (hm[d] >= max) {
-                                FORC3 avg[c] += rgb[d][row][col][c];
-                                avg[3]++;
-                            }
-                        FORC3 image[(row + top)*width + col + left][c] = avg[c] / avg[3];
                     }
+                }
             }
         }
         free(buffer);
     } /* _OPENMP */
+    free(cielab);
     border_interpolate_INDI(height, width, image, filters, colors, 8, hh);
 }
 
+#undef TS
+/* AHD keeps 26*TS*TS bytes of scratch per thread. At 256 this stays close
+   to the size of a typical L2 cache, while the 512 used by X-Trans would
+   not. The result does not depend on the tile size, only the amount of
+   overlap recomputed between tiles does. */
+#define TS 256
+
 /*
    Adaptive Homogeneity-Directed interpolation is based on
    the work of Keigo Hirakawa, Thomas Parks, and Paul Lee.
@@ -853,32 +912,38 @@ void CLASS ahd_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                                 const int colors, const float rgb_cam[3][4],
                                 void *dcraw, dcraw_data *h)
 {
-    int i, j, top, left, row, col, tr, tc, c, d, val, hm[2];
+    int i, top, left, row, col, tr, tc, c, d, val, hm[2], hv[2][TS];
     static const int dir[4] = { -1, 1, -TS, TS };
     unsigned ldiff[2][4], abdiff[2][4], leps, abeps;
     ushort(*rgb)[TS][TS][3], (*rix)[3], (*pix)[4];
     short(*lab)[TS][TS][3], (*lix)[3];
     char(*homo)[TS][TS], *buffer;
+    cielab_table *cielab;
 
     dcraw_message(dcraw, DCRAW_VERBOSE, _("AHD interpolation...\n")); /*UF*/
 
+    /* The tables and the border are shared by all threads, so they are
+       prepared once before the tiles are started. */
+    cielab = (cielab_table *) malloc(sizeof(cielab_table));
+    merror(cielab, "ahd_interpolate()");
+    cielab_INDI(0, 0, colors, rgb_cam, cielab);
+    border_interpolate_INDI(height, width, image, filters, colors, 5, h);
+    progress(PROGRESS_INTERPOLATE, -height);
+
 #ifdef _OPENMP
     #pragma omp parallel				\
     default(shared)					\
-    private(top, left, row, col, pix, rix, lix, c, val, d, tc, tr, i, j, ldiff, abdiff, leps, abeps, hm, buffer, rgb, lab, homo)
+    private(top, left, row, col, pix, rix, lix, c, val, d, tc, tr, i, ldiff, abdiff, leps, abeps, hm, hv, buffer, rgb, lab, homo)
 #endif
     {
-        cielab_INDI(0, 0, colors, rgb_cam);
-        border_interpolate_INDI(height, width, image, filters, colors, 5, h);
         buffer = (char *) malloc(26 * TS * TS);
         merror(buffer, "ahd_interpolate()");
         rgb  = (ushort(*)[TS][TS][3]) buffer;
         lab  = (short(*)[TS][TS][3])(buffer + 12 * TS * TS);
         homo = (char(*)[TS][TS])(buffer + 24 * TS * TS);
 
-        progress(PROGRESS_INTERPOLATE, -height);
 #ifdef _OPENMP
-        #pragma omp for
+        #pragma omp for schedule(dynamic)
 #endif
         for (top = 2; top < height - 5; top += TS - 6) {
             progress(PROGRESS_INTERPOLATE, TS - 6);
@@ -919,10 +984,11 @@ void CLASS ahd_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                             rix[0][c] = CLIP(val);
                             c = FC(row, col);
                             rix[0][c] = pix[0][c];
-                            cielab_INDI(rix[0], lix[0], colors, rgb_cam);
+                            cielab_INDI(rix[0], lix[0], colors, rgb_cam, cielab);
                         }
-                /*  Build homogeneity maps from the CIELab images: */
-                memset(homo, 0, 2 * TS * TS);
+                /*  Build homogeneity maps from the CIELab images.
+                    Every cell read below is written here, so the maps
+                    need no clearing between tiles. */
                 for (row = top + 2; row < top + TS - 2 && row < height - 4; row++) {
                     tr = row - top;
                     for (col = left + 2; col < left + TS - 2 && col < width - 4; col++) {
@@ -939,21 +1005,28 @@ void CLASS ahd_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                                    MAX(ldiff[1][2], ldiff[1][3]));
                         abeps = MIN(MAX(abdiff[0][0], abdiff[0][1]),
                                     MAX(abdiff[1][2], abdiff[1][3]));
-                        for (d = 0; d < 2; d++)
-                            for (i = 0; i < 4; i++)
-                                if (ldiff[d][i] <= leps && abdiff[d][i] <= abeps)
-                                    homo[d][tr][tc]++;
+                        for (d = 0; d < 2; d++) {
+                            for (val = i = 0; i < 4; i++)
+                                val += ldiff[d][i] <= leps && abdiff[d][i] <= abeps;
+                            homo[d][tr][tc] = val;
+                        }
                     }
                 }
-                /*  Combine the most homogenous pixels for the final result: */
+                /*  Combine the most homogenous pixels for the final result.
+                    The 3x3 sums are taken as three column sums, each of
+                    which is shared by three neighbouring pixels. */
                 for (row = top + 3; row < top + TS - 3 && row < height - 5; row++) {
                     tr = row - top;
+                    for (col = left + 2; col < left + TS - 2 && col < width - 4; col++) {
+                        tc = col - left;
+                        for (d = 0; d < 2; d++)
+                            hv[d][tc] = homo[d][tr - 1][tc] + homo[d][tr][tc]
+                                        + homo[d][tr + 1][tc];
+                    }
                     for (col = left + 3; col < left + TS - 3 && col < width - 5; col++) {
                         tc = col - left;
                         for (d = 0; d < 2; d++)
-                            for (hm[d] = 0, i = tr - 1; i <= tr + 1; i++)
-                                for (j = tc - 1; j <= tc + 1; j++)
-                                    hm[d] += homo[d][i][j];
+                            hm[d] = hv[d][tc - 1] + hv[d][tc] + hv[d][tc + 1];
                         if (hm[0] != hm[1])
                             FORC3 image[row * width + col][c] = rgb[hm[1] > hm[0]][tr][tc][c];
                         else
@@ -965,6 +1038,7 @@ void CLASS ahd_interpolate_INDI(ushort(*image)[4], const unsigned filters,
         }
         free(buffer);
     } /* _OPENMP */
+    free(cielab);
 }
 #undef TS
 
@@ -980,8 +1054,8 @@ void CLASS ahd_interpolate_INDI(ushort(*image)[4], const unsigned filters,
  * N. Devillard - 1998
  */
 
-#define PIX_SORT(a,b) { if ((a)>(b)) PIX_SWAP((a),(b)); }
-#define PIX_SWAP(a,b) { int temp=(a);(a)=(b);(b)=temp; }
+/* Branch free, so that loops calling median9() can be vectorized */
+#define PIX_SORT(a,b) { int temp=MIN((a),(b));(b)=MAX((a),(b));(a)=temp; }
 
 static inline int median9(int *p)
 {
@@ -1007,70 +1081,144 @@ static inline int median9(int *p)
     return (p[4]) ;
 }
 
-#undef PIX_SWAP
 #undef PIX_SORT
 
-// Just making this function inline speeds up ahd_interpolate_INDI() up to 15%
-static inline ushort eahd_median(int row, int col, int color,
-                                 ushort(*image)[4], const int width)
+/*
+ * One pass of the color smoothing over a row. up, mid and down hold the
+ * R-G or B-G differences of three consecutive rows from the previous pass.
+ * The new difference is the median of the 3x3 neighbourhood, clipped the
+ * same way as the color value it will eventually be added back into.
+ */
+static void color_smooth_row(int *out, const int *up, const int *mid,
+                             const int *down, ushort(*pix)[4], const int width)
 {
-    //declare the pixel array
-    int pArray[9];
-    int result;
-
-    //perform the median filter (this only works for red or blue)
-    //  result = median(R-G)+G or median(B-G)+G
-    //
-    // to perform the filter on green, it needs to be the average
-    //  results = (median(G-R)+median(G-B)+R+B)/2
-
-    //no checks are done here to speed up the inlining
-    pArray[0] = image[width * (row) + col + 1][color] - image[width * (row) + col + 1][1];
-    pArray[1] = image[width * (row - 1) + col + 1][color] - image[width * (row - 1) + col + 1][1];
-    pArray[2] = image[width * (row - 1) + col  ][color] - image[width * (row - 1) + col  ][1];
-    pArray[3] = image[width * (row - 1) + col - 1][color] - image[width * (row - 1) + col - 1][1];
-    pArray[4] = image[width * (row) + col - 1][color] - image[width * (row) + col - 1][1];
-    pArray[5] = image[width * (row + 1) + col - 1][color] - image[width * (row + 1) + col - 1][1];
-    pArray[6] = image[width * (row + 1) + col  ][color] - image[width * (row + 1) + col  ][1];
-    pArray[7] = image[width * (row + 1) + col + 1][color] - image[width * (row + 1) + col + 1][1];
-    pArray[8] = image[width * (row) + col  ][color] - image[width * (row) + col  ][1];
-
-    median9(pArray);
-    result = pArray[4] + image[width * (row) + col  ][1];
-    return DTOP(result);
-
+    int col, g, val, p[9];
+
+    out[0] = mid[0];
+    out[1] = mid[1];
+    for (col = 2; col < width - 2; col++) {
+        p[0] = mid[col + 1];
+        p[1] = up[col + 1];
+        p[2] = up[col];
+        p[3] = up[col - 1];
+        p[4] = mid[col - 1];
+        p[5] = down[col - 1];
+        p[6] = down[col];
+        p[7] = down[col + 1];
+        p[8] = mid[col];
+        g = pix[col][1];
+        val = median9(p) + g;
+        out[col] = DTOP(val) - g;
+    }
+    out[width - 2] = mid[width - 2];
+    out[width - 1] = mid[width - 1];
 }
 
+#define CS_BAND 64	/* Rows per band of color smoothing */
+
 // Add the color smoothing from Kimmel as suggested in the AHD paper
 // Algorithm updated by Michael Goertz
+//
+// The median filter is applied to R-G and B-G. Every pass reads the
+// result of the previous pass only, so the rows can be split in bands
+// that run in parallel. Each band streams through its rows once and runs
+// all the passes on a few rows of differences per pass, lagging one row
+// behind the previous pass. The first and last rows of each band are
+// still read by the neighbouring bands, so they are written back only
+// after all bands are finished.
 void CLASS color_smooth(ushort(*image)[4], const int width, const int height,
                         const int passes)
 {
-    int row, col;
-    int row_start = 2;
-    int row_stop  = height - 2;
-    int col_start = 2;
-    int col_stop  = width - 2;
-    //interate through all the colors
-    int count;
-
-    ushort *mpix;
-
-    for (count = 0; count < passes; count++) {
-        //perform 3 iterations - seems to be a commonly settled upon number of iterations
+    int row, col, r, c, pass, band, bands, top, bottom, slot, *buf;
+    int *prev, *cur;
+    ushort(*edge)[2], (*pix)[4];
+
+    if (passes < 1 || width < 5 || height < 5) return;
+    bands = (height - 4 + CS_BAND - 1) / CS_BAND;
+    edge = (ushort(*)[2]) malloc(bands * 2 * passes * width * sizeof * edge);
+    merror(edge, "color_smooth()");
+
+#define CS_ROW(pass, row, c) \
+    (buf + ((((pass) * 3 + (row) % 3) * 2) + (c)) * width)
+
 #ifdef _OPENMP
-        #pragma omp parallel for default(shared) private(row,col,mpix)
+    #pragma omp parallel default(shared) \
+    private(row, col, r, c, pass, band, top, bottom, slot, buf, prev, cur, pix)
 #endif
-        for (row = row_start; row < row_stop; row++) {
-            for (col = col_start; col < col_stop; col++) {
-                //calculate the median only over the red and blue
-                //calculating over green seems to offer very little additional quality
-                mpix = image[row * width + col];
-                mpix[0] = eahd_median(row, col, 0, image, width);
-                mpix[2] = eahd_median(row, col, 2, image, width);
+    {
+        buf = (int *) malloc((passes + 1) * 3 * 2 * width * sizeof * buf);
+        merror(buf, "color_smooth()");
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic)
+#endif
+        for (band = 0; band < bands; band++) {
+            top = 2 + band * CS_BAND;
+            bottom = MIN(top + CS_BAND, height - 2);
+            for (r = top - passes; r < bottom + passes; r++) {
+                /* Load the differences of a new row. */
+                if (r >= 0 && r < height) {
+                    pix = image + r * width;
+                    for (c = 0; c < 2; c++) {
+                        cur = CS_ROW(0, r, c);
+                        for (col = 0; col < width; col++)
+                            cur[col] = pix[col][2 * c] - pix[col][1];
+                    }
+                }
+                /* Advance every pass by one row. The borders that are
+                   never smoothed are carried over unchanged. */
+                for (pass = 1; pass <= passes; pass++) {
+                    row = r - pass;
+                    if (row < 0 || row >= height ||
+                            row < top - passes + pass || row >= bottom + passes - pass)
+                        continue;
+                    for (c = 0; c < 2; c++) {
+                        cur = CS_ROW(pass, row, c);
+                        prev = CS_ROW(pass - 1, row, c);
+                        if (row < 2 || row >= height - 2)
+                            memcpy(cur, prev, width * sizeof * cur);
+                        else
+                            color_smooth_row(cur, CS_ROW(pass - 1, row - 1, c), prev,
+                                             CS_ROW(pass - 1, row + 1, c),
+                                             image + row * width, width);
+                    }
+                }
+                /* Store a finished row. */
+                row = r - passes;
+                if (row < top || row >= bottom) continue;
+                pix = image + row * width;
+                if (row - top < passes || bottom - row <= passes) {
+                    slot = row - top < passes ? row - top : row - bottom + 2 * passes;
+                    for (c = 0; c < 2; c++) {
+                        cur = CS_ROW(passes, row, c);
+                        for (col = 2; col < width - 2; col++)
+                            edge[(band * 2 * passes + slot) * width + col][c] =
+                                cur[col] + pix[col][1];
+                    }
+                } else {
+                    for (c = 0; c < 2; c++) {
+                        cur = CS_ROW(passes, row, c);
+                        for (col = 2; col < width - 2; col++)
+                            pix[col][2 * c] = cur[col] + pix[col][1];
+                    }
+                }
             }
         }
+        free(buf);
+    } /* _OPENMP */
+#undef CS_ROW
+
+    for (band = 0; band < bands; band++) {
+        top = 2 + band * CS_BAND;
+        bottom = MIN(top + CS_BAND, height - 2);
+        for (row = top; row < bottom; row++) {
+            if (row - top >= passes && bottom - row > passes) continue;
+            slot = row - top < passes ? row - top : row - bottom + 2 * passes;
+            for (col = 2; col < width - 2; col++)
+                FORC(2) image[row * width + col][2 * c] =
+                    edge[(band * 2 * passes + slot) * width + col][c];
+        }
     }
+    free(edge);
 }
 
 void CLASS fuji_rotate_INDI(ushort(**image_p)[4], int *height_p,
@@ -16,11 +16,198 @@
 #include <string.h>
 #include <glib/gi18n.h>
 
+#ifndef _WIN32
+#include <unistd.h>    /* for fork */
+#include <sys/types.h>
+#include <sys/wait.h>  /* for waitpid */
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 static gboolean silentMessenger;
 char *ufraw_binary;
 
+int ufraw_batch_confirm(ufraw_data *uf);
 int ufraw_batch_saver(ufraw_data *uf);
 
+/* Load, convert and save a configured image. Returns TRUE on success. */
+static gboolean ufraw_batch_convert(ufraw_data *uf, const char *stat)
+{
+    if (ufraw_load_raw(uf) != UFRAW_SUCCESS)
+        return FALSE;
+    ufraw_message(UFRAW_MESSAGE, _("Loaded %s %s"), uf->filename, stat);
+    /* Nothing else is done with the image once it is saved. */
+    uf->streamExport = TRUE;
+    int status = ufraw_batch_saver(uf);
+    if (status == UFRAW_SUCCESS || status == UFRAW_WARNING) {
+        if (uf->conf->createID != only_id)
+            ufraw_message(UFRAW_MESSAGE, _("Saved %s %s"),
+                          uf->conf->outputFilename, stat);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+#ifndef _WIN32
+typedef struct {
+    pid_t pid;
+    gsize memory;
+} batch_job;
+
+/* Rough estimate of the peak memory needed to convert an opened image.
+ * The raw image, the interpolated first phase image and the developed
+ * output buffers all hold about four 16-bit channels per pixel. Every
+ * frame of a multi-frame raw is decoded into a buffer of its own at the
+ * same time, and a dark frame is another raw image of the same size. */
+static gsize ufraw_batch_memory(ufraw_data *uf)
+{
+    dcraw_data *raw = uf->raw;
+    gsize pixels = (gsize)uf->initialWidth * uf->initialHeight;
+    gsize memory = pixels * 4 * sizeof(guint16) * 3 +
+                   pixels * raw->frames * sizeof(guint16) + uf->unzippedBufLen;
+    if (strlen(uf->conf->darkframeFile) > 0)
+        memory += pixels * (4 + 1) * sizeof(guint16);
+    return memory;
+}
+
+/* Wait for one running job to finish and release its slot.
+ * Returns FALSE if the job failed. */
+static gboolean ufraw_batch_wait(batch_job *jobs, int *running,
+                                 gsize *inFlight)
+{
+    int status, i;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+        /* No children left, should not happen. */
+        *running = 0;
+        *inFlight = 0;
+        return FALSE;
+    }
+    for (i = 0; i < *running; i++)
+        if (jobs[i].pid == pid) break;
+    if (i < *running) {
+        *inFlight -= jobs[i].memory;
+        jobs[i] = jobs[--(*running)];
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Convert the files on the command line using up to 'jobCount' worker
+ * processes. The parent opens each file only to resolve its output name,
+ * ask about overwriting and estimate its memory use. It decodes nothing,
+ * not even the dark frame, so that no OpenMP threads exist when it forks.
+ * The conversion itself is done in a forked child, since dcraw keeps
+ * per-image global state.
+ * A new job is started only if the in-flight memory estimate stays below
+ * 'maxMemory' bytes, or if no other job is running. */
+static int ufraw_batch_parallel(int argc, char **argv, int optInd,
+                                conf_data *rc, conf_data *conf,
+                                conf_data *cmd, int jobCount, gsize maxMemory)
+{
+    batch_job *jobs = g_new(batch_job, jobCount);
+    int running = 0;
+    gsize inFlight = 0;
+    int exitCode = 0;
+    int fileCount = argc - optInd;
+    int fileIndex = 1;
+#ifdef _OPENMP
+    /* Split the processors between the jobs to avoid oversubscription. */
+    int threads = MAX(omp_get_num_procs() / jobCount, 1);
+#endif
+
+    for (; optInd < argc; optInd++, fileIndex++) {
+        char *argFile = uf_win32_locale_to_utf8(argv[optInd]);
+        char filename[max_path];
+        g_strlcpy(filename, argFile, max_path);
+        ufraw_data *uf = ufraw_open(argFile);
+        uf_win32_locale_free(argFile);
+        if (uf == NULL) {
+            exitCode = 1;
+            ufraw_message(UFRAW_REPORT, NULL);
+            continue;
+        }
+        uf->noDarkframe = TRUE;
+        int status = ufraw_config(uf, rc, conf, cmd);
+        if (uf->conf && uf->conf->createID == only_id && cmd->createID == -1)
+            uf->conf->createID = no_id;
+        if (status == UFRAW_ERROR) {
+            ufraw_close(uf);
+            g_free(uf);
+            while (running > 0)
+                ufraw_batch_wait(jobs, &running, &inFlight);
+            g_free(jobs);
+            return 1;
+        }
+        if (ufraw_batch_confirm(uf) != UFRAW_SUCCESS) {
+            exitCode = 1;
+            ufraw_close(uf);
+            g_free(uf);
+            continue;
+        }
+        gsize memory = ufraw_batch_memory(uf);
+        ufraw_close(uf);
+        g_free(uf);
+
+        while (running == jobCount ||
+                (running > 0 && maxMemory > 0 && inFlight + memory > maxMemory))
+            if (!ufraw_batch_wait(jobs, &running, &inFlight))
+                exitCode = 1;
+
+        /* Flush before forking so that buffered output is not duplicated. */
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid < 0) {
+            ufraw_message(UFRAW_ERROR, _("Failed to start a job for %s: %s"),
+                          filename, g_strerror(errno));
+            exitCode = 1;
+            continue;
+        }
+        if (pid == 0) {
+            /* Child process */
+#ifdef _OPENMP
+            omp_set_num_threads(threads);
+#endif
+            char stat[max_name];
+            if (fileCount > 1)
+                g_snprintf(stat, max_name, "[%d/%d]", fileIndex, fileCount);
+            else
+                stat[0] = '\0';
+            gboolean success = FALSE;
+            uf = ufraw_open(filename);
+            if (uf == NULL) {
+                ufraw_message(UFRAW_REPORT, NULL);
+                _exit(1);
+            }
+            status = ufraw_config(uf, rc, conf, cmd);
+            if (uf->conf && uf->conf->createID == only_id &&
+                    cmd->createID == -1)
+                uf->conf->createID = no_id;
+            if (status != UFRAW_ERROR) {
+                /* The parent already asked about overwriting. */
+                uf->conf->overwrite = TRUE;
+                success = ufraw_batch_convert(uf, stat);
+            }
+            ufraw_close_darkframe(uf->conf);
+            ufraw_close(uf);
+            g_free(uf);
+            fflush(stdout);
+            _exit(success ? 0 : 1);
+        }
+        jobs[running].pid = pid;
+        jobs[running].memory = memory;
+        running++;
+        inFlight += memory;
+    }
+    while (running > 0)
+        if (!ufraw_batch_wait(jobs, &running, &inFlight))
+            exitCode = 1;
+    g_free(jobs);
+    return exitCode;
+}
+#endif /* _WIN32 */
+
 int main(int argc, char **argv)
 {
     ufraw_data *uf;
@@ -62,6 +249,21 @@ int main(int argc, char **argv)
         ufraw_message(UFRAW_WARNING, _("No input file, nothing to do."));
     }
     int fileCount = argc - optInd;
+    int jobCount = cmd.jobs;
+#if GLIB_CHECK_VERSION(2,36,0)
+    if (jobCount == 0)
+        jobCount = g_get_num_processors();
+#endif
+    jobCount = MIN(MAX(jobCount, 1), MAX(fileCount, 1));
+#ifndef _WIN32
+    if (jobCount > 1 && strcmp(cmd.outputFilename, "-") != 0) {
+        exitCode = ufraw_batch_parallel(argc, argv, optInd, &rc, &conf, &cmd,
+                                        jobCount, (gsize)cmd.maxMemory << 20);
+        ufobject_delete(cmd.ufobject);
+        ufobject_delete(rc.ufobject);
+        exit(exitCode);
+    }
+#endif
     int fileIndex = 1;
     for (; optInd < argc; optInd++, fileIndex++) {
         argFile = uf_win32_locale_to_utf8(argv[optInd]);
@@ -82,27 +284,13 @@ int main(int argc, char **argv)
             g_free(uf);
             exit(1);
         }
-        if (ufraw_load_raw(uf) != UFRAW_SUCCESS) {
-            exitCode = 1;
-            ufraw_close_darkframe(uf->conf);
-            ufraw_close(uf);
-            g_free(uf);
-            continue;
-        }
         char stat[max_name];
         if (fileCount > 1)
             g_snprintf(stat, max_name, "[%d/%d]", fileIndex, fileCount);
         else
             stat[0] = '\0';
-        ufraw_message(UFRAW_MESSAGE, _("Loaded %s %s"), uf->filename, stat);
-        status = ufraw_batch_saver(uf);
-        if (status == UFRAW_SUCCESS || status == UFRAW_WARNING) {
-            if (uf->conf->createID != only_id)
-                ufraw_message(UFRAW_MESSAGE, _("Saved %s %s"),
-                              uf->conf->outputFilename, stat);
-        } else {
+        if (!ufraw_batch_convert(uf, stat))
             exitCode = 1;
-        }
         ufraw_close_darkframe(uf->conf);
         ufraw_close(uf);
         g_free(uf);
@@ -113,7 +301,9 @@ int main(int argc, char **argv)
     exit(exitCode);
 }
 
-int ufraw_batch_saver(ufraw_data *uf)
+/* Ask the user whether an existing output file may be overwritten.
+ * Returns UFRAW_CANCEL if the answer is no. */
+int ufraw_batch_confirm(ufraw_data *uf)
 {
     if (!uf->conf->overwrite && uf->conf->createID != only_id
             && strcmp(uf->conf->outputFilename, "-")
@@ -140,6 +330,13 @@ int ufraw_batch_saver(ufraw_data *uf)
         g_free(nChar);
         g_free(ans8);
     }
+    return UFRAW_SUCCESS;
+}
+
+int ufraw_batch_saver(ufraw_data *uf)
+{
+    if (ufraw_batch_confirm(uf) != UFRAW_SUCCESS)
+        return UFRAW_CANCEL;
     if (strcmp(uf->conf->outputFilename, "-")) {
         char *absname = uf_file_set_absolute(uf->conf->outputFilename);
         g_strlcpy(uf->conf->outputFilename, absname, max_path);
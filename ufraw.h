@@ -115,8 +115,8 @@ enum { linear_histogram, log_histogram };
  * in dcraw_api.h. */
 enum { ahd_interpolation, vng_interpolation, four_color_interpolation,
        ppg_interpolation, bilinear_interpolation, xtrans_interpolation,
-       none_interpolation, half_interpolation, obsolete_eahd_interpolation,
-       num_interpolations
+       xtrans_1pass_interpolation, none_interpolation, half_interpolation,
+       obsolete_eahd_interpolation, num_interpolations
      };
 enum { no_id, also_id, only_id, send_id };
 enum { manual_curve, linear_curve, custom_curve, camera_curve };
@@ -175,6 +175,9 @@ typedef struct {
     Intent intent[profile_types];
     gboolean updateTransform;
     void *colorTransform;
+    /* Optional 3D table sampled from colorTransform, see --color-lut */
+    gboolean useColorLut;
+    guint16 (*colorLut)[3];
     void *working2displayTransform;
     void *rgbtolabTransform;
     double saturation;
@@ -183,6 +186,15 @@ typedef struct {
 #endif
     CurveData baseCurveData, luminosityCurveData;
     guint16 gammaCurve[0x10000];
+    /* White balance, normalization and exposure of every raw value,
+     * as applied by develop_linear(). Values above linearClip[c] are
+     * clipped highlights that go through detail restoration. */
+    gint32 linearCurve[4][0x10000];
+    guint16 linearClip[4];
+    gboolean useLinearCurve;
+    /* The values linearCurve was built for */
+    int linearWB[4], linearRestoreDetails, linearClipHighlights;
+    unsigned linearMax, linearExposure, linearColors;
     void *luminosityProfile;
     void *TransferFunction[3];
     void *saturationProfile;
@@ -301,6 +313,9 @@ typedef struct {
     char curvePath[max_path];
     char profilePath[max_path];
     gboolean silent;
+    int jobs, maxMemory; /* ufraw-batch parallel jobs and memory budget (MB) */
+    gboolean colorLut; /* Approximate the color transform by a 3D table */
+    gboolean fastPreview; /* Demosaic the preview with the cheapest engine */
     char remoteGimpCommand[max_path];
 
     /* EXIF data */
@@ -316,15 +331,22 @@ typedef struct {
     char real_make[max_name], real_model[max_name];
 } conf_data;
 
+/* Most subareas an image is divided into, see
+ * ufraw_image_get_subarea_grid(). */
+#define UF_MAX_SUBAREAS 1024
+
 typedef struct {
     guint8 *buffer;
     int height, width, depth, rowstride;
-    /* This bit field marks valid pieces of the image with 1's.
-       The variable contains a fixed 4x8 matrix of bits, every bit containing
-       the validity of the respective subarea of the whole image. The subarea
-       sizes are determined by dividing the width by 4 and height by 8.
-       This field must always contain at least 32 bits. */
-    guint32 valid;
+    /* This bitset marks valid pieces of the image with 1's, one bit per
+       subarea of the whole image. The subarea grid is chosen from the
+       image size and omp_get_max_threads() by
+       ufraw_image_get_subarea_grid(), so the thread count must not change
+       while an image holds valid bits. The raw phase image has the raw
+       data dimensions, so its subareas do not cover the same pixels as
+       those of the later phases. The bitset has room for the largest grid
+       so that images can still be copied by value. */
+    guint32 valid[UF_MAX_SUBAREAS / 32];
     gboolean rgbg;
     gboolean invalidate_event;
 } ufraw_image_data;
@@ -368,6 +390,17 @@ typedef struct ufraw_struct {
     gboolean mark_hotpixels;
     unsigned raw_multiplier;
     gboolean wb_presets_make_model_match;
+    /* Let ufraw_write_image() use ufraw_convert_image_stream(). */
+    gboolean streamExport;
+    /* Let ufraw_config() leave conf->darkframeFile unloaded. */
+    gboolean noDarkframe;
+    /* Let ufraw_convert_image_area() demosaic with the cheapest engine.
+     * ufraw_convert_image() always uses the configured one. */
+    gboolean fastPreview;
+    /* Rows [bandY, bandY + band.height) of the first phase image,
+     * when it is converted in bands. */
+    ufraw_image_data band;
+    int bandY;
 } ufraw_data;
 
 extern const conf_data conf_default;
@@ -391,10 +424,14 @@ int ufraw_load_raw(ufraw_data *uf);
 int ufraw_load_darkframe(ufraw_data *uf);
 void ufraw_developer_prepare(ufraw_data *uf, DeveloperMode mode);
 int ufraw_convert_image(ufraw_data *uf);
+int ufraw_convert_image_stream(ufraw_data *uf);
+ufraw_image_type *ufraw_convert_image_rows(ufraw_data *uf, int y, int height);
 ufraw_image_data *ufraw_get_image(ufraw_data *uf, UFRawPhase phase,
                                   gboolean bufferok);
 ufraw_image_data *ufraw_convert_image_area(ufraw_data *uf, unsigned saidx,
         UFRawPhase phase);
+ufraw_image_data *ufraw_convert_image_area_scaled(ufraw_data *uf,
+        unsigned saidx, UFRawPhase phase, int scale);
 void ufraw_close_darkframe(conf_data *uf);
 void ufraw_close(ufraw_data *uf);
 void ufraw_flip_orientation(ufraw_data *uf, int flip);
@@ -417,9 +454,17 @@ void ufraw_get_image_dimensions(ufraw_data *uf);
 /* Get scaled crop coordinates in final image coordinates */
 void ufraw_get_scaled_crop(ufraw_data *uf, UFRectangle *crop);
 
+void ufraw_image_get_subarea_grid(ufraw_image_data *img, int *cols, int *rows);
+int ufraw_image_get_subarea_count(ufraw_image_data *img);
 UFRectangle ufraw_image_get_subarea_rectangle(ufraw_image_data *img,
         unsigned saidx);
 unsigned ufraw_img_get_subarea_idx(ufraw_image_data *img, int x, int y);
+gboolean ufraw_image_subarea_is_valid(ufraw_image_data *img, unsigned saidx);
+void ufraw_image_validate_subarea(ufraw_image_data *img, unsigned saidx);
+gboolean ufraw_image_is_valid(ufraw_image_data *img);
+gboolean ufraw_image_is_invalid(ufraw_image_data *img);
+void ufraw_image_validate(ufraw_image_data *img);
+void ufraw_image_invalidate(ufraw_image_data *img);
 
 /* prototypes for functions in ufraw_message.c */
 char *ufraw_get_message(ufraw_data *uf);
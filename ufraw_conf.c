@@ -133,6 +133,9 @@ const conf_data conf_default = {
     0, /* number of helper lines to draw */
     "", "", /* curvePath, profilePath */
     FALSE, /* silent */
+    1, 0, /* jobs, maxMemory */
+    FALSE, /* colorLut */
+    FALSE, /* fastPreview */
 #ifdef _WIN32
     "gimp-win-remote gimp-2.8.exe", /* remoteGimpCommand */
 #elif HAVE_GIMP_2_4
@@ -153,7 +156,8 @@ const conf_data conf_default = {
 };
 
 static const char *interpolationNames[] = {
-    "ahd", "vng", "four-color", "ppg", "bilinear", "xtrans", "none", "half",
+    "ahd", "vng", "four-color", "ppg", "bilinear", "xtrans", "xtrans-1pass",
+    "none", "half",
     "eahd", NULL
 };
 static const char *restoreDetailsNames[] =
@@ -654,6 +658,8 @@ static void conf_parse_text(GMarkupParseContext *context, const gchar *text,
         sscanf(temp, "%d", &c->drawLines);
     if (!strcmp("RememberOutputPath", element))
         sscanf(temp, "%d", &c->RememberOutputPath);
+    if (!strcmp("FastPreview", element))
+        sscanf(temp, "%d", &c->fastPreview);
     if (!strcmp("WindowMaximized", element))
         sscanf(temp, "%d", &c->WindowMaximized);
     if (!strcmp("WaveletDenoisingThreshold", element))
@@ -979,6 +985,9 @@ int conf_save(conf_data *c, char *IDFilename, char **confBuffer)
             buf = uf_markup_buf(buf,
                                 "<RememberOutputPath>%d</RememberOutputPath>\n",
                                 c->RememberOutputPath);
+        if (c->fastPreview != conf_default.fastPreview)
+            buf = uf_markup_buf(buf,
+                                "<FastPreview>%d</FastPreview>\n", c->fastPreview);
         if (c->WindowMaximized != conf_default.WindowMaximized)
             buf = uf_markup_buf(buf,
                                 "<WindowMaximized>%d</WindowMaximized>\n",
@@ -1516,6 +1525,7 @@ int conf_set_cmd(conf_data *conf, const conf_data *cmd)
     if (cmd->CropY2 != -1) conf->CropY2 = cmd->CropY2;
     if (cmd->aspectRatio != 0.0) conf->aspectRatio = cmd->aspectRatio;
     if (cmd->silent != -1) conf->silent = cmd->silent;
+    if (cmd->colorLut != -1) conf->colorLut = cmd->colorLut;
     if (cmd->compression != NULLF) conf->compression = cmd->compression;
     if (cmd->autoExposure) {
         conf->autoExposure = cmd->autoExposure;
@@ -1661,7 +1671,7 @@ char *helpText[] = {
     "                      Auto exposure or exposure correction in EV (default 0).\n"),
     N_("--black-point=auto|BLACK\n"
     "                      Auto black-point or black-point value (default 0).\n"),
-    N_("--interpolation=ahd|vng|four-color|ppg|bilinear\n"
+    N_("--interpolation=ahd|vng|four-color|ppg|bilinear|xtrans-1pass\n"
     "                      Interpolation algorithm to use (default ahd).\n"),
     N_("--color-smoothing     Apply color smoothing.\n"),
     N_("--grayscale=none|lightness|luminance|value|mixer\n"
@@ -1703,6 +1713,14 @@ char *helpText[] = {
     N_("--maximize-window     Force window to be maximized.\n"),
     N_("--silent              Do not display any messages during conversion. This\n"
     "                      option is only valid with 'ufraw-batch'.\n"),
+    N_("--jobs=N              Convert up to N files in parallel, 0 uses one job per\n"
+    "                      CPU. This option is only valid with 'ufraw-batch'\n"
+    "                      (default 1).\n"),
+    N_("--max-memory=MB       Do not start another parallel job if the estimated\n"
+    "                      memory of the running jobs would exceed MB megabytes,\n"
+    "                      0 means no limit (default 0).\n"),
+    N_("--color-lut           Apply the color profiles, curves and saturation through\n"
+    "                      a precomputed 3D table. Faster, but not exact.\n"),
     "\n",
     N_("UFRaw first reads the setting from the resource file $HOME/.ufrawrc.\n"
     "Then, if an ID file is specified, its setting are read. Next, the setting from\n"
@@ -1841,6 +1859,8 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
         { "crop-right", 1, 0, '3'},
         { "crop-bottom", 1, 0, '4'},
         { "aspect-ratio", 1, 0, 'P'},
+        { "jobs", 1, 0, 'J'},
+        { "max-memory", 1, 0, 'K'},
         /* Binary flags that don't have a value are here at the end */
         { "zip", 0, 0, 'z'},
         { "nozip", 0, 0, 'Z'},
@@ -1851,6 +1871,7 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
         { "noexif", 0, 0, 'F'},
         { "embedded-image", 0, 0, 'm'},
         { "silent", 0, 0, 'q'},
+        { "color-lut", 0, 0, 'Q'},
         { "help", 0, 0, 'h'},
         { "version", 0, 0, 'v'},
         { "batch", 0, 0, 'b'},
@@ -1880,7 +1901,7 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
         &createIDName, &outPath, &output, &darkframeFile,
         &restoreName, &clipName, &conf,
         &cmd->CropX1, &cmd->CropY1, &cmd->CropX2, &cmd->CropY2,
-        &cmd->aspectRatio
+        &cmd->aspectRatio, &cmd->jobs, &cmd->maxMemory
     };
     cmd->autoExposure = disabled_state;
     cmd->autoBlack = disabled_state;
@@ -1892,6 +1913,9 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
     cmd->profile[1][0].BitDepth = -1;
     cmd->embeddedImage = FALSE;
     cmd->silent = FALSE;
+    cmd->colorLut = FALSE;
+    cmd->jobs = 1;
+    cmd->maxMemory = 0;
     cmd->profile[0][0].gamma = NULLF;
     cmd->profile[0][0].linear = NULLF;
     cmd->hotpixel = NULLF;
@@ -1974,6 +1998,8 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
             case '2':
             case '3':
             case '4':
+            case 'J':
+            case 'K':
                 locale = uf_set_locale_C();
                 if (sscanf(optarg, "%d", (int *)optPointer[index]) == 0) {
                     ufraw_message(UFRAW_ERROR,
@@ -2017,6 +2043,9 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
             case 'q':
                 cmd->silent = TRUE;
                 break;
+            case 'Q':
+                cmd->colorLut = TRUE;
+                break;
             case 'z':
 #ifdef HAVE_LIBZ
                 cmd->losslessCompress = TRUE;
@@ -2405,6 +2434,18 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
             return -1;
         }
     }
+    if (cmd->jobs < 0) {
+        ufraw_message(UFRAW_ERROR,
+                      _("'%d' is not a valid value for the --%s option."),
+                      cmd->jobs, "jobs");
+        return -1;
+    }
+    if (cmd->maxMemory < 0) {
+        ufraw_message(UFRAW_ERROR,
+                      _("'%d' is not a valid value for the --%s option."),
+                      cmd->maxMemory, "max-memory");
+        return -1;
+    }
     cmd->createID = -1;
     if (createIDName != NULL) {
         if (!strcmp(createIDName, "no"))
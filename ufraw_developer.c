@@ -37,6 +37,10 @@ developer_data *developer_init()
     d->mode = -1;
     d->gamma = -1;
     d->linear = -1;
+    d->useLinearCurve = FALSE;
+    d->linearColors = 0;
+    d->useColorLut = FALSE;
+    d->colorLut = NULL;
     d->saturation = -1;
 #ifdef UFRAW_CONTRAST
     d->contrast = -1;
@@ -85,6 +89,7 @@ void developer_destroy(developer_data *d)
     cmsCloseProfile(d->adjustmentProfile);
     if (d->colorTransform != NULL)
         cmsDeleteTransform(d->colorTransform);
+    g_free(d->colorLut);
     if (d->working2displayTransform != NULL)
         cmsDeleteTransform(d->working2displayTransform);
     if (d->rgbtolabTransform != NULL)
@@ -394,6 +399,113 @@ static double findExpCoeff(double b)
     return a;
 }
 
+/* The color table has 33 nodes per channel, 2048 apart. The last node
+ * is sampled at 0xFFFF instead of 0x10000. */
+#define LUT_BITS 11
+#define LUT_SIZE ((0x10000 >> LUT_BITS) + 1)
+#define LUT_NODE(i) MIN((i) << LUT_BITS, 0xFFFF)
+
+static void developer_color_lut_apply(guint16 (*lut)[3],
+                                      guint16 *buf, int count)
+{
+    const int sr = LUT_SIZE * LUT_SIZE, sg = LUT_SIZE, sb = 1;
+    const int one = 1 << LUT_BITS;
+    int i, c;
+
+    for (i = 0; i < count; i++, buf += 3) {
+        int rx = buf[0] & (one - 1), gx = buf[1] & (one - 1);
+        int bx = buf[2] & (one - 1);
+        int base = (buf[0] >> LUT_BITS) * sr + (buf[1] >> LUT_BITS) * sg +
+                   (buf[2] >> LUT_BITS) * sb;
+        /* Tetrahedral interpolation: walk from the base corner to the
+         * opposite one along the edges of the largest fractions first. */
+        int w1, w2, w3, o1, o2;
+        if (rx >= gx) {
+            if (gx >= bx) {
+                w1 = rx; w2 = gx; w3 = bx; o1 = sr; o2 = sr + sg;
+            } else if (rx >= bx) {
+                w1 = rx; w2 = bx; w3 = gx; o1 = sr; o2 = sr + sb;
+            } else {
+                w1 = bx; w2 = rx; w3 = gx; o1 = sb; o2 = sr + sb;
+            }
+        } else {
+            if (rx >= bx) {
+                w1 = gx; w2 = rx; w3 = bx; o1 = sg; o2 = sr + sg;
+            } else if (gx >= bx) {
+                w1 = gx; w2 = bx; w3 = rx; o1 = sg; o2 = sg + sb;
+            } else {
+                w1 = bx; w2 = gx; w3 = rx; o1 = sb; o2 = sg + sb;
+            }
+        }
+        guint16 *p0 = lut[base], *p1 = lut[base + o1], *p2 = lut[base + o2];
+        guint16 *p3 = lut[base + sr + sg + sb];
+        for (c = 0; c < 3; c++) {
+            int v = (p0[c] << LUT_BITS) + w1 * (p1[c] - p0[c]) +
+                    w2 * (p2[c] - p1[c]) + w3 * (p3[c] - p2[c]);
+            buf[c] = LIM((v + one / 2) >> LUT_BITS, 0, 0xFFFF);
+        }
+    }
+}
+
+/* Sample colorTransform into d->colorLut and log how far the table is
+ * from the transform itself, as CIE76 color differences in the target
+ * profile, measured halfway between the nodes. */
+static void developer_color_lut(developer_data *d, int targetProfile)
+{
+    const int nodes = LUT_SIZE * LUT_SIZE * LUT_SIZE;
+    const int samples = (LUT_SIZE - 1) * (LUT_SIZE - 1) * (LUT_SIZE - 1);
+    int r, g, b, i;
+
+    d->colorLut = g_malloc(nodes * sizeof * d->colorLut);
+    for (r = 0, i = 0; r < LUT_SIZE; r++)
+        for (g = 0; g < LUT_SIZE; g++)
+            for (b = 0; b < LUT_SIZE; b++, i++) {
+                d->colorLut[i][0] = LUT_NODE(r);
+                d->colorLut[i][1] = LUT_NODE(g);
+                d->colorLut[i][2] = LUT_NODE(b);
+            }
+    cmsDoTransform(d->colorTransform, d->colorLut, d->colorLut, nodes);
+
+    guint16 (*exact)[3] = g_malloc(samples * sizeof * exact);
+    guint16 (*approx)[3] = g_malloc(samples * sizeof * approx);
+    for (r = 0, i = 0; r < LUT_SIZE - 1; r++)
+        for (g = 0; g < LUT_SIZE - 1; g++)
+            for (b = 0; b < LUT_SIZE - 1; b++, i++) {
+                exact[i][0] = LUT_NODE(r) + (1 << (LUT_BITS - 1));
+                exact[i][1] = LUT_NODE(g) + (1 << (LUT_BITS - 1));
+                exact[i][2] = LUT_NODE(b) + (1 << (LUT_BITS - 1));
+            }
+    memcpy(approx, exact, samples * sizeof * exact);
+    cmsDoTransform(d->colorTransform, exact, exact, samples);
+    developer_color_lut_apply(d->colorLut, approx[0], samples);
+
+    cmsHPROFILE labProfile = cmsCreateLab4Profile(NULL);
+    cmsHTRANSFORM toLab = cmsCreateTransform(d->profile[targetProfile],
+                          TYPE_RGB_16, labProfile, TYPE_Lab_DBL,
+                          INTENT_ABSOLUTE_COLORIMETRIC, 0);
+    cmsCloseProfile(labProfile);
+    if (toLab == NULL) {
+        g_free(exact);
+        g_free(approx);
+        return;
+    }
+    double maxDE = 0, sumDE = 0;
+    for (i = 0; i < samples; i++) {
+        cmsCIELab lab[2];
+        cmsDoTransform(toLab, exact[i], &lab[0], 1);
+        cmsDoTransform(toLab, approx[i], &lab[1], 1);
+        double dE = cmsDeltaE(&lab[0], &lab[1]);
+        maxDE = MAX(maxDE, dE);
+        sumDE += dE;
+    }
+    cmsDeleteTransform(toLab);
+    g_free(exact);
+    g_free(approx);
+    ufraw_message(UFRAW_SET_LOG,
+                  "Color table: max dE %.3f, mean dE %.3f\n",
+                  maxDE, sumDE / samples);
+}
+
 static void developer_create_transform(developer_data *d, DeveloperMode mode)
 {
     if (!d->updateTransform)
@@ -441,6 +553,10 @@ static void developer_create_transform(developer_data *d, DeveloperMode mode)
         d->colorTransform = cmsCreateMultiprofileTransform(prof, i,
                             TYPE_RGB_16, TYPE_RGB_16, d->intent[out_profile], 0);
     }
+    g_free(d->colorLut);
+    d->colorLut = NULL;
+    if (d->useColorLut && d->colorTransform != NULL)
+        developer_color_lut(d, targetProfile);
 
     if (d->working2displayTransform != NULL)
         cmsDeleteTransform(d->working2displayTransform);
@@ -466,6 +582,50 @@ static void developer_create_transform(developer_data *d, DeveloperMode mode)
     }
 }
 
+/* Tabulate the per channel part of develop_linear(), which costs two 64-bit
+ * divisions per channel and pixel otherwise. The table reproduces the
+ * arithmetic exactly and is disabled if a value does not fit in 32 bits. */
+static void developer_linear_curve(developer_data *d)
+{
+    unsigned c, i;
+    gint64 val;
+
+    if (d->colors == d->linearColors && d->max == d->linearMax &&
+            d->exposure == d->linearExposure &&
+            d->clipHighlights == d->linearClipHighlights &&
+            d->restoreDetails == d->linearRestoreDetails &&
+            memcmp(d->rgbWB, d->linearWB, d->colors * sizeof(int)) == 0)
+        return;
+    d->linearColors = d->colors;
+    d->linearMax = d->max;
+    d->linearExposure = d->exposure;
+    d->linearClipHighlights = d->clipHighlights;
+    d->linearRestoreDetails = d->restoreDetails;
+    memcpy(d->linearWB, d->rgbWB, d->colors * sizeof(int));
+    d->useLinearCurve = TRUE;
+    for (c = 0; c < d->colors; c++) {
+        d->linearClip[c] = 0xFFFF;
+        for (i = 0; i < 0x10000; i++) {
+            val = (gint64)i * d->rgbWB[c] / 0x10000;
+            if (d->restoreDetails != clip_details && val > d->max) {
+                if (d->linearClip[c] == 0xFFFF)
+                    d->linearClip[c] = i - 1;
+            } else {
+                val = MIN(val, d->max);
+            }
+            if (d->clipHighlights == film_highlights)
+                val = val * 0x10000 / d->max;
+            else
+                val = val * d->exposure / d->max;
+            if (val > G_MAXINT32) {
+                d->useLinearCurve = FALSE;
+                return;
+            }
+            d->linearCurve[c][i] = val;
+        }
+    }
+}
+
 static gboolean test_adjustments(const lightness_adjustment values[max_adjustments],
                                  gdouble reference, gdouble threshold)
 {
@@ -489,6 +649,12 @@ void developer_prepare(developer_data *d, conf_data *conf,
         d->mode = mode;
         d->updateTransform = TRUE;
     }
+    /* The auto-tools develop a few samples only, transform them exactly. */
+    gboolean useColorLut = conf->colorLut && mode != auto_developer;
+    if (useColorLut != d->useColorLut) {
+        d->useColorLut = useColorLut;
+        d->updateTransform = TRUE;
+    }
     in = &conf->profile[in_profile][conf->profileIndex[in_profile]];
     /* For auto-tools we create an sRGB output. */
     if (mode == auto_developer)
@@ -607,6 +773,7 @@ void developer_prepare(developer_data *d, conf_data *conf,
                 d->gammaCurve[i] = MIN(pow(a * BaseCurve[FilmCurve[i]] / 0x10000 + b,
                                            g) * 0x10000, 0xFFFF);
     }
+    developer_linear_curve(d);
     developer_profile(d, in_profile, in);
     developer_profile(d, out_profile, out);
     if (conf->intent[out_profile] != d->intent[out_profile]) {
@@ -873,7 +1040,9 @@ void develop(void *po, guint16 pix[4], developer_data *d, int mode, int count)
             for (c = 0; c < 3; c++)
                 buf[i * 3 + c] = d->gammaCurve[tmppix[c]];
         }
-        if (d->colorTransform != NULL)
+        if (d->colorLut != NULL)
+            developer_color_lut_apply(d->colorLut, buf + offset * 3, width);
+        else if (d->colorTransform != NULL)
             cmsDoTransform(d->colorTransform,
                            buf + offset * 3, buf + offset * 3, width);
     }
@@ -883,7 +1052,9 @@ void develop(void *po, guint16 pix[4], developer_data *d, int mode, int count)
         for (c = 0; c < 3; c++)
             buf[i * 3 + c] = d->gammaCurve[tmppix[c]];
     }
-    if (d->colorTransform != NULL)
+    if (d->colorLut != NULL)
+        developer_color_lut_apply(d->colorLut, buf, count);
+    else if (d->colorTransform != NULL)
         cmsDoTransform(d->colorTransform, buf, buf, count);
 #endif
 
@@ -944,7 +1115,13 @@ void develop_linear(guint16 in[4], guint16 out[3], developer_data *d)
     unsigned c;
     gint64 tmppix[4];
     gboolean clipped = FALSE;
-    for (c = 0; c < d->colors; c++) {
+    if (d->useLinearCurve) {
+        for (c = 0; c < d->colors; c++) {
+            tmppix[c] = d->linearCurve[c][in[c]];
+            if (in[c] > d->linearClip[c])
+                clipped = TRUE;
+        }
+    } else for (c = 0; c < d->colors; c++) {
         /* Set WB, normalizing tmppix[c]<0x10000 */
         tmppix[c] = in[c];
         tmppix[c] *= d->rgbWB[c];
@@ -40,6 +40,17 @@
 #ifdef _WIN32	/* GDK threads are not supported on the Windows platform. */
 #define gdk_threads_add_timeout g_timeout_add
 #define gdk_threads_add_idle_full g_idle_add_full
+#else
+/* The preview is rendered by a background thread, see render_thread(). */
+#define UF_RENDER_THREAD
+#endif
+
+#ifdef UF_RENDER_THREAD
+static GThread *RenderThread = NULL;
+static GMutex *RenderMutex;
+static GCond *RenderCond;
+/* Work posted to the main thread is dropped once this is NULL. */
+static preview_data *RenderData = NULL;
 #endif
 
 #ifdef __MINGW32__
@@ -126,10 +137,38 @@ void ufraw_focus(void *window, gboolean focus)
     }
 }
 
+#ifdef UF_RENDER_THREAD
+typedef struct {
+    char *message;
+    void *parentWindow;
+} posted_message;
+
+static gboolean ufraw_messenger_posted(posted_message *post)
+{
+    ufraw_messenger(post->message, RenderData != NULL ?
+                    post->parentWindow : NULL);
+    g_free(post->message);
+    g_free(post);
+    return FALSE;
+}
+#endif
+
 void ufraw_messenger(char *message,  void *parentWindow)
 {
     GtkDialog *dialog;
 
+#ifdef UF_RENDER_THREAD
+    /* Only the main thread may run dialogs. */
+    if (parentWindow != NULL && RenderThread != NULL &&
+            g_thread_self() == RenderThread) {
+        posted_message *post = g_new(posted_message, 1);
+        post->message = g_strdup(message);
+        post->parentWindow = parentWindow;
+        gdk_threads_add_idle_full(G_PRIORITY_HIGH_IDLE,
+                                  (GSourceFunc)(ufraw_messenger_posted), post, NULL);
+        return;
+    }
+#endif
     if (parentWindow == NULL) {
         ufraw_batch_messenger(message);
     } else {
@@ -818,6 +857,10 @@ static void render_status_text(preview_data *data)
 
 static gboolean render_raw_histogram(preview_data *data);
 static gboolean render_preview_image(preview_data *data);
+#ifdef UF_RENDER_THREAD
+static void render_thread_request(preview_data *data);
+static void render_thread_event(GdkEvent *event, preview_data *data);
+#endif
 static gboolean render_live_histogram(preview_data *data);
 static gboolean render_spot(preview_data *data);
 static void draw_spot(preview_data *data, gboolean draw);
@@ -917,16 +960,31 @@ static void preview_progress(int what, int ticks)
         case PROGRESS_SAVE:
             text = _("Saving image");
     }
+    if (!(ticks < 0 && text) && !events)
+        return;
+#ifdef UF_RENDER_THREAD
+    /* The render thread must take the GDK lock, while the main loop keeps
+     * running by itself. */
+    gboolean worker = RenderThread != NULL && g_thread_self() == RenderThread;
+    if (worker)
+        gdk_threads_enter();
+#else
+    gboolean worker = FALSE;
+#endif
     if (ticks < 0 && text)
         gtk_progress_bar_set_text(ProgressBar, text);
-    if (!events)
-        return;
-    fraction = todo ? start + (stop - start) * done / todo : 0;
-    if (fraction > stop)
-        fraction = stop;
-    gtk_progress_bar_set_fraction(ProgressBar, fraction);
-    while (gtk_events_pending())
-        gtk_main_iteration();
+    if (events) {
+        fraction = todo ? start + (stop - start) * done / todo : 0;
+        if (fraction > stop)
+            fraction = stop;
+        gtk_progress_bar_set_fraction(ProgressBar, fraction);
+        while (!worker && gtk_events_pending())
+            gtk_main_iteration();
+    }
+#ifdef UF_RENDER_THREAD
+    if (worker)
+        gdk_threads_leave();
+#endif
 }
 
 static void preview_progress_enable(preview_data *data)
@@ -953,6 +1011,7 @@ static gboolean render_preview_now(preview_data *data)
 
     while (g_idle_remove_by_data(data))
         ;
+    g_atomic_int_inc(&data->RenderGeneration);
     data->RenderSubArea = 0;
 
     if (data->UF->Images[ufraw_transform_phase].invalidate_event)
@@ -1008,20 +1067,28 @@ static gboolean render_preview_now(preview_data *data)
     data->FreezeDialog = FALSE;
     render_init(data);
 
+    preview_progress_enable(data);
+#ifdef UF_RENDER_THREAD
+    /* The render thread converts the untiled phases while the dialog is
+     * frozen, so the main loop keeps running meanwhile. */
+    data->FreezeDialog = TRUE;
+    render_thread_request(data);
+#else
     /* This will trigger the untiled phases if necessary. The progress bar
      * updates require gtk_main_iteration() calls which can only be
      * done when there are no pending idle tasks which could recurse
      * into ufraw_convert_image_area(). */
-    preview_progress_enable(data);
     data->FreezeDialog = TRUE;
     ufraw_convert_image_area(data->UF, 0, ufraw_first_phase);
     data->FreezeDialog = FALSE;
 
-    preview_progress(PROGRESS_RENDER, -32);
+    preview_progress(PROGRESS_RENDER, -ufraw_image_get_subarea_count(
+                         ufraw_get_image(data->UF, ufraw_display_phase, FALSE)));
     // Since we are already inside an idle callback, we should not use
     // gdk_threads_add_idle_full().
     g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
                     (GSourceFunc)(render_preview_image), data, NULL);
+#endif
 
     return FALSE;
 }
@@ -1030,6 +1097,8 @@ void render_preview(preview_data *data)
 {
     while (g_idle_remove_by_data(data))
         ;
+    /* Stop the rendering of tiles for the previous settings */
+    g_atomic_int_inc(&data->RenderGeneration);
     gdk_threads_add_idle_full(G_PRIORITY_DEFAULT_IDLE,
                               (GSourceFunc)(render_preview_now), data, NULL);
 }
@@ -1131,112 +1200,174 @@ static gboolean render_raw_histogram(preview_data *data)
     return FALSE;
 }
 
-static int choose_subarea(preview_data *data, int *chosen)
+typedef struct {
+    int subarea;
+    int visible;
+} subarea_order;
+
+static int subarea_order_compare(const void *a, const void *b)
 {
-    int subarea = -1;
-    int max_area = -1;
+    const subarea_order *sa = a, *sb = b;
+    if (sa->visible != sb->visible)
+        return sb->visible - sa->visible;
+    return sa->subarea - sb->subarea;
+}
 
-    /* First of all, find the maximally visible yet unrendered subarea.
-     * Refreshing visible subareas in the first place improves visual
-     * feedback and overall user experience.
-     */
+/* Fill queue with the unrendered subareas, most visible first, and return
+ * their number. Refreshing visible subareas in the first place improves
+ * visual feedback and overall user experience.
+ */
+static int queue_subareas(preview_data *data, subarea_order *queue)
+{
     ufraw_image_data *img = ufraw_get_image(data->UF,
                                             ufraw_display_phase, FALSE);
     GdkRectangle viewport;
     gtk_image_view_get_viewport(
         GTK_IMAGE_VIEW(data->PreviewWidget), &viewport);
 
-    int i;
-    for (i = 0; i < 32; i++) {
+    int i, n = 0;
+    int count = ufraw_image_get_subarea_count(img);
+    for (i = 0; i < count; i++) {
         /* Skip valid subareas */
-        if (img->valid & (1 << i))
+        if (ufraw_image_subarea_is_valid(img, i))
             continue;
-        /* Skip areas chosen by other threads */
-        if (*chosen & (1 << i))
-            continue;
-
 
         UFRectangle rec = ufraw_image_get_subarea_rectangle(img, i);
+        int x1 = MAX(rec.x, viewport.x);
+        int y1 = MAX(rec.y, viewport.y);
+        int x2 = MIN(rec.x + rec.width, viewport.x + viewport.width);
+        int y2 = MIN(rec.y + rec.height, viewport.y + viewport.height);
 
-        gboolean noclip = TRUE;
-        if (rec.x < viewport.x) {
-            rec.width -= (viewport.x - rec.x);
-            rec.x = viewport.x;
-            noclip = FALSE;
-        }
-        if (rec.x + rec.width > viewport.x + viewport.width) {
-            rec.width = viewport.x + viewport.width - rec.x;
-            noclip = FALSE;
-        }
-        if (rec.y < viewport.y) {
-            rec.height -= (viewport.y - rec.y);
-            rec.y = viewport.y;
-            noclip = FALSE;
-        }
-        if (rec.y + rec.height > viewport.y + viewport.height) {
-            rec.height = viewport.y + viewport.height - rec.y;
-            noclip = FALSE;
-        }
+        queue[n].subarea = i;
+        queue[n].visible = (x2 > x1 && y2 > y1) ? (x2 - x1) * (y2 - y1) : 0;
+        n++;
+    }
+    qsort(queue, n, sizeof(subarea_order), subarea_order_compare);
+    return n;
+}
 
-        /* Compute the visible area of the subarea */
-        int area = (rec.width > 0 && rec.height > 0) ? rec.width * rec.height : 0;
-        if (area > max_area) {
-            max_area = area;
-            subarea = i;
-            /* If this area is fully visible, stop searching */
-            if (noclip)
-                break;
-        }
+#ifdef UF_RENDER_THREAD
+typedef struct {
+    gint generation;
+    UFRectangle area;
+} posted_area;
+
+static gboolean render_draw_posted(posted_area *post)
+{
+    preview_data *data = RenderData;
+    /* The area might belong to a canvas that was since resized */
+    if (data != NULL &&
+            post->generation == g_atomic_int_get(&data->RenderGeneration))
+        preview_draw_area(data, post->area.x, post->area.y,
+                          post->area.width, post->area.height);
+    return FALSE;
+}
+#endif
+
+/* Draw a rendered subarea of the display image. The render thread posts
+ * it to the main thread, where it is dropped if rendering was restarted
+ * in the meantime. */
+static void render_draw_subarea(preview_data *data, ufraw_image_data *img,
+                                unsigned saidx)
+{
+    UFRectangle area = ufraw_image_get_subarea_rectangle(img, saidx);
+#ifdef UF_RENDER_THREAD
+    posted_area *post = g_new(posted_area, 1);
+    post->generation = g_atomic_int_get(&data->RenderGeneration);
+    post->area = area;
+    gdk_threads_add_idle_full(G_PRIORITY_HIGH_IDLE,
+                              (GSourceFunc)(render_draw_posted), post, g_free);
+#else
+    preview_draw_area(data, area.x, area.y, area.width, area.height);
+#endif
+}
+
+/* The coarse pass develops one pixel out of each block of this size. */
+#define PREVIEW_COARSE_SCALE 8
+
+/*
+ * Show a coarse version of the visible unrendered subareas, which is
+ * refined a subarea at a time by render_preview_image(). This is only
+ * possible for subareas whose develop phase input is still valid. That is
+ * the case after exposure, curve, color profile and other develop phase
+ * adjustments, and after any adjustment if the first phase is not tiled
+ * and there is no transform phase, since the untiled phases are converted
+ * before the first call. White balance, denoising and interpolation
+ * changes otherwise invalidate the tiles and get no coarse pass.
+ * Return TRUE if anything was drawn.
+ */
+static gboolean render_preview_coarse(preview_data *data,
+                                      subarea_order *queue, int n)
+{
+    gboolean drawn = FALSE;
+    int i;
+    for (i = 0; i < n && queue[i].visible > 0; i++) {
+        ufraw_image_data *img = ufraw_convert_image_area_scaled(data->UF,
+                                queue[i].subarea, ufraw_phases_num - 1,
+                                PREVIEW_COARSE_SCALE);
+        if (img == NULL)
+            continue;
+        render_draw_subarea(data, img, queue[i].subarea);
+        drawn = TRUE;
     }
-    if (subarea >= 0)
-        *chosen |= 1 << subarea;
-    return subarea;
+    return drawn;
 }
 
 /*
- * render_preview_image() is called after all non-tiled phases are rendered.
+ * render_preview_image() is called after all non-tiled phases are rendered,
+ * by the render thread with the GDK lock held or as an idle callback.
+ * Its first call shows a coarse version of the visible area, whatever the
+ * fast preview setting. A new render_preview() cancels the refinement.
  *
  * OpenMP notes:
  *
- * Unfortunately ufraw_convert_image_area() still has some OpenMP awareness
- * which is related to OpenMP here. That should not be necessary.
+ * Each call renders the most visible unrendered subareas, a couple of
+ * them per thread. The raw and first phases of these subareas are
+ * converted one subarea at a time, since their conversion uses all
+ * threads by itself. Their progress is not reported: it would run the GTK
+ * main loop from inside this idle callback, or take the GDK lock that the
+ * render thread already holds. The later phases are
+ * converted a subarea per iteration of a dynamically scheduled loop, so
+ * that threads which finish early take over the remaining subareas.
+ * Unfortunately ufraw_convert_image_area() still has some OpenMP
+ * awareness which is related to OpenMP here. That should not be necessary.
  */
 static gboolean render_preview_image(preview_data *data)
 {
-    gboolean again = FALSE;
-    int chosen = 0;
+    gboolean again;
 
     if (data->FreezeDialog) return FALSE;
-    int subarea[uf_omp_get_max_threads()];
+    subarea_order queue[UF_MAX_SUBAREAS];
+    int n = queue_subareas(data, queue);
     int i;
-    for (i = 0; i < uf_omp_get_max_threads(); i++)
-        subarea[i] = -1;
-#ifdef _OPENMP
-    #pragma omp parallel shared(chosen,data) reduction(||:again)
-    {
-        #pragma omp critical
-#endif
-        subarea[uf_omp_get_thread_num()] = choose_subarea(data, &chosen);
-        if (subarea[uf_omp_get_thread_num()] < 0) {
-            data->RenderSubArea = -1;
-        } else {
-            ufraw_convert_image_area(data->UF,
-                                     subarea[uf_omp_get_thread_num()], ufraw_phases_num - 1);
-            again = TRUE;
-        }
-
-#ifdef _OPENMP
+    if (data->RenderSubArea == 0) {
+        data->RenderSubArea = 1;
+        /* Not worth it if a single batch renders all that is visible. */
+        if (n > 2 * uf_omp_get_max_threads() &&
+                queue[2 * uf_omp_get_max_threads()].visible > 0 &&
+                render_preview_coarse(data, queue, n))
+            return TRUE;
     }
+    n = MIN(n, 2 * uf_omp_get_max_threads());
+    again = n > 0;
+    void (*saveProgress)(int what, int ticks) = ufraw_progress;
+    ufraw_progress = NULL;
+    for (i = 0; i < n; i++)
+        ufraw_convert_image_area(data->UF, queue[i].subarea, ufraw_first_phase);
+    ufraw_progress = saveProgress;
+    if (!again)
+        data->RenderSubArea = -1;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) shared(data,queue)
 #endif
+    for (i = 0; i < n; i++)
+        ufraw_convert_image_area(data->UF, queue[i].subarea,
+                                 ufraw_phases_num - 1);
     ufraw_image_data *img = ufraw_get_image(data->UF,
                                             ufraw_display_phase, FALSE);
-    for (i = 0; i < uf_omp_get_max_threads(); i++) {
-        if (subarea[i] >= 0) {
-            UFRectangle area = ufraw_image_get_subarea_rectangle(img,
-                               subarea[i]);
-            preview_draw_area(data, area.x, area.y, area.width, area.height);
-            progress(PROGRESS_RENDER, 1);
-        }
+    for (i = 0; i < n; i++) {
+        render_draw_subarea(data, img, queue[i].subarea);
+        progress(PROGRESS_RENDER, 1);
     }
     if (!again) {
         preview_progress_disable(data);
@@ -1250,6 +1381,145 @@ static gboolean render_preview_image(preview_data *data)
     return again;
 }
 
+#ifdef UF_RENDER_THREAD
+/*
+ * Render one generation of the preview in the render thread. The untiled
+ * phases are converted without the GDK lock, which is safe because the
+ * dialog is frozen. Then the tiles are rendered a batch at a time with the
+ * GDK lock held, so the main thread's handlers never see a half converted
+ * tile. Between batches the lock is released, letting the handlers run,
+ * and a new render_preview() stops this generation.
+ */
+static void render_thread_render(preview_data *data, gint generation)
+{
+    ufraw_convert_image_area(data->UF, 0, ufraw_first_phase);
+    preview_progress(PROGRESS_RENDER, -ufraw_image_get_subarea_count(
+                         ufraw_get_image(data->UF, ufraw_display_phase, FALSE)));
+
+    /* Unfreeze the dialog before releasing the input events held back by
+     * render_thread_event(), so that their handlers do not ignore them. */
+    gdk_threads_enter();
+    data->FreezeDialog = FALSE;
+    g_mutex_lock(RenderMutex);
+    data->RenderUntiled = FALSE;
+    g_cond_broadcast(RenderCond);
+    g_mutex_unlock(RenderMutex);
+    /* Adjustments made while the dialog was frozen only bumped the
+     * generation, their render_preview_now() gave up. */
+    if (generation != g_atomic_int_get(&data->RenderGeneration)) {
+        render_preview(data);
+        gdk_threads_leave();
+        return;
+    }
+    while (render_preview_image(data)) {
+        gdk_threads_leave();
+        g_thread_yield();
+        gdk_threads_enter();
+        if (generation != g_atomic_int_get(&data->RenderGeneration))
+            break;
+    }
+    gdk_threads_leave();
+}
+
+static gpointer render_thread(preview_data *data)
+{
+    gint generation = 0;
+
+    g_mutex_lock(RenderMutex);
+    for (;;) {
+        while (data->RenderRequest == generation)
+            g_cond_wait(RenderCond, RenderMutex);
+        if (data->RenderRequest < 0)
+            break;
+        generation = data->RenderRequest;
+        g_mutex_unlock(RenderMutex);
+        render_thread_render(data, generation);
+        g_mutex_lock(RenderMutex);
+    }
+    g_mutex_unlock(RenderMutex);
+    return NULL;
+}
+
+/* Ask the render thread to render the current generation. */
+static void render_thread_request(preview_data *data)
+{
+    if (RenderThread == NULL) {
+        RenderMutex = g_mutex_new();
+        RenderCond = g_cond_new();
+        data->RenderRequest = 0;
+        RenderData = data;
+        RenderThread = g_thread_create((GThreadFunc)(render_thread), data,
+                                       TRUE, NULL);
+        gdk_event_handler_set((GdkEventFunc)(render_thread_event), data,
+                              NULL);
+    }
+    g_mutex_lock(RenderMutex);
+    data->RenderRequest = g_atomic_int_get(&data->RenderGeneration);
+    data->RenderUntiled = TRUE;
+    g_cond_signal(RenderCond);
+    g_mutex_unlock(RenderMutex);
+}
+
+/* Wait until the render thread is done with the untiled phases. The
+ * caller holds the GDK lock, which the render thread may need meanwhile. */
+static void render_thread_wait(preview_data *data)
+{
+    if (RenderThread == NULL)
+        return;
+    gdk_threads_leave();
+    g_mutex_lock(RenderMutex);
+    while (data->RenderUntiled)
+        g_cond_wait(RenderCond, RenderMutex);
+    g_mutex_unlock(RenderMutex);
+    gdk_threads_enter();
+}
+
+/* Many handlers change CFG and invalidate the images without checking
+ * FreezeDialog. While the render thread converts the untiled phases they
+ * would race with it, so the main loop holds user input back until it is
+ * done. The progress bar is still drawn until such input arrives. */
+static void render_thread_event(GdkEvent *event, preview_data *data)
+{
+    switch (event->type) {
+        case GDK_DELETE:
+        case GDK_MOTION_NOTIFY:
+        case GDK_BUTTON_PRESS:
+        case GDK_2BUTTON_PRESS:
+        case GDK_3BUTTON_PRESS:
+        case GDK_BUTTON_RELEASE:
+        case GDK_KEY_PRESS:
+        case GDK_KEY_RELEASE:
+        case GDK_SCROLL:
+        case GDK_DRAG_MOTION:
+        case GDK_DROP_START:
+            render_thread_wait(data);
+            break;
+        default:
+            break;
+    }
+    gtk_main_do_event(event);
+}
+
+static void render_thread_stop(preview_data *data)
+{
+    if (RenderThread == NULL)
+        return;
+    gdk_event_handler_set((GdkEventFunc)(gtk_main_do_event), NULL, NULL);
+    g_mutex_lock(RenderMutex);
+    g_atomic_int_inc(&data->RenderGeneration);
+    data->RenderRequest = -1;
+    g_cond_signal(RenderCond);
+    g_mutex_unlock(RenderMutex);
+    gdk_threads_leave();
+    g_thread_join(RenderThread);
+    gdk_threads_enter();
+    RenderThread = NULL;
+    RenderData = NULL;
+    g_cond_free(RenderCond);
+    g_mutex_free(RenderMutex);
+}
+#endif
+
 static gboolean render_live_histogram(preview_data *data)
 {
     if (data->FreezeDialog) return FALSE;
@@ -3640,6 +3910,17 @@ static void options_dialog(preview_data *data)
     gtk_table_attach(settingsTable, blinkButton, 0, 2, 1, 2, GTK_FILL, 0, 0, 0);
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(blinkButton),
                                  CFG->blinkOverUnder);
+    // fastPreview toggle button
+    GtkWidget *fastPreviewButton = gtk_check_button_new_with_label(
+                                       _("Fast interpolation in the preview"));
+    gtk_table_attach(settingsTable, fastPreviewButton, 0, 2, 2, 3,
+                     GTK_FILL, 0, 0, 0);
+    gtk_widget_set_tooltip_text(fastPreviewButton,
+                                _("Use the quickest interpolation for the preview\n"
+                                  "and show a coarse preview first while rendering.\n"
+                                  "Saved images always use the selected interpolation."));
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(fastPreviewButton),
+                                 CFG->fastPreview);
 
     label = gtk_label_new(_("Configuration"));
     page = gtk_scrolled_window_new(NULL, NULL);
@@ -3753,6 +4034,9 @@ static void options_dialog(preview_data *data)
         if (CFG->blinkOverUnder !=
                 gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(blinkButton)))
             data->OptionsChanged = TRUE;
+        if (CFG->fastPreview !=
+                gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(fastPreviewButton)))
+            data->OptionsChanged = TRUE;
 
         if (!data->OptionsChanged) {
             /* If nothing changed there is nothing to do */
@@ -3762,6 +4046,12 @@ static void options_dialog(preview_data *data)
             g_strlcpy(RC->remoteGimpCommand, CFG->remoteGimpCommand, max_path);
             RC->blinkOverUnder = CFG->blinkOverUnder =
                                      gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(blinkButton));
+            RC->fastPreview = CFG->fastPreview =
+                                  gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(fastPreviewButton));
+            if (data->UF->fastPreview != CFG->fastPreview) {
+                data->UF->fastPreview = CFG->fastPreview;
+                ufraw_invalidate_layer(data->UF, ufraw_first_phase);
+            }
 
             /* Copy profiles and curves from CFG to RC and save .ufrawrc */
             if (memcmp(&RC->BaseCurve[RC->BaseCurveIndex],
@@ -4491,6 +4781,8 @@ static void whitebalance_fill_interface(preview_data *data,
         if (data->UF->IsXTrans) {
             uf_combo_box_append_text(combo, _("X-Trans interpolation"),
                                      (void*)xtrans_interpolation);
+            uf_combo_box_append_text(combo, _("X-Trans 1-pass interpolation"),
+                                     (void*)xtrans_1pass_interpolation);
         } else if (data->UF->colors == 4) {
             uf_combo_box_append_text(combo, _("VNG four color interpolation"),
                                      (void*)four_color_interpolation);
@@ -5538,6 +5830,7 @@ int ufraw_preview(ufraw_data *uf, conf_data *rc, int plugin,
 
     data->UF = uf;
     data->SaveFunc = save_func;
+    uf->fastPreview = uf->conf->fastPreview;
 
     data->rc = rc;
     data->SpotX1 = -1;
@@ -5931,12 +6224,17 @@ int ufraw_preview(ufraw_data *uf, conf_data *rc, int plugin,
 
     memset(data->raw_his, 0, sizeof(data->raw_his));
     data->RenderSubArea = -1;
+    data->RenderGeneration = 0;
+    data->RenderUntiled = FALSE;
     data->FreezeDialog = FALSE;
     data->RenderMode = render_default;
 
     /* This will start the conversion and enqueue rendering functions */
     update_scales(data);
     render_preview_now(data);
+#ifdef UF_RENDER_THREAD
+    render_thread_wait(data);
+#endif
     update_crop_ranges(data, FALSE);
 
     /* Collect raw histogram data */
@@ -5953,6 +6251,9 @@ int ufraw_preview(ufraw_data *uf, conf_data *rc, int plugin,
     data->OverUnderTicker = 0;
 
     gtk_main();
+#ifdef UF_RENDER_THREAD
+    render_thread_stop(data);
+#endif
     status = (uf_long)g_object_get_data(G_OBJECT(previewWindow),
                                         "WindowResponse");
     gtk_container_foreach(GTK_CONTAINER(previewVBox),
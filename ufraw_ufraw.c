@@ -29,6 +29,12 @@
 #ifdef HAVE_LIBBZ2
 #include <bzlib.h>
 #endif
+#ifdef _OPENMP
+#include <omp.h>
+#define uf_omp_get_max_threads() omp_get_max_threads()
+#else
+#define uf_omp_get_max_threads() 1
+#endif
 
 void (*ufraw_progress)(int what, int ticks) = NULL;
 
@@ -45,17 +51,20 @@ void ufraw_prepare_tca(ufraw_data *uf);
 static void ufraw_image_format(int *colors, int *bytes, ufraw_image_data *img,
                                const char *formats, const char *caller);
 static void ufraw_convert_image_raw(ufraw_data *uf, UFRawPhase phase);
-static void ufraw_convert_image_first(ufraw_data *uf, UFRawPhase phase);
+static void ufraw_convert_image_first(ufraw_data *uf, UFRawPhase phase,
+                                      int use);
 static void ufraw_convert_image_transform(ufraw_data *uf, ufraw_image_data *img,
         ufraw_image_data *outimg, UFRectangle *area);
 static void ufraw_convert_prepare_first_buffer(ufraw_data *uf,
         ufraw_image_data *img);
 static void ufraw_convert_prepare_transform_buffer(ufraw_data *uf,
         ufraw_image_data *img, int width, int height);
-static void ufraw_convert_reverse_wb(ufraw_data *uf, UFRawPhase phase);
+static void ufraw_convert_reverse_wb(ufraw_data *uf, ufraw_image_data *img);
+static int ufraw_calculate_scale(ufraw_data *uf);
 static void ufraw_convert_import_buffer(ufraw_data *uf, UFRawPhase phase,
                                         dcraw_image_data *dcimg);
 
+#ifndef HAVE_FMEMOPEN
 static int make_temporary(char *basefilename, char **tmpfilename)
 {
     int fd;
@@ -77,74 +86,95 @@ static ssize_t writeall(int fd, const char *buf, ssize_t size)
     return written;
 }
 
-static char *decompress_gz(char *origfilename)
+/* Without fmemopen() dcraw can only read from a file, so the decompressed
+ * data is written to a temporary file. */
+static char *write_temporary(char *origfilename, const gchar *buf, gsize len)
 {
-#ifdef HAVE_LIBZ
     char *tempfilename;
     int tmpfd;
-    gzFile gzfile;
-    char buf[8192];
-    ssize_t size;
     if ((tmpfd = make_temporary(origfilename, &tempfilename)) == -1)
         return NULL;
-    char *filename = uf_win32_locale_filename_from_utf8(origfilename);
-    gzfile = gzopen(filename, "rb");
-    uf_win32_locale_filename_free(filename);
-    if (gzfile != NULL) {
-        while ((size = gzread(gzfile, buf, sizeof buf)) > 0) {
-            if (writeall(tmpfd, buf, size) != size)
-                break;
-        }
-        gzclose(gzfile);
-        if (size == 0)
-            if (close(tmpfd) == 0)
-                return tempfilename;
-    }
+    if (writeall(tmpfd, buf, len) == (ssize_t)len)
+        if (close(tmpfd) == 0)
+            return tempfilename;
     close(tmpfd);
     g_unlink(tempfilename);
     g_free(tempfilename);
     return NULL;
+}
+#endif
+
+/* Decompress the whole file into memory. The buffer grows geometrically
+ * since the uncompressed size is not known in advance. */
+static gchar *decompress_gz(char *origfilename, gsize *len)
+{
+#ifdef HAVE_LIBZ
+    gzFile gzfile;
+    gsize size = 0, alloc = 1 << 20;
+    int n;
+    char *filename = uf_win32_locale_filename_from_utf8(origfilename);
+    gzfile = gzopen(filename, "rb");
+    uf_win32_locale_filename_free(filename);
+    if (gzfile == NULL)
+        return NULL;
+    gchar *buf = g_malloc(alloc);
+    while ((n = gzread(gzfile, buf + size, MIN(alloc - size, 1 << 30))) > 0) {
+        size += n;
+        if (size == alloc)
+            buf = g_realloc(buf, alloc *= 2);
+    }
+    gzclose(gzfile);
+    if (n < 0) {
+        g_free(buf);
+        return NULL;
+    }
+    *len = size;
+    return buf;
 #else
     (void)origfilename;
+    (void)len;
     ufraw_message(UFRAW_SET_ERROR,
                   "Cannot open gzip compressed images.\n");
     return NULL;
 #endif
 }
 
-static char *decompress_bz2(char *origfilename)
+static gchar *decompress_bz2(char *origfilename, gsize *len)
 {
 #ifdef HAVE_LIBBZ2
-    char *tempfilename;
-    int tmpfd;
     FILE *compfile;
     BZFILE *bzfile;
-    int bzerror;
-    char buf[8192];
-    ssize_t size;
+    int bzerror = BZ_OK;
+    gsize size = 0, alloc = 1 << 20;
+    gchar *buf;
+    int status;
 
-    if ((tmpfd = make_temporary(origfilename, &tempfilename)) == -1)
-        return NULL;
     compfile = g_fopen(origfilename, "rb");
-    if (compfile != NULL) {
-        if ((bzfile = BZ2_bzReadOpen(&bzerror, compfile, 0, 0, 0, 0)) != 0) {
-            while ((size = BZ2_bzRead(&bzerror, bzfile, buf, sizeof buf)) > 0)
-                if (writeall(tmpfd, buf, size) != size)
-                    break;
-            BZ2_bzReadClose(&bzerror, bzfile);
-            fclose(compfile);
-            if (size == 0) {
-                close(tmpfd);
-                return tempfilename;
-            }
-        }
+    if (compfile == NULL)
+        return NULL;
+    if ((bzfile = BZ2_bzReadOpen(&bzerror, compfile, 0, 0, 0, 0)) == 0) {
+        fclose(compfile);
+        return NULL;
     }
-    close(tmpfd);
-    g_unlink(tempfilename);
-    g_free(tempfilename);
-    return NULL;
+    buf = g_malloc(alloc);
+    while (bzerror == BZ_OK) {
+        size += BZ2_bzRead(&bzerror, bzfile, buf + size,
+                           MIN(alloc - size, 1 << 30));
+        if (size == alloc)
+            buf = g_realloc(buf, alloc *= 2);
+    }
+    status = bzerror;
+    BZ2_bzReadClose(&bzerror, bzfile);
+    fclose(compfile);
+    if (status != BZ_STREAM_END) {
+        g_free(buf);
+        return NULL;
+    }
+    *len = size;
+    return buf;
 #else
     (void)origfilename;
+    (void)len;
     ufraw_message(UFRAW_SET_ERROR,
                   "Cannot open bzip2 compressed images.\n");
     return NULL;
@@ -210,19 +240,38 @@ ufraw_data *ufraw_open(char *filename)
         filename = conf->inputFilename;
     }
     origfilename = filename;
+    gboolean compressed = TRUE;
     if (!strcasecmp(filename + strlen(filename) - 3, ".gz"))
-        filename = decompress_gz(filename);
+        unzippedBuf = decompress_gz(filename, &unzippedBufLen);
     else if (!strcasecmp(filename + strlen(filename) - 4, ".bz2"))
-        filename = decompress_bz2(filename);
-    if (filename == 0) {
-        ufraw_message(UFRAW_SET_ERROR,
-                      "Error creating temporary file for compressed data.");
+        unzippedBuf = decompress_bz2(filename, &unzippedBufLen);
+    else
+        compressed = FALSE;
+    if (compressed && unzippedBuf == NULL) {
+        ufraw_message(UFRAW_SET_ERROR, "Error decompressing %s.", filename);
         return NULL;
     }
+#ifndef HAVE_FMEMOPEN
+    if (compressed) {
+        filename = write_temporary(origfilename, unzippedBuf, unzippedBufLen);
+        if (filename == NULL) {
+            g_free(unzippedBuf);
+            ufraw_message(UFRAW_SET_ERROR,
+                          "Error creating temporary file for compressed data.");
+            return NULL;
+        }
+    }
+#endif
     raw = g_new(dcraw_data, 1);
-    status = dcraw_open(raw, filename);
+#ifdef HAVE_FMEMOPEN
+    /* The decompressed data stays in unzippedBuf until the raw image is
+     * loaded, dcraw reads it directly from there. */
+    if (compressed)
+        status = dcraw_open_buffer(raw, filename, unzippedBuf, unzippedBufLen);
+    else
+#endif
+        status = dcraw_open(raw, filename);
     if (filename != origfilename) {
-        g_file_get_contents(filename, &unzippedBuf, &unzippedBufLen, NULL);
         g_unlink(filename);
         g_free(filename);
         filename = origfilename;
@@ -248,7 +297,7 @@ ufraw_data *ufraw_open(char *filename)
         uf->Images[i].buffer = NULL;
         uf->Images[i].width = 0;
         uf->Images[i].height = 0;
-        uf->Images[i].valid = 0;
+        ufraw_image_invalidate(&uf->Images[i]);
         uf->Images[i].invalidate_event = TRUE;
     }
     uf->thumb.buffer = NULL;
@@ -510,8 +559,10 @@ int ufraw_config(ufraw_data *uf, conf_data *rc, conf_data *conf, conf_data *cmd)
     if (!uf->LoadingID) {
         g_snprintf(uf->conf->inputURI, max_path, "file://%s",
                    uf->conf->inputFilename);
+        /* raw->ifp might not be backed by a file descriptor */
         struct stat s;
-        fstat(fileno(raw->ifp), &s);
+        if (g_stat(uf->filename, &s) != 0)
+            s.st_mtime = 0;
         g_snprintf(uf->conf->inputModTime, max_name, "%d", (int)s.st_mtime);
     }
     if (strlen(uf->conf->outputFilename) == 0) {
@@ -527,8 +578,6 @@ int ufraw_config(ufraw_data *uf, conf_data *rc, conf_data *conf, conf_data *cmd)
         g_strlcpy(uf->conf->outputFilename, filename, max_path);
         g_free(filename);
     }
-    g_free(uf->unzippedBuf);
-    uf->unzippedBuf = NULL;
     /* Set the EXIF data */
 #ifdef __MINGW32__
     /* MinG32 does not have ctime_r(). */
@@ -614,7 +663,8 @@ int ufraw_config(ufraw_data *uf, conf_data *rc, conf_data *conf, conf_data *cmd)
                 uf->conf->BaseCurveIndex == camera_curve)
             uf->conf->BaseCurveIndex = linear_curve;
     }
-    ufraw_load_darkframe(uf);
+    if (!uf->noDarkframe)
+        ufraw_load_darkframe(uf);
 
     ufraw_get_image_dimensions(uf);
 
@@ -663,7 +713,12 @@ int ufraw_load_raw(ufraw_data *uf)
         uf->thumb.width = thumb.width;
         return ufraw_read_embedded(uf);
     }
-    if ((status = dcraw_load_raw(raw)) != DCRAW_SUCCESS) {
+    status = dcraw_load_raw(raw);
+    /* dcraw is done reading the input */
+    g_free(uf->unzippedBuf);
+    uf->unzippedBuf = NULL;
+    uf->unzippedBufLen = 0;
+    if (status != DCRAW_SUCCESS) {
         ufraw_message(UFRAW_SET_LOG, raw->message);
         ufraw_message(status, raw->message);
         if (status != DCRAW_WARNING) return status;
@@ -762,6 +817,7 @@ void ufraw_close(ufraw_data *uf)
     int i;
     for (i = ufraw_raw_phase; i < ufraw_phases_num; i++)
         g_free(uf->Images[i].buffer);
+    g_free(uf->band.buffer);
     g_free(uf->thumb.buffer);
     developer_destroy(uf->developer);
     developer_destroy(uf->AutoDeveloper);
@@ -779,21 +835,62 @@ void ufraw_close(ufraw_data *uf)
     ufraw_message(UFRAW_CLEAN, NULL);
 }
 
+/* Subareas are aimed at this many pixels on each side. */
+#define UF_SUBAREA_SIZE 512
+
+/* Return the subarea grid of an image. The grid is sized so that each
+ * subarea is roughly UF_SUBAREA_SIZE pixels on each side, but there are
+ * always at least 32 subareas and a few per thread, so that small images
+ * still spread over all threads and every thread can always find work.
+ */
+void ufraw_image_get_subarea_grid(ufraw_image_data *img, int *cols, int *rows)
+{
+    int width = MAX(img->width, 1);
+    int height = MAX(img->height, 1);
+    int minCount = MAX(32, 4 * uf_omp_get_max_threads());
+    minCount = MIN(minCount, UF_MAX_SUBAREAS);
+    int c = (width + UF_SUBAREA_SIZE - 1) / UF_SUBAREA_SIZE;
+    int r = (height + UF_SUBAREA_SIZE - 1) / UF_SUBAREA_SIZE;
+    // Refine the grid along its coarser side until it is fine enough.
+    while (c * r < minCount && (c < width || r < height)) {
+        if ((c < width && width * r >= height * c) || r >= height)
+            c++;
+        else
+            r++;
+    }
+    // Coarsen it the same way if the image is too large for the bitset.
+    while (c * r > UF_MAX_SUBAREAS) {
+        if ((c > 1 && width * r <= height * c) || r == 1)
+            c--;
+        else
+            r--;
+    }
+    *cols = MIN(c, width);
+    *rows = MIN(r, height);
+}
+
+int ufraw_image_get_subarea_count(ufraw_image_data *img)
+{
+    int cols, rows;
+    ufraw_image_get_subarea_grid(img, &cols, &rows);
+    return cols * rows;
+}
+
 /* Return the coordinates and the size of given image subarea.
- * There are always 32 subareas, numbered 0 to 31, ordered in a 4x8 matrix.
+ * Subareas are numbered row by row, see ufraw_image_get_subarea_grid().
  */
 UFRectangle ufraw_image_get_subarea_rectangle(ufraw_image_data *img,
         unsigned saidx)
 {
-    int saw = (img->width + 3) / 4;
-    int sah = (img->height + 7) / 8;
-    int sax = saidx % 4;
-    int say = saidx / 4;
+    int cols, rows;
+    ufraw_image_get_subarea_grid(img, &cols, &rows);
+    int sax = saidx % cols;
+    int say = saidx / cols;
     UFRectangle area;
-    area.x = saw * sax;
-    area.y = sah * say;
-    area.width = (sax < 3) ? saw : (img->width - saw * 3);
-    area.height = (say < 7) ? sah : (img->height - sah * 7);
+    area.x = sax * img->width / cols;
+    area.y = say * img->height / rows;
+    area.width = (sax + 1) * img->width / cols - area.x;
+    area.height = (say + 1) * img->height / rows - area.y;
     return area;
 }
 
@@ -801,9 +898,59 @@ UFRectangle ufraw_image_get_subarea_rectangle(ufraw_image_data *img,
  */
 unsigned ufraw_img_get_subarea_idx(ufraw_image_data *img, int x, int y)
 {
-    int saw = (img->width + 3) / 4;
-    int sah = (img->height + 7) / 8;
-    return (x / saw) + (y / sah) * 4;
+    int cols, rows;
+    ufraw_image_get_subarea_grid(img, &cols, &rows);
+    int width = MAX(img->width, 1);
+    int height = MAX(img->height, 1);
+    int sax = ((x + 1) * cols - 1) / width;
+    int say = ((y + 1) * rows - 1) / height;
+    sax = LIM(sax, 0, cols - 1);
+    say = LIM(say, 0, rows - 1);
+    return sax + say * cols;
+}
+
+gboolean ufraw_image_subarea_is_valid(ufraw_image_data *img, unsigned saidx)
+{
+    return (img->valid[saidx / 32] & (1U << (saidx % 32))) != 0;
+}
+
+void ufraw_image_validate_subarea(ufraw_image_data *img, unsigned saidx)
+{
+    img->valid[saidx / 32] |= 1U << (saidx % 32);
+}
+
+gboolean ufraw_image_is_valid(ufraw_image_data *img)
+{
+    int count = ufraw_image_get_subarea_count(img);
+    int i;
+    for (i = 0; i < count / 32; i++)
+        if (img->valid[i] != 0xffffffff)
+            return FALSE;
+    if (count % 32 != 0) {
+        guint32 mask = (1U << (count % 32)) - 1;
+        if ((img->valid[count / 32] & mask) != mask)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+gboolean ufraw_image_is_invalid(ufraw_image_data *img)
+{
+    int i;
+    for (i = 0; i < UF_MAX_SUBAREAS / 32; i++)
+        if (img->valid[i] != 0)
+            return FALSE;
+    return TRUE;
+}
+
+void ufraw_image_validate(ufraw_image_data *img)
+{
+    memset(img->valid, 0xff, sizeof(img->valid));
+}
+
+void ufraw_image_invalidate(ufraw_image_data *img)
+{
+    memset(img->valid, 0, sizeof(img->valid));
 }
 
 void ufraw_developer_prepare(ufraw_data *uf, DeveloperMode mode)
@@ -833,6 +980,17 @@ void ufraw_developer_prepare(ufraw_data *uf, DeveloperMode mode)
     }
 }
 
+static void ufraw_convert_auto_crop(ufraw_data *uf)
+{
+    if (uf->conf->autoCrop && !uf->LoadingID) {
+        ufraw_get_image_dimensions(uf);
+        uf->conf->CropX1 = (uf->rotatedWidth - uf->autoCropWidth) / 2;
+        uf->conf->CropX2 = uf->conf->CropX1 + uf->autoCropWidth;
+        uf->conf->CropY1 = (uf->rotatedHeight - uf->autoCropHeight) / 2;
+        uf->conf->CropY2 = uf->conf->CropY1 + uf->autoCropHeight;
+    }
+}
+
 int ufraw_convert_image(ufraw_data *uf)
 {
     uf->mark_hotpixels = FALSE;
@@ -841,7 +999,7 @@ int ufraw_convert_image(ufraw_data *uf)
 
     ufraw_image_data *img = &uf->Images[ufraw_first_phase];
     ufraw_convert_prepare_first_buffer(uf, img);
-    ufraw_convert_image_first(uf, ufraw_first_phase);
+    ufraw_convert_image_first(uf, ufraw_first_phase, dcraw_demosaic_export);
 
     UFRectangle area = { 0, 0, img->width, img->height };
     // prepare_transform has to be called before applying vignetting
@@ -861,16 +1019,134 @@ int ufraw_convert_image(ufraw_data *uf)
         *img = *img2;
         img2->buffer = NULL;
     }
-    if (uf->conf->autoCrop && !uf->LoadingID) {
-        ufraw_get_image_dimensions(uf);
-        uf->conf->CropX1 = (uf->rotatedWidth - uf->autoCropWidth) / 2;
-        uf->conf->CropX2 = uf->conf->CropX1 + uf->autoCropWidth;
-        uf->conf->CropY1 = (uf->rotatedHeight - uf->autoCropHeight) / 2;
-        uf->conf->CropY2 = uf->conf->CropY1 + uf->autoCropHeight;
-    }
+    ufraw_convert_auto_crop(uf);
     return UFRAW_SUCCESS;
 }
 
+/* Rows above and below a band that are demosaiced and smoothed only to
+ * give the band the same neighbourhood it has in the whole image. */
+#define BAND_OVERLAP 32
+/* Bands start on multiples of 48 rows, so that every CFA pattern
+ * (up to 16x16 for Leaf and 6x6 for X-Trans) and the half size raw
+ * buffer of Bayer sensors keep the phase they have in the whole image. */
+#define BAND_ALIGN 48
+#define BAND_HEIGHT 256
+
+/* The first phase image can be converted in bands if every step between
+ * the raw phase and the developer only looks at a few neighbouring rows:
+ * no resizing, no Fuji rotation, no transposition and no transform. */
+static gboolean ufraw_convert_image_streamable(ufraw_data *uf)
+{
+    dcraw_data *raw = uf->raw;
+    const dcraw_demosaic *engine = dcraw_demosaic_select(raw,
+                                   uf->conf->interpolation, dcraw_demosaic_export);
+
+    /* Every color smoothing pass widens the reach by a pixel. */
+    return uf->HaveFilters && ufraw_calculate_scale(uf) == 1 &&
+           engine != NULL && engine->tileable &&
+           engine->border + engine->smoothPasses <= BAND_OVERLAP &&
+           uf->conf->size == 0 && uf->conf->shrink <= 1 &&
+           raw->pixel_aspect == 1 && raw->fuji_width == 0 &&
+           !(uf->conf->orientation & 4) &&
+           !(uf->IsXTrans && uf->conf->threshold != 0) &&
+           uf->Images[ufraw_transform_phase].buffer == NULL;
+}
+
+/*
+ * Like ufraw_convert_image(), but when the settings allow it the first
+ * phase image is only sized here. Its rows are then converted on demand,
+ * a band at a time, by ufraw_convert_image_rows(). The raw data loaded by
+ * dcraw is released, so the image can not be converted a second time.
+ */
+int ufraw_convert_image_stream(ufraw_data *uf)
+{
+    ufraw_image_data *img = &uf->Images[ufraw_first_phase];
+    dcraw_data *raw = uf->raw;
+
+    ufraw_convert_prepare_first_buffer(uf, img);
+    ufraw_convert_prepare_transform_buffer(uf,
+            &uf->Images[ufraw_transform_phase], img->width, img->height);
+    if (!ufraw_convert_image_streamable(uf))
+        return ufraw_convert_image(uf);
+
+    uf->mark_hotpixels = FALSE;
+    ufraw_developer_prepare(uf, file_developer);
+    ufraw_convert_image_raw(uf, ufraw_raw_phase);
+    g_free(raw->raw.image);
+    raw->raw.image = NULL;
+
+    g_free(img->buffer);
+    img->buffer = NULL;
+    img->depth = sizeof(dcraw_image_type);
+    img->rowstride = img->width * img->depth;
+    ufraw_image_invalidate(img);
+    uf->bandY = 0;
+    uf->band.height = 0;
+    ufraw_convert_auto_crop(uf);
+    return UFRAW_SUCCESS;
+}
+
+/* Convert rows [y, y+height) of the first phase image into uf->band. */
+static void ufraw_convert_image_band(ufraw_data *uf, int y, int height)
+{
+    ufraw_image_data *img = &uf->Images[ufraw_first_phase];
+    ufraw_image_data *band = &uf->band;
+    dcraw_data *raw = uf->raw;
+    dcraw_data sub = *raw;
+    dcraw_image_data final;
+    int flip = uf->conf->orientation;
+    int top, bottom, shift, skip;
+
+    height = MIN(height, img->height - y);
+    /* Rows of the band in the image before flipping */
+    top = flip & 2 ? img->height - y - height : y;
+    bottom = MIN(top + height + BAND_OVERLAP, raw->height);
+    top = MAX(top - BAND_OVERLAP, 0) / BAND_ALIGN * BAND_ALIGN;
+    /* Bayer raw data is stored at half size, see dcraw_finalize_interpolate(). */
+    shift = raw->filters == 1 || raw->filters > 1000;
+    sub.height = bottom - top;
+    sub.raw.height = (sub.height + shift) >> shift;
+    sub.raw.image = (dcraw_image_type *)uf->Images[ufraw_raw_phase].buffer +
+                    (top >> shift) * raw->raw.width;
+
+    final.image = (dcraw_image_type *)band->buffer;
+    dcraw_finalize_interpolate(&final, &sub, uf->conf->interpolation,
+                               uf->conf->smoothing, dcraw_demosaic_export);
+    dcraw_flip_image(&final, flip);
+    skip = flip & 2 ? y - (img->height - bottom) : y - top;
+    memmove(final.image, final.image + skip * final.width,
+            height * final.width * sizeof(dcraw_image_type));
+
+    band->buffer = (guint8 *)final.image;
+    band->width = final.width;
+    band->height = height;
+    band->depth = sizeof(dcraw_image_type);
+    band->rowstride = band->width * band->depth;
+    band->rgbg = img->rgbg;
+    uf->bandY = y;
+    ufraw_convert_reverse_wb(uf, band);
+#ifdef HAVE_LENSFUN
+    if (uf->modifier != NULL && (uf->modFlags & LF_MODIFY_VIGNETTING))
+        lf_modifier_apply_color_modification(
+            uf->modifier, band->buffer, 0, y, band->width, band->height,
+            LF_CR_4(RED, GREEN, BLUE, UNKNOWN), band->rowstride);
+#endif
+}
+
+/* Return row y of the first phase image, making sure that the following
+ * height-1 rows are available too. */
+ufraw_image_type *ufraw_convert_image_rows(ufraw_data *uf, int y, int height)
+{
+    ufraw_image_data *img = &uf->Images[ufraw_first_phase];
+
+    if (img->buffer != NULL)
+        return (ufraw_image_type *)(img->buffer + y * img->rowstride);
+    if (y < uf->bandY || y + height > uf->bandY + uf->band.height)
+        ufraw_convert_image_band(uf, y, MAX(height, BAND_HEIGHT));
+    return (ufraw_image_type *)(uf->band.buffer +
+                                (y - uf->bandY) * uf->band.rowstride);
+}
+
 #ifdef HAVE_LENSFUN
 static void ufraw_convert_image_vignetting(ufraw_data *uf,
         ufraw_image_data *img, UFRectangle *area)
@@ -1236,14 +1512,15 @@ static int ufraw_calculate_scale(ufraw_data *uf)
 
 // Any change to ufraw_convertshrink() that might change the final image
 // dimensions should also be applied to ufraw_convert_prepare_first_buffer().
-static void ufraw_convertshrink(ufraw_data *uf, dcraw_image_data *final)
+static void ufraw_convertshrink(ufraw_data *uf, dcraw_image_data *final,
+                                int use)
 {
     dcraw_data *raw = uf->raw;
     int scale = ufraw_calculate_scale(uf);
 
     if (uf->HaveFilters && scale == 1)
         dcraw_finalize_interpolate(final, raw, uf->conf->interpolation,
-                                   uf->conf->smoothing);
+                                   uf->conf->smoothing, use);
     else
         dcraw_finalize_shrink(final, raw, scale);
 
@@ -1315,7 +1592,8 @@ static void ufraw_convert_image_raw(ufraw_data *uf, UFRawPhase phase)
  * Interface of ufraw_convertshrink() and dcraw_flip_image() should change
  * to accept a phase argument and no longer require type casts.
  */
-static void ufraw_convert_image_first(ufraw_data *uf, UFRawPhase phase)
+static void ufraw_convert_image_first(ufraw_data *uf, UFRawPhase phase,
+                                      int use)
 {
     ufraw_image_data *in = &uf->Images[phase - 1];
     ufraw_image_data *out = &uf->Images[phase];
@@ -1326,7 +1604,7 @@ static void ufraw_convert_image_first(ufraw_data *uf, UFRawPhase phase)
 
     dcraw_image_type *rawimage = raw->raw.image;
     raw->raw.image = (dcraw_image_type *)in->buffer;
-    ufraw_convertshrink(uf, &final);
+    ufraw_convertshrink(uf, &final, use);
     raw->raw.image = rawimage;
     dcraw_flip_image(&final, uf->conf->orientation);
     /* The threshold is scaled for compatibility */
@@ -1348,12 +1626,11 @@ static void ufraw_convert_image_first(ufraw_data *uf, UFRawPhase phase)
     out->rowstride = out->width * out->depth;
     out->buffer = (guint8 *)final.image;
 
-    ufraw_convert_reverse_wb(uf, phase);
+    ufraw_convert_reverse_wb(uf, out);
 }
 
-static void ufraw_convert_reverse_wb(ufraw_data *uf, UFRawPhase phase)
+static void ufraw_convert_reverse_wb(ufraw_data *uf, ufraw_image_data *img)
 {
-    ufraw_image_data *img = &uf->Images[phase];
     guint32 mul[4], px;
     guint16 *p16;
     int i, size, c;
@@ -1367,7 +1644,7 @@ static void ufraw_convert_reverse_wb(ufraw_data *uf, UFRawPhase phase)
     size = img->height * img->width;
 #ifdef _OPENMP
     #pragma omp parallel for schedule(static) \
-    shared(uf,phase,img,mul,size) \
+    shared(uf,img,mul,size) \
     private(i,p16,c,px)
 #endif
     for (i = 0; i < size; ++i) {
@@ -1381,6 +1658,208 @@ static void ufraw_convert_reverse_wb(ufraw_data *uf, UFRawPhase phase)
     }
 }
 
+/* Rows and columns around a raw phase subarea that are denoised with it,
+ * in raw phase pixels. The coarsest level of the wavelet denoise reaches
+ * 1+2+4+8+16 pixels. */
+#define RAW_OVERLAP 32
+
+/* The raw phase can be converted a subarea at a time unless one of its
+ * steps looks further than RAW_OVERLAP. Despeckling works on whole rows
+ * and columns, TCA moves pixels around and hot pixels are counted over
+ * the whole image. */
+static gboolean ufraw_convert_raw_tileable(ufraw_data *uf)
+{
+    return !ufraw_despeckle_active(uf) && uf->conf->hotpixel <= 0.0
+#ifdef HAVE_LENSFUN
+           && uf->TCAmodifier == NULL
+#endif
+           ;
+}
+
+/* The first phase can be converted a subarea at a time under the same
+ * conditions as in ufraw_convert_image_streamable(), except that the
+ * image may be shrunk. */
+static gboolean ufraw_convert_first_tileable(ufraw_data *uf, int use)
+{
+    dcraw_data *raw = uf->raw;
+
+    if (uf->HaveFilters && ufraw_calculate_scale(uf) == 1) {
+        const dcraw_demosaic *engine = dcraw_demosaic_select(raw,
+                                       uf->conf->interpolation, use);
+        if (engine == NULL || !engine->tileable ||
+                engine->border + engine->smoothPasses > BAND_OVERLAP)
+            return FALSE;
+    }
+    return uf->conf->size == 0 && raw->pixel_aspect == 1 &&
+           raw->fuji_width == 0 &&
+           !(uf->IsXTrans && uf->conf->threshold != 0) &&
+           uf->Images[ufraw_transform_phase].buffer == NULL;
+}
+
+/* Copy a window of an image that is 'width' pixels wide to a new buffer. */
+static dcraw_image_type *ufraw_copy_window(dcraw_image_type *image,
+        int width, UFRectangle *window)
+{
+    dcraw_image_type *copy = g_new(dcraw_image_type,
+                                   window->width * window->height);
+    int i;
+
+    for (i = 0; i < window->height; i++)
+        memcpy(copy + i * window->width,
+               image + (window->y + i) * width + window->x,
+               window->width * sizeof(dcraw_image_type));
+    return copy;
+}
+
+/* Convert subarea saidx of the raw phase image from a window of dcraw's
+ * raw data around it. */
+static void ufraw_convert_image_raw_area(ufraw_data *uf, unsigned saidx)
+{
+    ufraw_image_data *img = &uf->Images[ufraw_raw_phase];
+    dcraw_data *dark = uf->conf->darkframe ? uf->conf->darkframe->raw : NULL;
+    dcraw_data *raw = uf->raw;
+    dcraw_data sub = *raw, subDark;
+    UFRectangle area, window;
+    /* Bayer raw data is stored at half size, see dcraw_finalize_interpolate(). */
+    int shift = raw->filters == 1 || raw->filters > 1000;
+    int align = BAND_ALIGN >> shift;
+    /* The dark frame subtraction looks at the direct neighbours. */
+    int overlap = uf->conf->threshold > 0 ? RAW_OVERLAP : 1;
+    int i;
+
+    if (ufraw_image_subarea_is_valid(img, saidx))
+        return;
+    area = ufraw_image_get_subarea_rectangle(img, saidx);
+    window.x = MAX(area.x - overlap, 0) / align * align;
+    window.y = MAX(area.y - overlap, 0) / align * align;
+    window.width = MIN(area.x + area.width + overlap, img->width) - window.x;
+    window.height = MIN(area.y + area.height + overlap, img->height) - window.y;
+
+    sub.raw.width = window.width;
+    sub.raw.height = window.height;
+    sub.width = MIN(window.width << shift, raw->width - (window.x << shift));
+    sub.height = MIN(window.height << shift, raw->height - (window.y << shift));
+    sub.raw.image = ufraw_copy_window(raw->raw.image, raw->raw.width, &window);
+    if (dark != NULL) {
+        subDark = *dark;
+        subDark.raw.width = window.width;
+        subDark.raw.height = window.height;
+        subDark.raw.image = ufraw_copy_window(dark->raw.image,
+                                              dark->raw.width, &window);
+    }
+    /* The threshold is scaled for compatibility */
+    if (!uf->IsXTrans) dcraw_wavelet_denoise(&sub, uf->conf->threshold * sqrt(uf->raw_multiplier));
+    dcraw_finalize_raw(&sub, dark ? &subDark : NULL, uf->developer->rgbWB);
+
+    for (i = 0; i < area.height; i++)
+        memcpy(img->buffer + (area.y + i) * img->rowstride + area.x * img->depth,
+               sub.raw.image + (area.y - window.y + i) * window.width +
+               area.x - window.x, area.width * img->depth);
+    g_free(sub.raw.image);
+    if (dark != NULL)
+        g_free(subDark.raw.image);
+    ufraw_image_validate_subarea(img, saidx);
+}
+
+/*
+ * Convert subarea saidx of the first phase image from a window of the raw
+ * phase image, converting the raw phase subareas under the window first.
+ * The window starts on the CFA pattern grid and, when interpolating, adds
+ * BAND_OVERLAP pixels on every side, as ufraw_convert_image_band() does.
+ */
+static void ufraw_convert_image_first_area(ufraw_data *uf, unsigned saidx,
+        int use)
+{
+    ufraw_image_data *in = &uf->Images[ufraw_raw_phase];
+    ufraw_image_data *out = &uf->Images[ufraw_first_phase];
+    dcraw_data *raw = uf->raw;
+    dcraw_data sub = *raw;
+    dcraw_image_data final;
+    ufraw_image_data tile;
+    UFRectangle area = ufraw_image_get_subarea_rectangle(out, saidx);
+    UFRectangle window, rawWindow;
+    int flip = uf->conf->orientation;
+    int scale = ufraw_calculate_scale(uf);
+    int shift = raw->filters == 1 || raw->filters > 1000;
+    int overlap = uf->HaveFilters && scale == 1 ? BAND_OVERLAP : 0;
+    int width, height, top, left, bottom, right, t, i, j, skipX, skipY;
+    int cols, rows;
+    unsigned first, last;
+
+    /* The subarea in the image before flipping */
+    width = flip & 4 ? out->height : out->width;
+    height = flip & 4 ? out->width : out->height;
+    top = flip & 4 ? area.x : area.y;
+    left = flip & 4 ? area.y : area.x;
+    bottom = top + (flip & 4 ? area.width : area.height);
+    right = left + (flip & 4 ? area.height : area.width);
+    if (flip & 2) {
+        t = top;
+        top = height - bottom;
+        bottom = height - t;
+    }
+    if (flip & 1) {
+        t = left;
+        left = width - right;
+        right = width - t;
+    }
+    window.x = MAX(left - overlap, 0) / BAND_ALIGN * BAND_ALIGN;
+    window.y = MAX(top - overlap, 0) / BAND_ALIGN * BAND_ALIGN;
+    window.width = MIN(right + overlap, width) - window.x;
+    window.height = MIN(bottom + overlap, height) - window.y;
+
+    /* The same window in raw phase pixels */
+    sub.width = window.width * scale;
+    sub.height = window.height * scale;
+    rawWindow.x = window.x * scale >> shift;
+    rawWindow.y = window.y * scale >> shift;
+    rawWindow.width = sub.raw.width = (sub.width + shift) >> shift;
+    rawWindow.height = sub.raw.height = (sub.height + shift) >> shift;
+    first = ufraw_img_get_subarea_idx(in, rawWindow.x, rawWindow.y);
+    last = ufraw_img_get_subarea_idx(in,
+                                     MIN(rawWindow.x + rawWindow.width, in->width) - 1,
+                                     MIN(rawWindow.y + rawWindow.height, in->height) - 1);
+    ufraw_image_get_subarea_grid(in, &cols, &rows);
+    for (i = first / cols; i <= last / cols; i++)
+        for (j = first % cols; j <= last % cols; j++)
+            ufraw_convert_image_raw_area(uf, i * cols + j);
+    sub.raw.image = ufraw_copy_window((dcraw_image_type *)in->buffer,
+                                      in->width, &rawWindow);
+
+    final.image = NULL;
+    if (uf->HaveFilters && scale == 1)
+        dcraw_finalize_interpolate(&final, &sub, uf->conf->interpolation,
+                                   uf->conf->smoothing, use);
+    else
+        dcraw_finalize_shrink(&final, &sub, scale);
+    g_free(sub.raw.image);
+    dcraw_flip_image(&final, flip);
+
+    /* Where the subarea is in the flipped window */
+    top = flip & 2 ? height - window.y - window.height : window.y;
+    left = flip & 1 ? width - window.x - window.width : window.x;
+    skipX = area.x - (flip & 4 ? top : left);
+    skipY = area.y - (flip & 4 ? left : top);
+    for (i = 0; i < area.height; i++)
+        memmove(final.image + i * area.width,
+                final.image + (skipY + i) * final.width + skipX,
+                area.width * sizeof(dcraw_image_type));
+
+    tile = *out;
+    tile.buffer = (guint8 *)final.image;
+    tile.width = area.width;
+    tile.height = area.height;
+    tile.rowstride = tile.width * tile.depth;
+    ufraw_convert_reverse_wb(uf, &tile);
+#ifdef HAVE_LENSFUN
+    ufraw_convert_image_vignetting(uf, &tile, &area);
+#endif
+    for (i = 0; i < area.height; i++)
+        memcpy(out->buffer + (area.y + i) * out->rowstride + area.x * out->depth,
+               tile.buffer + i * tile.rowstride, tile.rowstride);
+    g_free(final.image);
+}
+
 #ifdef HAVE_LENSFUN
 /* Apply TCA */
 static void ufraw_convert_image_tca(ufraw_data *uf, ufraw_image_data *img,
@@ -1440,7 +1919,7 @@ static void ufraw_image_init(ufraw_image_data *img,
             img->depth == bitdepth && img->buffer != NULL)
         return;
 
-    img->valid = 0;
+    ufraw_image_invalidate(img);
     img->height = height;
     img->width = width;
     img->depth = bitdepth;
@@ -1689,7 +2168,10 @@ ufraw_image_data *ufraw_get_image(ufraw_data *uf, UFRawPhase phase,
 {
     ufraw_convert_prepare_buffers(uf, phase);
     // Find the closest phase that is actually rendered:
-    while (phase > ufraw_raw_phase && uf->Images[phase].buffer == NULL)
+    // (An exported first phase may be converted in bands, see
+    // ufraw_convert_image_stream().)
+    while (phase > ufraw_raw_phase && uf->Images[phase].buffer == NULL &&
+            !(phase == ufraw_first_phase && uf->streamExport))
         phase--;
 
     if (bufferok) {
@@ -1699,61 +2181,109 @@ ufraw_image_data *ufraw_get_image(ufraw_data *uf, UFRawPhase phase,
          * pixbuf. That can be fixed but is suboptimal anyway. The best
          * we can do is print a warning in case we need to finish the
          * conversion and finish it here. */
-        if (uf->Images[phase].valid != 0xffffffff) {
-            g_warning("%s: fixing unfinished conversion for phase %d.\n",
-                      G_STRFUNC, phase);
-            int i;
-            for (i = 0; i < 32; ++i)
+        if (!ufraw_image_is_valid(&uf->Images[phase])) {
+            /* The raw and first phases are not drawn, finishing them
+             * is harmless. */
+            if (phase > ufraw_first_phase)
+                g_warning("%s: fixing unfinished conversion for phase %d.\n",
+                          G_STRFUNC, phase);
+            int i, count = ufraw_image_get_subarea_count(&uf->Images[phase]);
+            for (i = 0; i < count; ++i)
                 ufraw_convert_image_area(uf, i, phase);
         }
     }
     return &uf->Images[phase];
 }
 
+/*
+ * The raw and first phases are converted a subarea at a time when
+ * ufraw_convert_first_tileable() allows it, and whole otherwise. Their
+ * subareas are converted one after the other, each using all threads, so
+ * this must not be called for them from a parallel region.
+ */
+static ufraw_image_data *ufraw_convert_image_area_first(ufraw_data *uf,
+        unsigned saidx, UFRawPhase phase)
+{
+    ufraw_image_data *in = &uf->Images[ufraw_raw_phase];
+    ufraw_image_data *out = &uf->Images[ufraw_first_phase];
+    dcraw_data *raw = uf->raw;
+    int use = uf->fastPreview ? dcraw_demosaic_preview : dcraw_demosaic_export;
+
+    // Tiling depends on whether the transform phase is skipped.
+    ufraw_convert_prepare_buffers(uf, ufraw_transform_phase);
+#ifdef HAVE_LENSFUN
+    if (ufraw_image_is_invalid(in))
+        ufraw_prepare_tca(uf);
+#endif
+    if (phase == ufraw_raw_phase || !ufraw_convert_first_tileable(uf, use)) {
+        if (!ufraw_image_is_valid(in)) {
+            ufraw_convert_image_raw(uf, ufraw_raw_phase);
+            ufraw_image_validate(in);
+        }
+        if (phase == ufraw_raw_phase)
+            return in;
+        ufraw_convert_image_first(uf, phase, use);
+        ufraw_image_validate(out);
+#ifdef HAVE_LENSFUN
+        UFRectangle allArea = { 0, 0, out->width, out->height };
+        ufraw_convert_image_vignetting(uf, out, &allArea);
+#endif /* HAVE_LENSFUN */
+        return out;
+    }
+    if (!ufraw_convert_raw_tileable(uf) && !ufraw_image_is_valid(in)) {
+        ufraw_convert_image_raw(uf, ufraw_raw_phase);
+        ufraw_image_validate(in);
+    }
+    /* No subarea is in use while the whole image is invalid, so this is
+     * where the buffers get their current size. */
+    if (ufraw_image_is_invalid(in)) {
+        in->width = raw->raw.width;
+        in->height = raw->raw.height;
+        in->depth = sizeof(dcraw_image_type);
+        in->rowstride = in->width * in->depth;
+        in->rgbg = raw->raw.colors == 4;
+        in->buffer = g_realloc(in->buffer, in->height * in->rowstride);
+        uf->hotpixels = 0;
+    }
+    if (ufraw_image_is_invalid(out)) {
+        out->depth = sizeof(dcraw_image_type);
+        out->rowstride = out->width * out->depth;
+        out->buffer = g_realloc(out->buffer, out->height * out->rowstride);
+    }
+    ufraw_convert_image_first_area(uf, saidx, use);
+    ufraw_image_validate_subarea(out, saidx);
+    return out;
+}
+
 ufraw_image_data *ufraw_convert_image_area(ufraw_data *uf, unsigned saidx,
         UFRawPhase phase)
 {
     int yy;
     ufraw_image_data *out = &uf->Images[phase];
 
-    if (out->valid & (1 << saidx))
+    if (ufraw_image_subarea_is_valid(out, saidx))
         return out; // the subarea has been already computed
 
+    if (phase <= ufraw_first_phase)
+        return ufraw_convert_image_area_first(uf, saidx, phase);
+
     /* Get the subarea image for previous phase */
-    ufraw_image_data *in = NULL;
-    if (phase > ufraw_raw_phase) {
-        in = ufraw_convert_image_area(uf, saidx, phase - 1);
-    }
+    ufraw_image_data *in = ufraw_convert_image_area(uf, saidx, phase - 1);
     // ufraw_convert_prepare_buffers() may set out->buffer to NULL.
     ufraw_convert_prepare_buffers(uf, phase);
-    if (phase > ufraw_first_phase && out->buffer == NULL)
+    if (out->buffer == NULL)
         return in; // skip phase
 
     /* Get subarea coordinates */
     UFRectangle area = ufraw_image_get_subarea_rectangle(out, saidx);
     guint8 *dest = out->buffer + area.y * out->rowstride + area.x * out->depth;
-    guint8 *src = NULL;
-    if (in != NULL)
-        src = in->buffer + area.y * in->rowstride + area.x * in->depth;
+    guint8 *src = in->buffer + area.y * in->rowstride + area.x * in->depth;
 
     switch (phase) {
-        case ufraw_raw_phase:
-            ufraw_convert_image_raw(uf, phase);
-            out->valid = 0xffffffff;
-            return out;
-
-        case ufraw_first_phase:
-            ufraw_convert_image_first(uf, phase);
-            out->valid = 0xffffffff;
-#ifdef HAVE_LENSFUN
-            UFRectangle allArea = { 0, 0, out->width, out->height };
-            ufraw_convert_image_vignetting(uf, out, &allArea);
-#endif /* HAVE_LENSFUN */
-            return out;
-
         case ufraw_transform_phase: {
             /* Area calculation is not needed at the moment since
-             * ufraw_first_phase is not tiled yet. */
+             * ufraw_first_phase is only tiled when there is no
+             * transform phase. */
             /*
                         int yy;
                         float *buff = g_new (float, (w < 8) ? 8 * 2 * 3 : w * 2 * 3);
@@ -1779,7 +2309,7 @@ ufraw_image_data *ufraw_convert_image_area(ufraw_data *uf, unsigned saidx,
                         for (yy = 0; yy < 8 * 2 * 3; yy += 2)
                         {
                             int idx = ufraw_img_get_subarea_idx (in, buff [yy], buff [yy + 1]);
-                            if (idx <= 31)
+                            if (idx < ufraw_image_get_subarea_count(in))
                                 ufraw_convert_image_area (uf, idx, phase - 1);
                         }
             */
@@ -1810,11 +2340,74 @@ ufraw_image_data *ufraw_convert_image_area(ufraw_data *uf, unsigned saidx,
     #pragma omp critical
 #endif
     // Mark the subarea as valid
-    out->valid |= (1 << saidx);
+    ufraw_image_validate_subarea(out, saidx);
 
     return out;
 }
 
+/*
+ * Convert a coarse approximation of subarea saidx of the develop or display
+ * phase image, for showing something while the subarea is still being
+ * converted. One pixel out of every scale x scale block is developed and
+ * fills its whole block. The subarea is not marked as valid, so it is fully
+ * converted later by ufraw_convert_image_area(). Only the develop and
+ * display phases are converted this way and only if their input is
+ * already valid, otherwise NULL is returned.
+ */
+ufraw_image_data *ufraw_convert_image_area_scaled(ufraw_data *uf,
+        unsigned saidx, UFRawPhase phase, int scale)
+{
+    ufraw_image_data *out = &uf->Images[phase];
+    ufraw_image_data *in, *dev, *disp;
+    int x, y, xx, yy, nb;
+
+    if (scale <= 1)
+        return ufraw_convert_image_area(uf, saidx, phase);
+    if (phase < ufraw_develop_phase)
+        return NULL;
+    if (ufraw_image_subarea_is_valid(out, saidx))
+        return out;
+    in = ufraw_get_image(uf, ufraw_transform_phase, FALSE);
+    if (!ufraw_image_subarea_is_valid(in, saidx))
+        return NULL;
+    ufraw_convert_prepare_buffers(uf, phase);
+    dev = &uf->Images[ufraw_develop_phase];
+    disp = phase == ufraw_display_phase &&
+           uf->Images[ufraw_display_phase].buffer != NULL ?
+           &uf->Images[ufraw_display_phase] : NULL;
+
+    UFRectangle area = ufraw_image_get_subarea_rectangle(dev, saidx);
+    nb = (area.width + scale - 1) / scale;
+    ufraw_image_type *pix = g_new(ufraw_image_type, nb);
+    guint8 *devRow = g_new(guint8, 2 * 3 * nb);
+    guint8 *dispRow = devRow + 3 * nb;
+    for (y = area.y; y < area.y + area.height; y += scale) {
+        int h = MIN(scale, area.y + area.height - y);
+        int sy = y + h / 2;
+        for (x = area.x, xx = 0; xx < nb; x += scale, xx++) {
+            int sx = x + MIN(scale, area.x + area.width - x) / 2;
+            memcpy(pix[xx], in->buffer + sy * in->rowstride + sx * in->depth,
+                   sizeof(ufraw_image_type));
+        }
+        develop(devRow, (void *)pix, uf->developer, 8, nb);
+        if (disp != NULL)
+            develop_display(dispRow, devRow, uf->developer, nb);
+        for (yy = y; yy < y + h; yy++) {
+            guint8 *d = dev->buffer + yy * dev->rowstride + area.x * 3;
+            for (xx = 0; xx < area.width; xx++, d += 3)
+                memcpy(d, devRow + xx / scale * 3, 3);
+            if (disp == NULL)
+                continue;
+            d = disp->buffer + yy * disp->rowstride + area.x * 3;
+            for (xx = 0; xx < area.width; xx++, d += 3)
+                memcpy(d, dispRow + xx / scale * 3, 3);
+        }
+    }
+    g_free(devRow);
+    g_free(pix);
+    return disp != NULL ? disp : dev;
+}
+
 static void ufraw_flip_image_buffer(ufraw_image_data *img, int flip)
 {
     if (img->buffer == NULL)
@@ -1961,12 +2554,16 @@ void ufraw_flip_image(ufraw_data *uf, int flip)
     UFRawPhase phase;
     for (phase = ufraw_first_phase; phase < ufraw_phases_num; phase++)
         ufraw_flip_image_buffer(&uf->Images[phase], flip);
+    /* The subareas of a partly converted first phase image do not map
+     * to those of the flipped one. */
+    if (!ufraw_image_is_valid(&uf->Images[ufraw_first_phase]))
+        ufraw_image_invalidate(&uf->Images[ufraw_first_phase]);
 }
 
 void ufraw_invalidate_layer(ufraw_data *uf, UFRawPhase phase)
 {
     for (; phase < ufraw_phases_num; phase++) {
-        uf->Images[phase].valid = 0;
+        ufraw_image_invalidate(&uf->Images[phase]);
         uf->Images[phase].invalidate_event = TRUE;
     }
 }
@@ -2005,7 +2602,7 @@ void ufraw_invalidate_despeckle_layer(ufraw_data *uf)
 void ufraw_invalidate_whitebalance_layer(ufraw_data *uf)
 {
     ufraw_invalidate_layer(uf, ufraw_develop_phase);
-    uf->Images[ufraw_raw_phase].valid = 0;
+    ufraw_image_invalidate(&uf->Images[ufraw_raw_phase]);
     uf->Images[ufraw_raw_phase].invalidate_event = TRUE;
 
     /* Despeckling is sensitive for WB changes because it is nonlinear. */
@@ -137,8 +137,16 @@ typedef struct {
 #endif /* HAVE_LENSFUN */
     long(*SaveFunc)();
     RenderModeType RenderMode;
-    /* Current subarea index (0-31). If negative, rendering has stopped */
+    /* Zero before the first render_preview_image() call, positive after it
+     * and negative when rendering has stopped */
     int RenderSubArea;
+    /* Bumped by render_preview(), rendering of older generations stops */
+    volatile gint RenderGeneration;
+    /* The generation the render thread was last asked to render, or -1
+     * when it should quit */
+    gint RenderRequest;
+    /* TRUE while the render thread converts the untiled phases */
+    gboolean RenderUntiled;
     /* Some actions update the progress bar while working, but meanwhile we
      * want to freeze all other actions. After we thaw the dialog we must
      * call update_scales() which was also frozen. */
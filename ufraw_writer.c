@@ -224,8 +224,7 @@ void ufraw_write_image_data(
 {
     int row, row0;
     int rowStride = uf->Images[ufraw_first_phase].width;
-    ufraw_image_type *rawImage =
-        (ufraw_image_type *)uf->Images[ufraw_first_phase].buffer;
+    ufraw_image_type *rawImage;
     int byteDepth = (bitDepth + 7) / 8;
     guint8 *pixbuf8 = g_new(guint8,
                             Crop->width * 3 * byteDepth * DEVELOP_BATCH);
@@ -233,6 +232,8 @@ void ufraw_write_image_data(
     progress(PROGRESS_SAVE, -Crop->height);
     for (row0 = 0; row0 < Crop->height; row0 += DEVELOP_BATCH) {
         progress(PROGRESS_SAVE, DEVELOP_BATCH);
+        int batchHeight = MIN(Crop->height - row0, DEVELOP_BATCH);
+        rawImage = ufraw_convert_image_rows(uf, Crop->y + row0, batchHeight);
 #ifdef _OPENMP
         #pragma omp parallel for default(shared) private(row)
 #endif
@@ -240,12 +241,11 @@ void ufraw_write_image_data(
             if (row + row0 >= Crop->height)
                 continue;
             guint8 *rowbuf = &pixbuf8[row * Crop->width * 3 * byteDepth];
-            develop(rowbuf, rawImage[(Crop->y + row + row0)*rowStride + Crop->x],
+            develop(rowbuf, rawImage[row * rowStride + Crop->x],
                     uf->developer, bitDepth, Crop->width);
             if (grayscaleMode)
                 grayscale_buffer(rowbuf, Crop->width, bitDepth);
         }
-        int batchHeight = MIN(Crop->height - row0, DEVELOP_BATCH);
         if (row_writer(uf, out, pixbuf8, row0, Crop->width, batchHeight,
                        grayscaleMode, bitDepth) != UFRAW_SUCCESS)
             break;
@@ -358,7 +358,10 @@ int ufraw_write_image(ufraw_data *uf)
             }
         }
     // TODO: error handling
-    ufraw_convert_image(uf);
+    if (uf->streamExport && uf->conf->type != fits_type)
+        ufraw_convert_image_stream(uf);
+    else
+        ufraw_convert_image(uf);
     UFRectangle Crop;
     ufraw_get_scaled_crop(uf, &Crop);
     volatile int BitDepth = uf->conf->profile[out_profile]